@@ -0,0 +1,370 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "archive.h"
+#include "history.h"
+
+/*
+ * Segment "x.log.STAMP" is compressed to "x.log.STAMP.gz.tmp", which is
+ * renamed to "x.log.STAMP.gz" when complete, and only then the original
+ * is removed. Work interrupted by exit is picked up by archive_scan()
+ * on the next start.
+ */
+#define ARCHIVE_BUFSZ	65536
+
+struct archive_job {
+	SIMPLEQ_ENTRY(archive_job)	 aj_entry;
+	char				 aj_path[PATH_MAX];
+};
+SIMPLEQ_HEAD(archive_jobs, archive_job);
+
+struct archive_reader {
+	int		 ar_fd;
+#ifdef HAVE_ZLIB
+	gzFile		 ar_gz;
+#endif
+};
+
+#ifdef HAVE_ZLIB
+int	 archive_level = 6;
+#else
+int	 archive_level = 0;
+#endif
+
+static struct archive_jobs	 archive_jobs =
+    SIMPLEQ_HEAD_INITIALIZER(archive_jobs);
+static pthread_mutex_t		 archive_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		 archive_cv = PTHREAD_COND_INITIALIZER;
+static pthread_t		 archive_thread;
+static int			 archive_running;
+static _Atomic int		 archive_stopping;
+
+#ifdef HAVE_ZLIB
+static void	*archive_main(void *arg);
+static void	 compress_file(const char *path);
+#endif
+static int	 has_suffix(const char *name, size_t len, const char *suffix);
+
+static int
+has_suffix(const char *name, size_t len, const char *suffix) {
+	size_t	 slen = strlen(suffix);
+
+	return len >= slen && strcmp(name + len - slen, suffix) == 0;
+}
+
+#ifdef HAVE_ZLIB
+static void
+compress_file(const char *path) {
+	gzFile		 gz;
+	ssize_t		 n = -1;
+	char		 tmppath[PATH_MAX], gzpath[PATH_MAX], mode[8];
+	char		*buf;
+	int		 fd, outfd;
+
+	if (snprintf(tmppath, sizeof(tmppath), "%s.gz.tmp", path) >=
+	    (int)sizeof(tmppath))
+		return;
+	if (snprintf(gzpath, sizeof(gzpath), "%s.gz", path) >=
+	    (int)sizeof(gzpath))
+		return;
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1) {
+		if (errno != ENOENT)
+			warn("%s", path);
+		return;
+	}
+	outfd = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+	if (outfd == -1) {
+		warn("%s", tmppath);
+		close(fd);
+		return;
+	}
+	snprintf(mode, sizeof(mode), "wb%d", archive_level);
+	if ((gz = gzdopen(outfd, mode)) == NULL) {
+		warnx("%s: cannot start compression", tmppath);
+		close(outfd);
+		goto fail;
+	}
+	if ((buf = malloc(ARCHIVE_BUFSZ)) == NULL)
+		err(1, __func__);
+	while (!atomic_load(&archive_stopping) &&
+	    (n = read(fd, buf, ARCHIVE_BUFSZ)) != 0) {
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("%s", path);
+			break;
+		}
+		if (gzwrite(gz, buf, (unsigned int)n) != (int)n) {
+			warnx("%s: compression failed", tmppath);
+			break;
+		}
+	}
+	free(buf);
+	if (gzclose(gz) != Z_OK || n != 0)
+		goto fail;
+	close(fd);
+	if (rename(tmppath, gzpath) == -1) {
+		warn("%s", gzpath);
+		unlink(tmppath);
+		return;
+	}
+	if (unlink(path) == -1)
+		warn("%s", path);
+	return;
+
+fail:
+	// interrupted by exit or failed; the segment is still there
+	close(fd);
+	unlink(tmppath);
+}
+
+static void *
+archive_main(void *arg) {
+	struct archive_job	*aj;
+
+	(void)arg;
+	pthread_mutex_lock(&archive_mtx);
+	for (;;) {
+		while (SIMPLEQ_EMPTY(&archive_jobs) &&
+		    !atomic_load(&archive_stopping))
+			pthread_cond_wait(&archive_cv, &archive_mtx);
+		if (atomic_load(&archive_stopping))
+			break;
+		aj = SIMPLEQ_FIRST(&archive_jobs);
+		SIMPLEQ_REMOVE_HEAD(&archive_jobs, aj_entry);
+		pthread_mutex_unlock(&archive_mtx);
+		compress_file(aj->aj_path);
+		free(aj);
+		pthread_mutex_lock(&archive_mtx);
+	}
+	pthread_mutex_unlock(&archive_mtx);
+	return NULL;
+}
+#endif
+
+/*
+ * Schedules compression of the given closed segment. May be called from
+ * the history writer thread, too.
+ */
+void
+archive_queue(const char *path) {
+#ifdef HAVE_ZLIB
+	struct archive_job	*aj;
+	int			 ec;
+
+	if (archive_level == 0)
+		return;
+	if ((aj = calloc(1, sizeof(struct archive_job))) == NULL)
+		err(1, __func__);
+	strlcpy(aj->aj_path, path, sizeof(aj->aj_path));
+	pthread_mutex_lock(&archive_mtx);
+	if (!archive_running && !atomic_load(&archive_stopping)) {
+		ec = pthread_create(&archive_thread, NULL, archive_main, NULL);
+		if (ec != 0) {
+			errno = ec;
+			err(1, "pthread_create");
+		}
+		archive_running = 1;
+	}
+	SIMPLEQ_INSERT_TAIL(&archive_jobs, aj, aj_entry);
+	pthread_cond_signal(&archive_cv);
+	pthread_mutex_unlock(&archive_mtx);
+#else
+	(void)path;
+#endif
+}
+
+/*
+ * Queues segments left uncompressed by previous runs, removing
+ * incomplete results of compression.
+ */
+void
+archive_scan(const char *dir) {
+	struct history_name	 hn;
+	struct dirent		*de;
+	DIR			*d;
+	size_t			 len;
+	char			 path[PATH_MAX];
+
+	if (archive_level == 0 || dir[0] == '\0' ||
+	    (d = opendir(dir)) == NULL)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		if (snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >=
+		    (int)sizeof(path))
+			continue;
+		len = strlen(de->d_name);
+		if (has_suffix(de->d_name, len, ".gz.tmp")) {
+			de->d_name[len - 7] = '\0';
+			if (history_parse_name(de->d_name, &hn) &&
+			    hn.hn_stamp != NULL)
+				(void)unlink(path);
+		} else if (history_parse_name(de->d_name, &hn) &&
+		    hn.hn_stamp != NULL && !hn.hn_gz)
+			archive_queue(path);
+	}
+	closedir(d);
+}
+
+/*
+ * Stops compression; unfinished work is redone on the next start.
+ */
+void
+archive_stop(void) {
+#ifdef HAVE_ZLIB
+	struct archive_job	*aj;
+
+	pthread_mutex_lock(&archive_mtx);
+	atomic_store(&archive_stopping, 1);
+	pthread_cond_signal(&archive_cv);
+	pthread_mutex_unlock(&archive_mtx);
+	if (archive_running)
+		pthread_join(archive_thread, NULL);
+	archive_running = 0;
+	while ((aj = SIMPLEQ_FIRST(&archive_jobs)) != NULL) {
+		SIMPLEQ_REMOVE_HEAD(&archive_jobs, aj_entry);
+		free(aj);
+	}
+#endif
+}
+
+/*
+ * Opens segment for reading, returns NULL with errno set on failure.
+ * Not compressed files are read as is.
+ */
+struct archive_reader *
+archive_open(const char *path) {
+	struct archive_reader	*ar;
+
+#ifndef HAVE_ZLIB
+	if (has_suffix(path, strlen(path), ".gz")) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+#endif
+	if ((ar = calloc(1, sizeof(struct archive_reader))) == NULL)
+		err(1, __func__);
+	if ((ar->ar_fd = open(path, O_RDONLY|O_CLOEXEC)) == -1) {
+		free(ar);
+		return NULL;
+	}
+#ifdef HAVE_ZLIB
+	if ((ar->ar_gz = gzdopen(ar->ar_fd, "rb")) == NULL) {
+		close(ar->ar_fd);
+		free(ar);
+		errno = ENOMEM;
+		return NULL;
+	}
+	gzbuffer(ar->ar_gz, ARCHIVE_BUFSZ);
+#endif
+	return ar;
+}
+
+/*
+ * Returns number of bytes read, 0 at end of file or -1 on error.
+ */
+ssize_t
+archive_read(struct archive_reader *ar, void *buf, size_t len) {
+#ifdef HAVE_ZLIB
+	int	 n;
+
+	if (len > INT_MAX)
+		len = INT_MAX;
+	if ((n = gzread(ar->ar_gz, buf, (unsigned int)len)) < 0) {
+		errno = EIO;
+		return -1;
+	}
+	return n;
+#else
+	ssize_t	 n;
+
+	while ((n = read(ar->ar_fd, buf, len)) == -1 && errno == EINTR)
+		;
+	return n;
+#endif
+}
+
+void
+archive_close(struct archive_reader *ar) {
+#ifdef HAVE_ZLIB
+	gzclose(ar->ar_gz);	// closes descriptor, too
+#else
+	close(ar->ar_fd);
+#endif
+	free(ar);
+}
+
+/*
+ * Returns NUL-terminated last maxlen bytes of segment, or NULL.
+ * Compressed ones are decoded in whole, keeping only the tail in memory.
+ * The cutp is set if something was skipped at the beginning.
+ */
+char *
+archive_tail(const char *path, size_t maxlen, size_t *lenp, int *cutp) {
+	struct archive_reader	*ar;
+	ssize_t			 n;
+	size_t			 len = 0, bufsz;
+	char			*buf;
+
+	if ((ar = archive_open(path)) == NULL)
+		return NULL;
+	// read in big pieces, then drop everything before the tail
+	bufsz = maxlen + ARCHIVE_BUFSZ;
+	if ((buf = malloc(bufsz + 1)) == NULL)
+		err(1, __func__);
+	*cutp = 0;
+	while ((n = archive_read(ar, buf + len, bufsz - len)) > 0) {
+		len += (size_t)n;
+		if (len == bufsz) {
+			memmove(buf, buf + len - maxlen, maxlen);
+			len = maxlen;
+			*cutp = 1;
+		}
+	}
+	archive_close(ar);
+	if (n == -1) {
+		warnx("%s: cannot decompress", path);
+		free(buf);
+		return NULL;
+	}
+	if (len > maxlen) {
+		memmove(buf, buf + len - maxlen, maxlen);
+		len = maxlen;
+		*cutp = 1;
+	}
+	buf[len] = '\0';
+	*lenp = len;
+	return buf;
+}
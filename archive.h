@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef OICB_ARCHIVE_H
+#define OICB_ARCHIVE_H
+
+#include <sys/types.h>
+
+/*
+ * Rotated history segments are compressed with gzip by a background
+ * thread, one at a time. Readers get segments decompressed on the fly,
+ * whether compressed already or not.
+ */
+
+struct archive_reader;
+
+void			 archive_queue(const char *path);
+void			 archive_scan(const char *dir);
+void			 archive_stop(void);
+struct archive_reader	*archive_open(const char *path);
+ssize_t			 archive_read(struct archive_reader *ar, void *buf,
+			    size_t len);
+void			 archive_close(struct archive_reader *ar);
+char			*archive_tail(const char *path, size_t maxlen,
+			    size_t *lenp, int *cutp);
+
+extern int	 archive_level;		// gzip level, 0 disables compression
+
+#endif // OICB_ARCHIVE_H
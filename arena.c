@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Tasks are carved from big chunks with a bump pointer; freeing a task
+ * only decrements the live counter of its chunk. Queues are processed in
+ * FIFO order, so chunks become empty in order, too, and get recycled.
+ * Once everything allocated from the arena is freed, the current chunk
+ * is rewound, so a drained queue is reset in O(1).
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "oicb.h"
+#include "arena.h"
+#include "metrics.h"
+
+#define ARENA_ALIGN	16
+#define ARENA_ROUND(x)	(((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena_chunk {
+	TAILQ_ENTRY(arena_chunk)	 ac_entry;
+	struct task_arena		*ac_arena;
+	size_t	 ac_size;	// usable bytes
+	size_t	 ac_used;	// bump offset
+	size_t	 ac_live;	// number of live tasks
+	struct icb_task	*ac_last;	// most recent allocation
+};
+#define CHUNK_HDRSZ	ARENA_ROUND(sizeof(struct arena_chunk))
+#define CHUNK_DATA(c)	((char *)(c) + CHUNK_HDRSZ)
+
+size_t		 arena_live_bytes, arena_peak_bytes;
+
+static struct arena_chunk	*chunk_new(struct task_arena *ta, size_t size);
+static void			 chunk_release(struct arena_chunk *ac);
+
+
+void
+task_arena_init(struct task_arena *ta, size_t chunksz) {
+	memset(ta, 0, sizeof(struct task_arena));
+	TAILQ_INIT(&ta->ta_chunks);
+	ta->ta_chunksz = chunksz;
+}
+
+/*
+ * Release all memory held by arena. There must be no live tasks.
+ */
+void
+task_arena_clear(struct task_arena *ta) {
+	struct arena_chunk	*ac;
+
+	if (ta->ta_live != 0)
+		errx(1, "%s: arena is still in use (internal error)", __func__);
+	while ((ac = TAILQ_FIRST(&ta->ta_chunks)) != NULL) {
+		TAILQ_REMOVE(&ta->ta_chunks, ac, ac_entry);
+		free(ac);
+	}
+	free(ta->ta_spare);
+	ta->ta_spare = NULL;
+}
+
+static struct arena_chunk *
+chunk_new(struct task_arena *ta, size_t size) {
+	struct arena_chunk	*ac;
+
+	if (size <= ta->ta_chunksz && ta->ta_spare != NULL) {
+		ac = ta->ta_spare;
+		ta->ta_spare = NULL;
+	} else {
+		if (size < ta->ta_chunksz)
+			size = ta->ta_chunksz;
+		if ((ac = malloc(CHUNK_HDRSZ + size)) == NULL)
+			err(1, __func__);
+		metrics.m_chunk_allocs++;
+		ac->ac_arena = ta;
+		ac->ac_size = size;
+	}
+	ac->ac_used = 0;
+	ac->ac_live = 0;
+	ac->ac_last = NULL;
+	TAILQ_INSERT_TAIL(&ta->ta_chunks, ac, ac_entry);
+	return ac;
+}
+
+/*
+ * Called when the last task in chunk was freed.
+ */
+static void
+chunk_release(struct arena_chunk *ac) {
+	struct task_arena	*ta = ac->ac_arena;
+
+	if (ac == TAILQ_LAST(&ta->ta_chunks, arena_chunk_list)) {
+		// current one, just rewind
+		ac->ac_used = 0;
+		ac->ac_last = NULL;
+		return;
+	}
+	TAILQ_REMOVE(&ta->ta_chunks, ac, ac_entry);
+	if (ta->ta_spare == NULL && ac->ac_size == ta->ta_chunksz)
+		ta->ta_spare = ac;
+	else
+		free(ac);
+}
+
+/*
+ * Allocate task able to hold datalen bytes. Only task header is zeroed.
+ */
+struct icb_task *
+task_alloc(struct task_arena *ta, size_t datalen) {
+	struct arena_chunk	*ac;
+	struct icb_task		*it;
+	size_t			 sz;
+
+	sz = ARENA_ROUND(sizeof(struct icb_task) + datalen);
+	ac = TAILQ_LAST(&ta->ta_chunks, arena_chunk_list);
+	if (ac == NULL || ac->ac_size - ac->ac_used < sz)
+		ac = chunk_new(ta, sz);
+
+	it = (struct icb_task *)(CHUNK_DATA(ac) + ac->ac_used);
+	memset(it, 0, sizeof(struct icb_task));
+	it->it_chunk = ac;
+	it->it_size = sz;
+	ac->ac_used += sz;
+	ac->ac_live++;
+	ac->ac_last = it;
+	metrics.m_task_allocs++;
+
+	ta->ta_live += sz;
+	if (ta->ta_live > ta->ta_peak)
+		ta->ta_peak = ta->ta_live;
+	arena_live_bytes += sz;
+	if (arena_live_bytes > arena_peak_bytes)
+		arena_peak_bytes = arena_live_bytes;
+	return it;
+}
+
+/*
+ * Returns number of data bytes the task may hold after task_resize().
+ * Only the most recent allocation in arena may grow.
+ */
+size_t
+task_room(const struct icb_task *it) {
+	const struct arena_chunk	*ac = it->it_chunk;
+	size_t				 avail;
+
+	avail = it->it_size - sizeof(struct icb_task);
+	if (ac->ac_last == it)
+		avail += ac->ac_size - ac->ac_used;
+	return avail;
+}
+
+/*
+ * Change amount of data bytes reserved by task, not exceeding task_room().
+ * Shrinking is effective for the most recent allocation only.
+ */
+void
+task_resize(struct icb_task *it, size_t datalen) {
+	struct arena_chunk	*ac = it->it_chunk;
+	struct task_arena	*ta = ac->ac_arena;
+	size_t			 sz;
+
+	if (datalen > task_room(it))
+		errx(1, "%s: no room for %zu bytes (internal error)",
+		    __func__, datalen);
+	sz = ARENA_ROUND(sizeof(struct icb_task) + datalen);
+	if (ac->ac_last != it)
+		return;
+	ac->ac_used = ac->ac_used - it->it_size + sz;
+	ta->ta_live = ta->ta_live - it->it_size + sz;
+	arena_live_bytes = arena_live_bytes - it->it_size + sz;
+	if (ta->ta_live > ta->ta_peak)
+		ta->ta_peak = ta->ta_live;
+	if (arena_live_bytes > arena_peak_bytes)
+		arena_peak_bytes = arena_live_bytes;
+	it->it_size = sz;
+}
+
+/*
+ * Returns the most recent task allocated from arena, if it's still alive.
+ */
+struct icb_task *
+task_arena_last(struct task_arena *ta) {
+	struct arena_chunk	*ac;
+
+	ac = TAILQ_LAST(&ta->ta_chunks, arena_chunk_list);
+	return ac ? ac->ac_last : NULL;
+}
+
+void
+task_free(struct icb_task *it) {
+	struct arena_chunk	*ac = it->it_chunk;
+
+	ac->ac_arena->ta_live -= it->it_size;
+	arena_live_bytes -= it->it_size;
+	if (ac->ac_last == it)
+		ac->ac_last = NULL;
+	if (--ac->ac_live == 0)
+		chunk_release(ac);
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef OICB_ARENA_H
+#define OICB_ARENA_H
+
+TAILQ_HEAD(arena_chunk_list, arena_chunk);
+struct task_arena {
+	struct arena_chunk_list	 ta_chunks;	// last one is current
+	struct arena_chunk	*ta_spare;	// cached empty chunk
+	size_t	 ta_chunksz;
+	size_t	 ta_live;	// bytes used by live tasks
+	size_t	 ta_peak;
+};
+
+void		 task_arena_init(struct task_arena *ta, size_t chunksz);
+void		 task_arena_clear(struct task_arena *ta);
+struct icb_task	*task_alloc(struct task_arena *ta, size_t datalen);
+size_t		 task_room(const struct icb_task *it);
+void		 task_resize(struct icb_task *it, size_t datalen);
+struct icb_task	*task_arena_last(struct task_arena *ta);
+void		 task_free(struct icb_task *it);
+
+extern size_t			 arena_live_bytes, arena_peak_bytes;
+extern struct task_arena	 stdout_arena;	// see push_stdout()
+
+#endif // OICB_ARENA_H
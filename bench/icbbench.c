@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Throughput benchmark for the incoming message path.
+ *
+ * A fake server thread writes synthetic traffic into one end of a socket
+ * pair; the other end is used as session socket, and messages go through
+ * get_next_icb_msg() and proceed_icb_msg() to the (discarded) terminal
+ * output and to chat history, like in the main loop.
+ *
+ * The main oicb.c is compiled in, with its main() renamed, so everything
+ * not exported is still reachable from here.
+ */
+
+#define main	oicb_main
+int	 main(int argc, char **argv);
+#include "../oicb.c"
+#undef main
+
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+
+struct bench_buf {
+	char	*bb_data;
+	size_t	 bb_len, bb_size;
+};
+
+struct bench_case {
+	const char	*bc_name;
+	size_t		 bc_count;	// messages at scale 1
+	size_t		(*bc_gen)(struct bench_buf *bb, size_t count);
+};
+
+struct bench_feed {
+	int			 bf_fd;
+	const struct bench_buf	*bf_buf;
+};
+
+static size_t	 gen_flood(struct bench_buf *bb, size_t count);
+static size_t	 gen_huge(struct bench_buf *bb, size_t count);
+static size_t	 gen_who(struct bench_buf *bb, size_t count);
+
+static const struct bench_case	bench_cases[] = {
+	{ "flood",	200000,	gen_flood },
+	{ "huge",	200,	gen_huge },
+	{ "who",	100000,	gen_who },
+};
+#define NCASES	(sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+static char	 bench_dir[] = "/tmp/icbbench.XXXXXX";
+
+static void		 bench_usage(void);
+static void		 bb_add(struct bench_buf *bb, const void *data,
+			    size_t len);
+static void		 bb_packet(struct bench_buf *bb, char type,
+			    const char *fmt, ...)
+			    __attribute__((__format__ (printf, 3, 4)));
+static void		*feed_thread(void *arg);
+static long long	 now_ns(void);
+static int		 cmp_ll(const void *a, const void *b);
+static void		 run_case(FILE *report, const struct bench_case *bc,
+			    size_t scale);
+static void		 cleanup_dir(void);
+
+static __dead void
+bench_usage(void) {
+	fprintf(stderr, "usage: %s [-H] [-o name=value[,...]] [-s scale]"
+	    " [case ...]\n", getprogname());
+	exit(1);
+}
+
+static void
+bb_add(struct bench_buf *bb, const void *data, size_t len) {
+	char	*p;
+	size_t	 nsize;
+
+	if (bb->bb_len + len > bb->bb_size) {
+		nsize = bb->bb_size ? bb->bb_size : 65536;
+		while (nsize < bb->bb_len + len)
+			nsize *= 2;
+		if ((p = realloc(bb->bb_data, nsize)) == NULL)
+			err(1, __func__);
+		bb->bb_data = p;
+		bb->bb_size = nsize;
+	}
+	memcpy(bb->bb_data + bb->bb_len, data, len);
+	bb->bb_len += len;
+}
+
+/*
+ * Appends message, split into extended packets like servers do:
+ * zero length byte, then type and 254 bytes of data in each but the last.
+ */
+static void
+bb_packet(struct bench_buf *bb, char type, const char *fmt, ...) {
+	va_list		 ap;
+	char		*data, *p;
+	unsigned char	 hdr[2];
+	int		 len;
+
+	va_start(ap, fmt);
+	len = vasprintf(&data, fmt, ap);
+	va_end(ap);
+	if (len == -1)
+		err(1, __func__);
+	len++;		// NUL ends the message
+	hdr[1] = (unsigned char)type;
+	for (p = data; len > 254; p += 254, len -= 254) {
+		hdr[0] = 0;
+		bb_add(bb, hdr, 2);
+		bb_add(bb, p, 254);
+	}
+	hdr[0] = (unsigned char)(len + 1);
+	bb_add(bb, hdr, 2);
+	bb_add(bb, p, (size_t)len);
+	free(data);
+}
+
+static size_t
+gen_flood(struct bench_buf *bb, size_t count) {
+	size_t	 i;
+
+	for (i = 0; i < count; i++)
+		bb_packet(bb, 'b', "user%zu\001message number %zu, with some"
+		    " words to wrap and log", i % 50, i);
+	return count;
+}
+
+static size_t
+gen_huge(struct bench_buf *bb, size_t count) {
+	size_t	 i;
+	char	*text;
+
+	if ((text = malloc(256 * 1024)) == NULL)
+		err(1, __func__);
+	memset(text, 'x', 256 * 1024 - 1);
+	text[256 * 1024 - 1] = '\0';
+	for (i = 0; i < count; i++)
+		bb_packet(bb, 'b', "user%zu\001%s", i % 50, text);
+	free(text);
+	return count;
+}
+
+/*
+ * "/who" listings of 1000 users each, with the end of output record.
+ */
+static size_t
+gen_who(struct bench_buf *bb, size_t count) {
+	size_t	 i, n = 0;
+
+	for (i = 0; i < count; i++) {
+		bb_packet(bb, 'i', "wl\001%c\001user%zu\001%zu\0010\001%zu"
+		    "\001ident%zu\001host%zu.example.org", (i % 1000) ? ' ' : 'm',
+		    i % 1000, i % 3600, 1600000000 + i, i % 1000, i % 1000);
+		n++;
+		if (i % 1000 == 999 || i == count - 1) {
+			bb_packet(bb, 'i', "ec\001");
+			n++;
+		}
+	}
+	return n;
+}
+
+static void *
+feed_thread(void *arg) {
+	const struct bench_feed	*bf = arg;
+	size_t			 ndone = 0;
+	ssize_t			 n;
+
+	while (ndone < bf->bf_buf->bb_len) {
+		n = write(bf->bf_fd, bf->bf_buf->bb_data + ndone,
+		    bf->bf_buf->bb_len - ndone);
+		if (n == -1)
+			err(1, "feed");
+		ndone += (size_t)n;
+	}
+	return NULL;
+}
+
+static long long
+now_ns(void) {
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int
+cmp_ll(const void *a, const void *b) {
+	long long	 x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Latency is the time spent on a single message, from asking for it
+ * till its handler returned, including socket read when needed.
+ * Rendering and history writes are done between reads, as in the main
+ * loop, and are accounted in throughput only.
+ */
+static void
+run_case(FILE *report, const struct bench_case *bc, size_t scale) {
+	struct bench_buf	 bb = { NULL, 0, 0 };
+	struct bench_feed	 bf;
+	struct icb_session	*s;
+	struct pollfd		 pfd;
+	pthread_t		 feeder;
+	unsigned long long	 allocs, chunks;
+	long long		*lat, start, t, elapsed;
+	size_t			 nmsgs, ndone = 0;
+	int			 sv[2];
+	char			*msg;
+	size_t			 msglen;
+
+	nmsgs = bc->bc_gen(&bb, bc->bc_count * scale);
+	if ((lat = reallocarray(NULL, nmsgs, sizeof(long long))) == NULL)
+		err(1, __func__);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+		err(1, "socketpair");
+	if (fcntl(sv[0], F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+
+	s = session;
+	s->is_sock = sv[0];
+	s->is_state = Chat;
+	s->is_rx_head = s->is_rx_fill = 0;
+	bf.bf_fd = sv[1];
+	bf.bf_buf = &bb;
+
+	allocs = metrics.m_task_allocs;
+	chunks = metrics.m_chunk_allocs;
+	start = now_ns();
+	if (pthread_create(&feeder, NULL, feed_thread, &bf) != 0)
+		errx(1, "pthread_create");
+	while (ndone < nmsgs) {
+		t = now_ns();
+		if ((msg = get_next_icb_msg(s, &msglen)) == NULL) {
+			clock_update();
+			render_stdout();
+			proceed_history();
+			pfd.fd = sv[0];
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, -1) == -1)
+				err(1, "poll");
+			continue;
+		}
+		proceed_icb_msg(msg, msglen);
+		lat[ndone++] = now_ns() - t;
+	}
+	clock_update();
+	want_exit = 1;		// render everything left at once
+	render_stdout();
+	want_exit = 0;
+	history_write_all();
+	elapsed = now_ns() - start;
+	pthread_join(feeder, NULL);
+	close(sv[0]);
+	close(sv[1]);
+	s->is_sock = -1;
+
+	qsort(lat, nmsgs, sizeof(long long), cmp_ll);
+	fprintf(report, "%-6s %8zu msgs %8.1f MB %10.0f msg/s"
+	    "  p50 %7.2f us  p99 %8.2f us  %.3f tasks/msg  %.4f chunks/msg\n",
+	    bc->bc_name, nmsgs, (double)bb.bb_len / (1024 * 1024),
+	    (double)nmsgs * 1e9 / (double)elapsed,
+	    (double)lat[nmsgs / 2] / 1000,
+	    (double)lat[nmsgs - 1 - nmsgs / 100] / 1000,
+	    (double)(metrics.m_task_allocs - allocs) / (double)nmsgs,
+	    (double)(metrics.m_chunk_allocs - chunks) / (double)nmsgs);
+	fflush(report);
+	free(lat);
+	free(bb.bb_data);
+}
+
+static void
+cleanup_dir(void) {
+	DIR		*dir;
+	struct dirent	*de;
+	char		 path[PATH_MAX];
+
+	if ((dir = opendir(bench_dir)) == NULL)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", bench_dir, de->d_name);
+		(void)unlink(path);
+	}
+	closedir(dir);
+	(void)rmdir(bench_dir);
+}
+
+int
+main(int argc, char **argv) {
+	FILE		*report;
+	size_t		 i, scale = 1;
+	int		 ch, devnull, found;
+	const char	*errstr;
+
+	while ((ch = getopt(argc, argv, "Ho:s:")) != -1) {
+		switch (ch) {
+		case 'H':
+			enable_history = 0;
+			break;
+		case 'o':
+			set_tunables(optarg);
+			break;
+		case 's':
+			scale = strtonum(optarg, 1, 1000, &errstr);
+			if (errstr)
+				errx(1, "invalid scale: %s", errstr);
+			break;
+		default:
+			bench_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	for (ch = 0; ch < argc; ch++) {
+		for (i = 0; i < NCASES; i++)
+			if (strcmp(argv[ch], bench_cases[i].bc_name) == 0)
+				break;
+		if (i == NCASES)
+			errx(1, "unknown benchmark case: %s", argv[ch]);
+	}
+
+	if (strstr(setlocale(LC_CTYPE, ""), ".UTF-8"))
+		utf8_ready = 1;
+	headless = 1;
+	frame_ms = 0;
+	SIMPLEQ_INIT(&tasks_stdout);
+	task_arena_init(&stdout_arena, 16384);
+	clock_update();
+
+	// results go to the real stdout, chat output is discarded
+	if ((report = fdopen(dup(STDOUT_FILENO), "w")) == NULL)
+		err(1, "stdout");
+	if ((devnull = open("/dev/null", O_WRONLY)) == -1)
+		err(1, "/dev/null");
+	if (dup2(devnull, STDOUT_FILENO) == -1)
+		err(1, "dup2");
+	close(devnull);
+
+	(void)session_new(strdup("bench@localhost"), "hall");
+	session = active_session;
+	if (enable_history) {
+		if (mkdtemp(bench_dir) == NULL)
+			err(1, "mkdtemp");
+		strlcpy(session->is_history_path, bench_dir, PATH_MAX);
+	}
+	history_init();
+	filter_init(NULL);    // own nick highlighting only
+
+	for (i = 0; i < NCASES; i++) {
+		found = (argc == 0);
+		for (ch = 0; ch < argc && !found; ch++)
+			found = strcmp(argv[ch], bench_cases[i].bc_name) == 0;
+		if (found)
+			run_case(report, &bench_cases[i], scale);
+	}
+	if (enable_history)
+		cleanup_dir();
+	fclose(report);
+	return 0;
+}
@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks for the functions every line goes through: UTF-8
+ * validation and splitting, command line parsing, packetizing and
+ * escaping of text for display.
+ *
+ * Each function runs over the lines of several corpora, repeatedly,
+ * until a round takes long enough; the median of rounds is reported.
+ * Like icbbench, this includes oicb.c with its main() renamed.
+ */
+
+#define main	oicb_main
+int	 main(int argc, char **argv);
+#include "../oicb.c"
+#undef main
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+struct micro_corpus {
+	const char	*mc_name;
+	const char	*mc_unit;	// repeated to fill the line
+	char		*mc_line;
+	size_t		 mc_len;
+};
+
+struct micro_bench {
+	const char	*mb_name;
+	void		(*mb_run)(const struct micro_corpus *mc);
+};
+
+static struct micro_corpus	 corpora[] = {
+	{ "ascii",	"The quick brown fox jumps over the lazy dog. ",
+	    NULL, 0 },
+	{ "cjk",	"\xe6\xbc\xa2\xe5\xad\x97\xe3\x81\x8b\xe3\x81\xaa"
+	    "\xe4\xba\xa4\xe3\x81\x98\xe3\x82\x8a\xe6\x96\x87 ", NULL, 0 },
+	{ "emoji",	"ok \xf0\x9f\x98\x80\xf0\x9f\x91\x8d\xf0\x9f\x8f\xbd "
+	    "\xf0\x9f\x8e\x89 ", NULL, 0 },
+	{ "invalid",	"ab\xff\xc0\xaf\x80 \xe6\xbc \xf0\x9f\x98 cd\xed\xa0"
+	    "\x80 ", NULL, 0 },
+};
+#define NCORPORA	(sizeof(corpora) / sizeof(corpora[0]))
+
+static void	 run_validate(const struct micro_corpus *mc);
+static void	 run_validlen(const struct micro_corpus *mc);
+static void	 run_split(const struct micro_corpus *mc);
+static void	 run_parse_cmd(const struct micro_corpus *mc);
+static void	 run_packet_ws(const struct micro_corpus *mc);
+static void	 run_packet_ext(const struct micro_corpus *mc);
+static void	 run_untrusted(const struct micro_corpus *mc);
+
+static const struct micro_bench	benches[] = {
+	{ "mbsvalidate",	run_validate },
+	{ "mbsvalidlen",	run_validlen },
+	{ "mbssplit",		run_split },
+	{ "parse_cmd_line",	run_parse_cmd },
+	{ "packet_ws",		run_packet_ws },
+	{ "packet_ext",		run_packet_ext },
+	{ "push_untrusted",	run_untrusted },
+};
+#define NBENCHES	(sizeof(benches) / sizeof(benches[0]))
+
+static char	*cmd_line;	// private message command over corpus line
+static volatile size_t	 sink;	// keeps results from being optimized out
+
+static void		 micro_usage(void);
+static void		 fill_corpus(struct micro_corpus *mc, size_t len);
+static long long	 now_ns(void);
+static unsigned long long cycles(void);
+static int		 cmp_double(const void *a, const void *b);
+static void		 measure(FILE *report, const struct micro_bench *mb,
+			    const struct micro_corpus *mc, int rounds,
+			    long long round_ns);
+
+static __dead void
+micro_usage(void) {
+	fprintf(stderr, "usage: %s [-l bytes] [-r rounds] [-t msecs]"
+	    " [bench ...]\n", getprogname());
+	exit(1);
+}
+
+/*
+ * Lines are made of whole units, so UTF-8 ones stay valid.
+ */
+static void
+fill_corpus(struct micro_corpus *mc, size_t len) {
+	size_t	 unitlen;
+
+	unitlen = strlen(mc->mc_unit);
+	if ((mc->mc_line = malloc(len + unitlen + 1)) == NULL)
+		err(1, __func__);
+	mc->mc_len = 0;
+	do {
+		memcpy(mc->mc_line + mc->mc_len, mc->mc_unit, unitlen);
+		mc->mc_len += unitlen;
+	} while (mc->mc_len + unitlen <= len);
+	mc->mc_line[mc->mc_len] = '\0';
+}
+
+static void
+run_validate(const struct micro_corpus *mc) {
+	sink += (size_t)mbsvalidate(mc->mc_line);
+}
+
+static void
+run_validlen(const struct micro_corpus *mc) {
+	sink += mbsvalidlen(mc->mc_line, mc->mc_len);
+}
+
+static void
+run_split(const struct micro_corpus *mc) {
+	struct mbs_splitter	 ms;
+	size_t			 n;
+
+	mbssplit_init(&ms, mc->mc_line, mc->mc_len, 250, 1, utf8_ready);
+	while ((n = mbssplit_next(&ms)) != 0)
+		sink += n;
+}
+
+static void
+run_parse_cmd(const struct micro_corpus *mc) {
+	struct line_cmd	 cmd;
+
+	(void)mc;
+	sink += (size_t)parse_cmd_line(cmd_line, &cmd);
+}
+
+static void
+run_packet_ws(const struct micro_corpus *mc) {
+	session->is_features &= ~ExtPkt;
+	push_icb_msg('b', mc->mc_line, mc->mc_len);
+	sched_drop(session);
+}
+
+static void
+run_packet_ext(const struct micro_corpus *mc) {
+	session->is_features |= ExtPkt;
+	push_icb_msg('b', mc->mc_line, mc->mc_len);
+	sched_drop(session);
+}
+
+static void
+run_untrusted(const struct micro_corpus *mc) {
+	struct icb_task	*it;
+
+	sink += (size_t)push_stdout_untrusted("%s\n", mc->mc_line);
+	while ((it = SIMPLEQ_FIRST(&tasks_stdout)) != NULL) {
+		SIMPLEQ_REMOVE_HEAD(&tasks_stdout, it_entry);
+		task_free(it);
+	}
+}
+
+static long long
+now_ns(void) {
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned long long
+cycles(void) {
+#ifdef HAVE_RDTSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static int
+cmp_double(const void *a, const void *b) {
+	double	 x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Number of calls per round is doubled until a round takes round_ns,
+ * then the chosen number is used for all rounds.
+ */
+static void
+measure(FILE *report, const struct micro_bench *mb,
+    const struct micro_corpus *mc, int rounds, long long round_ns) {
+	double			*ns, *cyc;
+	unsigned long long	 c0;
+	long long		 t0, t;
+	size_t			 calls, i;
+	int			 r;
+
+	if ((ns = calloc((size_t)rounds, sizeof(double))) == NULL ||
+	    (cyc = calloc((size_t)rounds, sizeof(double))) == NULL)
+		err(1, __func__);
+	if (strcmp(mb->mb_name, "parse_cmd_line") == 0) {
+		free(cmd_line);
+		if (asprintf(&cmd_line, "/m somebody %s", mc->mc_line) == -1)
+			err(1, __func__);
+	}
+
+	for (calls = 1;; calls *= 2) {
+		t0 = now_ns();
+		for (i = 0; i < calls; i++)
+			mb->mb_run(mc);
+		if (now_ns() - t0 >= round_ns || calls >= (1UL << 30))
+			break;
+	}
+	for (r = 0; r < rounds; r++) {
+		t0 = now_ns();
+		c0 = cycles();
+		for (i = 0; i < calls; i++)
+			mb->mb_run(mc);
+		cyc[r] = (double)(cycles() - c0) / (double)calls;
+		t = now_ns() - t0;
+		ns[r] = (double)t / (double)calls;
+	}
+	qsort(ns, (size_t)rounds, sizeof(double), cmp_double);
+	qsort(cyc, (size_t)rounds, sizeof(double), cmp_double);
+
+	fprintf(report, "%-15s %-8s %6zu bytes %10.1f ns/call %7.3f ns/byte",
+	    mb->mb_name, mc->mc_name, mc->mc_len, ns[rounds / 2],
+	    ns[rounds / 2] / (double)mc->mc_len);
+#ifdef HAVE_RDTSC
+	fprintf(report, " %10.0f cycles/call", cyc[rounds / 2]);
+#endif
+	fprintf(report, "  (spread %.1f%%)\n", ns[rounds / 2] > 0 ?
+	    (ns[rounds - 1] - ns[0]) * 100 / ns[rounds / 2] : 0.0);
+	fflush(report);
+	free(ns);
+	free(cyc);
+}
+
+int
+main(int argc, char **argv) {
+	size_t		 i, j, len = 512;
+	long long	 round_ns = 50 * 1000000LL;
+	int		 ch, rounds = 7, found;
+	const char	*errstr, *locale;
+
+	while ((ch = getopt(argc, argv, "l:r:t:")) != -1) {
+		switch (ch) {
+		case 'l':
+			len = strtonum(optarg, 64, 1024 * 1024, &errstr);
+			if (errstr)
+				errx(1, "invalid line length: %s", errstr);
+			break;
+		case 'r':
+			rounds = strtonum(optarg, 1, 1000, &errstr);
+			if (errstr)
+				errx(1, "invalid number of rounds: %s", errstr);
+			break;
+		case 't':
+			round_ns = strtonum(optarg, 1, 60000, &errstr) *
+			    1000000LL;
+			if (errstr)
+				errx(1, "invalid round time: %s", errstr);
+			break;
+		default:
+			micro_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	for (ch = 0; ch < argc; ch++) {
+		for (i = 0; i < NBENCHES; i++)
+			if (strcmp(argv[ch], benches[i].mb_name) == 0)
+				break;
+		if (i == NBENCHES)
+			errx(1, "unknown benchmark: %s", argv[ch]);
+	}
+
+	// wide character functions must behave as in the client
+	locale = setlocale(LC_CTYPE, "");
+	if (locale == NULL || strstr(locale, ".UTF-8") == NULL)
+		errx(1, "UTF-8 locale is needed, check LC_ALL and LC_CTYPE");
+	utf8_ready = 1;
+	headless = 1;
+	enable_history = 0;
+	SIMPLEQ_INIT(&tasks_stdout);
+	task_arena_init(&stdout_arena, 16384);
+	clock_update();
+	(void)session_new(strdup("bench@localhost"), "hall");
+	session = active_session;
+	session->is_state = Chat;
+
+	for (i = 0; i < NCORPORA; i++)
+		fill_corpus(&corpora[i], len);
+	for (i = 0; i < NBENCHES; i++) {
+		found = (argc == 0);
+		for (ch = 0; ch < argc && !found; ch++)
+			found = strcmp(argv[ch], benches[i].mb_name) == 0;
+		if (!found)
+			continue;
+		for (j = 0; j < NCORPORA; j++)
+			measure(stdout, &benches[i], &corpora[j], rounds,
+			    round_ns);
+	}
+	return 0;
+}
@@ -18,6 +18,7 @@
 #include <ctype.h>
 #include <limits.h>
 #include <err.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,113 +27,205 @@
 #include <unistd.h>
 
 #include "oicb.h"
+#include "arena.h"
 #include "chat.h"
+#include "clock.h"
+#include "filter.h"
 #include "history.h"
+#include "metrics.h"
 #include "private.h"
+#include "record.h"
+#include "sched.h"
+#include "scrollback.h"
+#include "search.h"
+#include "session.h"
 #include "utf8.h"
+#include "who.h"
 
 
 static void	 err_unexpected_msg(char type);
 static void	 err_invalid_msg(char type, const char *desc);
-static void	 push_icb_msg_ws(char type, const char *src, size_t len);
-static void	 push_icb_msg_extended(char type, const char *src, size_t len);
+static void	 push_icb_msg_ws(struct icb_task_queue *q, char type,
+		    const char *src, size_t len);
+static void	 push_icb_msg_extended(struct icb_task_queue *q, char type,
+		    const char *src, size_t len);
 
 static void	 proceed_chat_msg(char type, const char *author, const char *text);
+static void	 status_nicks(const char *category, const char *text);
 static void	 proceed_cmd_result(char *msg, size_t len);
 static void	 proceed_cmd_result_end(char *msg, size_t len);
 static void	 proceed_user_list(char *msg, size_t len);
 static void	 proceed_group_list(char *msg, size_t len);
+static void	 proceed_cmd_ignored(char *msg, size_t len);
+
+static void	 proceed_login_ok(char type, char *msg, size_t len);
+static void	 proceed_chat(char type, char *msg, size_t len);
+static void	 proceed_error(char type, char *msg, size_t len);
+static void	 proceed_exit(char type, char *msg, size_t len);
+static void	 proceed_cmd_output(char type, char *msg, size_t len);
+static void	 proceed_protocol(char type, char *msg, size_t len);
+static void	 proceed_beep(char type, char *msg, size_t len);
+static void	 proceed_ping(char type, char *msg, size_t len);
+static void	 proceed_pong(char type, char *msg, size_t len);
+static void	 proceed_noop(char type, char *msg, size_t len);
+
+/*
+ * Incoming messages are dispatched by type byte, checking that message
+ * is expected in the current session state.
+ */
+struct icb_msg_type {
+	unsigned int		 mt_states;	// ICB_STATE() mask
+	icb_type_handler	 mt_handler;
+};
+static struct icb_msg_type msg_types[256] = {
+	['a'] = { ICB_STATE(LoginSent),	proceed_login_ok },
+	['b'] = { ICB_STATE(Chat),	proceed_chat },		// open
+	['c'] = { ICB_STATE(Chat),	proceed_chat },		// private
+	['d'] = { ICB_STATE(Chat),	proceed_chat },		// status
+	['e'] = { ICB_ANY_STATE,	proceed_error },
+	['f'] = { ICB_STATE(Chat),	proceed_chat },		// important
+	['g'] = { ICB_STATE(Chat),	proceed_exit },
+	['i'] = { ICB_STATE(Chat),	proceed_cmd_output },
+	['j'] = { ICB_STATE(Connected),	proceed_protocol },
+	['k'] = { ICB_STATE(Chat),	proceed_beep },
+	['l'] = { ICB_ANY_STATE,	proceed_ping },
+	['m'] = { ICB_ANY_STATE,	proceed_pong },
+	['n'] = { ICB_STATE(Chat),	proceed_noop },
+};
+
+/*
+ * Command output types are one or two characters, packed into integer.
+ * Lower five bits of each character give slot in cmd_handlers[], which
+ * is unique for letters; code stored in slot resolves the rest.
+ */
+#define OUTTYPE(c1, c2)	\
+	(((unsigned int)(unsigned char)(c1) << 8) | (unsigned char)(c2))
+#define OUTTYPE_SLOT(code)	\
+	((((code) >> 8) & 0x1f) << 5 | ((code) & 0x1f))
 
-typedef void (*icb_msg_handler)(char *, size_t);
 struct cmd_result_handler {
-	char		outtype[4];
-	icb_msg_handler	handler;
-} cmd_handlers[] = {
-	{ "co",	&proceed_cmd_result },
-	{ "ec",	&proceed_cmd_result_end },
-	{ "wl",	&proceed_user_list },
-	{ "wg",	&proceed_group_list },
+	unsigned int	 code;
+	icb_msg_handler	 handler;
+};
+static struct cmd_result_handler cmd_handlers[32 * 32] = {
+#define CMD_RESULT(c1, c2, h)	\
+	[OUTTYPE_SLOT(OUTTYPE(c1, c2))] = { OUTTYPE(c1, c2), h }
+	CMD_RESULT('c', 'o', proceed_cmd_result),
+	CMD_RESULT('e', 'c', proceed_cmd_result_end),
+	CMD_RESULT('w', 'l', proceed_user_list),
+	CMD_RESULT('w', 'g', proceed_group_list),
 
 	// here deprecated/ignored ones go
-	{ "wh",	NULL },     // show user list header
-	{ "gh",	NULL },     // show group list header
-	{ "ch",	NULL },     // show commands supported by client
-	{ "c",	NULL }      // show one exact command description
+	CMD_RESULT('w', 'h', proceed_cmd_ignored),	// user list header
+	CMD_RESULT('g', 'h', proceed_cmd_ignored),	// group list header
+	CMD_RESULT('c', 'h', proceed_cmd_ignored),	// commands supported
+	CMD_RESULT('c', '\0', proceed_cmd_ignored),	// one command description
+#undef CMD_RESULT
 };
 
+// FilterAction bits for the chat message being handled
+static unsigned int	 msg_filter;
+
 
 /*
- * Queue ICB messages to be sent to server.
+ * Queue ICB messages to be sent to server. User input is held back
+ * until we're logged in, and survives reconnects.
  */
 void
 push_icb_msg(char type, const char *src, size_t len) {
+	struct icb_task_queue	 q;
+	struct icb_task		*it;
+	int			 held;
+
+	held = (type == 'b' || type == 'h') && session->is_state != Chat;
 	if (debug >= 2) {
-		warnx("%s: asked type '%c' with size %zu: %s, queue %p",
-		    __func__, type, len, src, &tasks_net);
+		warnx("%s: asked type '%c' with size %zu: %s%s",
+		    __func__, type, len, src, held ? ", held" : "");
 	}
-	if ((srv_features & ExtPkt) == ExtPkt)
-		push_icb_msg_extended(type, src, len);
+	SIMPLEQ_INIT(&q);
+	if ((session->is_features & ExtPkt) == ExtPkt)
+		push_icb_msg_extended(&q, type, src, len);
 	else
-		push_icb_msg_ws(type, src, len);
+		push_icb_msg_ws(&q, type, src, len);
+	metrics.m_out_msgs[(unsigned char)type]++;
+	while ((it = SIMPLEQ_FIRST(&q)) != NULL) {
+		SIMPLEQ_REMOVE_HEAD(&q, it_entry);
+		metrics.m_out_bytes[(unsigned char)type] += it->it_len;
+		if (held)
+			SIMPLEQ_INSERT_TAIL(&session->is_tasks_held, it,
+			    it_entry);
+		else
+			sched_push(session, it);
+	}
+}
+
+/*
+ * Sends ping tagged with sequence number, remembering the time it was
+ * queued at, so the round-trip time is measured when pong comes back.
+ */
+void
+push_ping(void) {
+	char		 tag[16];
+	unsigned int	 seq;
+
+	seq = session->is_ping_seq++;
+	session->is_ping_at[seq % PING_SLOTS] = icb_now.ic_mono;
+	snprintf(tag, sizeof(tag), "%u", seq);
+	push_icb_msg('l', tag, strlen(tag));
 }
 
 /*
  * Split messages sent, preferrably on whitespace (for chat).
- * Send messages as separate packets, for compatibility's sake.
+ * Send messages as separate packets, for compatibility's sake;
+ * each one is a separate task, so the scheduler may pace them.
  */
 void
-push_icb_msg_ws(char type, const char *msg, size_t len) {
-	struct icb_task	*it;
-	int		 privmsg;
-	unsigned char	 msglen, maxlen, commonlen;
-	const char	*p, *src;
+push_icb_msg_ws(struct icb_task_queue *q, char type, const char *msg,
+    size_t len) {
+	struct mbs_splitter	 ms;
+	struct icb_task		*it;
+	int			 privmsg;
+	size_t			 msglen, maxlen, commonlen;
+	const char		*p, *src;
+	char			*dst;
 
 	commonlen = 0;
 	privmsg = type == 'h' && memcmp(msg, "m\001", 2) == 0;
 	if (privmsg) {
 		p = strchr(msg, ' ');
 		if (p != NULL && p - msg < NICKNAME_MAX + 3)
-			commonlen = (unsigned char)(p - msg) + 1;
+			commonlen = (size_t)(p - msg) + 1;
 	}
 	src = msg + commonlen;
 	len -= commonlen;
 
 	// give a chance to server to prepend nickname field without breaking
-	maxlen = 253 - ((unsigned char)nicklen + 1) - commonlen;
+	maxlen = 253 - (session->is_nicklen + 1) - commonlen;
+	mbssplit_init(&ms, src, len, maxlen, type == 'b' || privmsg,
+	    utf8_ready);
 	do {
-		if (len > maxlen) {
-			msglen = maxlen;
-			if (type == 'b' || privmsg) {
-				if (utf8_ready)
-					msglen = mbsbreak(src, msglen);
-				else {
-					for (p = src + msglen - 1; p > src; p--)
-						if (isblank(*p) || ispunct(*p)) {
-							msglen = p - src + 1;
-							break;
-						}
-				}
-			}
-		} else
-			msglen = len;
-		if ((it = calloc(1, sizeof(struct icb_task) + msglen + commonlen + 3)) == NULL)
-			err(1, __func__);
+		msglen = mbssplit_next(&ms);
+		it = task_alloc(&session->is_net_arena, msglen + commonlen + 3);
 		it->it_len = msglen + commonlen + 3;
-		it->it_data[0] = (char)((unsigned char)msglen + commonlen + 2);
-		it->it_data[1] = type;
-		memcpy(it->it_data + 2, msg, commonlen);
-		memcpy(it->it_data + 2 + commonlen, src, msglen);
+		dst = it->it_data;
+		dst[0] = (char)(msglen + commonlen + 2);
+		dst[1] = type;
+		memcpy(dst + 2, msg, commonlen);
+		memcpy(dst + 2 + commonlen, src, msglen);
+		dst[2 + commonlen + msglen] = '\0';
 		src += msglen;
-		len -= msglen;
-		SIMPLEQ_INSERT_TAIL(&tasks_net, it, it_entry);
-	} while (len);
+		SIMPLEQ_INSERT_TAIL(q, it, it_entry);
+	} while (ms.ms_start < len);
 }
 
 /*
  * Use proposed "extended" messages. Not tested on real servers yet.
+ * Packets of a message must not be interleaved with other ones, so
+ * they're kept in a single task.
  */
 void
-push_icb_msg_extended(char type, const char *src, size_t len) {
+push_icb_msg_extended(struct icb_task_queue *q, char type, const char *src,
+    size_t len) {
 	struct icb_task	*it;
 	size_t		 msgcnt;
 	unsigned char	*dst, szfinal;
@@ -142,10 +235,9 @@ push_icb_msg_extended(char type, const char *src, size_t len) {
 	if (debug >= 3)
 		warnx("%s: there will be %zu messages", __func__, msgcnt);
 
-	// +1 for sizeof(struct icb_task)
-	if ((it = calloc(msgcnt + 1, 256)) == NULL)
-		err(1, __func__);
-	it->it_len = len + msgcnt * 2;   // for size and type bytes in each message
+	// for size and type bytes in each message
+	it = task_alloc(&session->is_net_arena, len + msgcnt * 2);
+	it->it_len = len + msgcnt * 2;
 	dst = (unsigned char *)it->it_data;
 	while (msgcnt-- > 1) {
 		*dst++ = 0;
@@ -157,15 +249,14 @@ push_icb_msg_extended(char type, const char *src, size_t len) {
 			warnx("\tinitialized msg #%zu", msgcnt);
 		}
 	}
-	szfinal = (unsigned char)(len % 254);
+	szfinal = (unsigned char)(len - (len - 1) / 254 * 254);
 	if (debug >= 3) {
 		warnx("\tputting last %hhu bytes", szfinal);
 	}
 	*dst++ = szfinal + 1;    // for type byte
 	*dst++ = type;
-	memcpy(dst, src, szfinal);
-	// NUL is already there, thanks to calloc
-	SIMPLEQ_INSERT_TAIL(&tasks_net, it, it_entry);
+	memcpy(dst, src, szfinal);    // including NUL
+	SIMPLEQ_INSERT_TAIL(q, it, it_entry);
 }
 
 /*
@@ -180,6 +271,7 @@ proceed_user_input(char *line) {
 		want_exit = 1;
 		return;
 	}
+	session = active_session;
 
 	for (p = line; isspace(*p); p++)
 		;
@@ -187,6 +279,21 @@ proceed_user_input(char *line) {
 		return;    // add some insult like icb(1) does?
 
 	if (parse_cmd_line(line, &cmd)) {
+		if (cmd.cmd_name_len == 7 &&
+		    memcmp(cmd.cmd_name, "session", 7) == 0) {
+			session_cmd(cmd.cmd_name_end);
+			return;
+		}
+		if (cmd.cmd_name_len == 4 &&
+		    memcmp(cmd.cmd_name, "grep", 4) == 0) {
+			search_cmd(cmd.cmd_name_end);
+			return;
+		}
+		if (cmd.cmd_name_len == 4 &&
+		    memcmp(cmd.cmd_name, "last", 4) == 0) {
+			scrollback_cmd(cmd.cmd_name_end);
+			return;
+		}
 		if (cmd.has_args)
 			*cmd.cmd_name_end = '\001';    // separate args
 
@@ -198,7 +305,10 @@ proceed_user_input(char *line) {
 			ch = *cmd.peer_nick_end;
 			*cmd.peer_nick_end = '\0';
 			update_nick_history(cmd.peer_nick, cmd.private_msg);
+			who_idle_hint(session, cmd.peer_nick);
 			save_history('c', cmd.peer_nick, cmd.private_msg, 0);
+			scrollback_add(session, 'c', cmd.peer_nick,
+			    cmd.private_msg, 0);
 			*cmd.peer_nick_end = ch;
 			repeat_priv_nick = 1;
 			prefer_long_priv_cmd = cmd.cmd_name_len == 3;
@@ -209,7 +319,8 @@ proceed_user_input(char *line) {
 
 	// public message
 	update_nick_history(NULL, NULL);
-	save_history('b', nick, line, 0);
+	save_history('b', session->is_nick, line, 0);
+	scrollback_add(session, 'b', session->is_nick, line, 0);
 	push_icb_msg('b', line, strlen(line));
 }
 
@@ -224,58 +335,100 @@ err_invalid_msg(char type, const char *desc) {
 }
 
 /*
- * Queue formatted incoming chat message for displaying.
+ * Remembers nicks of users coming in or renamed, for completion.
  */
 void
-proceed_chat_msg(char type, const char *author, const char *text) {
-	size_t		 textlen;
-	char		 timebuf[sizeof("[00:00:00]")];
-	const char	*preuser, *postuser, *s;
-	time_t		 t;
-	int		 bell = 0;
-
-	save_history(type, author, text, 1);
+status_nicks(const char *category, const char *text) {
+	const char	*p;
+	size_t		 len;
+	char		 nick[NICKNAME_MAX];
+
+	if (strcmp(category, "Name") == 0) {
+		// "old changed nickname to new"
+		if ((p = strrchr(text, ' ')) == NULL)
+			return;
+		p++;
+		len = strlen(p);
+	} else if (strcmp(category, "Arrive") == 0 ||
+	    strcmp(category, "Sign-on") == 0) {
+		// "nick (user@host) entered group"
+		p = text;
+		len = strcspn(text, " ");
+	} else
+		return;
+	if (len == 0 || len >= sizeof(nick))
+		return;
+	memcpy(nick, p, len);
+	nick[len] = '\0';
+	nick_seen(nick);
+}
 
+/*
+ * Returns strings surrounding author of chat message of given type.
+ */
+void
+chat_marks(char type, const char **preuser, const char **postuser) {
 	switch (type) {
 	case 'c':
-		preuser  = postuser = "*";
+		*preuser  = *postuser = "*";
 		break;
 	case 'd':
-		preuser  = "[=";
-		postuser = "=]";
+		*preuser  = "[=";
+		*postuser = "=]";
 		break;
 	case 'e':
 	case 'k':
-		preuser  = postuser = "!";
+		*preuser  = *postuser = "!";
 		break;
 	case 'f':
-		preuser  = "{";
-		postuser = "}";
+		*preuser  = "{";
+		*postuser = "}";
 		break;
 	default:
-		preuser  = "<";
-		postuser = ">";
+		*preuser  = "<";
+		*postuser = ">";
 	}
+}
+
+/*
+ * Queue formatted incoming chat message for displaying.
+ */
+void
+proceed_chat_msg(char type, const char *author, const char *text) {
+	size_t		 textlen;
+	const char	*preuser, *postuser;
+	int		 bell;
+
+	save_history(type, author, text, 1);
+	scrollback_add(session, type, author, text, 1);
+	if (type == 'b' || type == 'c')
+		nick_seen(author);
+	else if (type == 'd')
+		status_nicks(author, text);
+	if (output_format != OutText)
+		return;    // already shown by push_record()
 
-	if (type == 'c')
-		bell = 1;
-	else if ((s = strstr(text, nick)) != NULL)
-		bell = (s == text || isspace((unsigned char)s[-1])) &&
-		    !isalnum((unsigned char)s[nicklen]);
+	chat_marks(type, &preuser, &postuser);
 
+	bell = type == 'c' || (msg_filter & FilterHighlight);
 	if (bell && isatty(STDOUT_FILENO))
 		putchar('\a');
 
-	t = time(NULL);
-	strftime(timebuf, sizeof(timebuf), "[%H:%M:%S]", localtime(&t));
 	push_stdout_untrusted("%s %s%s%s %s",
-	                      timebuf, preuser, author, postuser, text);
+	                      icb_now.ic_hms, preuser, author, postuser, text);
 	push_stdout("\n");
 }
 
+void
+proceed_cmd_ignored(char *msg, size_t len) {
+	(void)msg;
+	(void)len;
+}
+
 void
 proceed_cmd_result(char *msg, size_t len) {
 	(void)len;
+	who_flush(session);
 	push_stdout_untrusted(msg);
 	push_stdout("\n");
 }
@@ -283,86 +436,16 @@ proceed_cmd_result(char *msg, size_t len) {
 void
 proceed_cmd_result_end(char *msg, size_t len) {
 	(void)len;
+	who_end(session);
 	push_stdout_untrusted(msg);
 	push_stdout("\n");
-	state = Chat;
+	session->is_state = Chat;
 }
 
 void
 proceed_user_list(char *msg, size_t len) {
-	char		*p, *endptr;
-	const char	*peer_nick, *ident, *srcaddr;
-	long long	 signedon, idle;
-	struct tm	 tm;
-
 	(void)len;
-
-/*
-moderator ("m" or else)
-nickname
-idle time
-0 (always zero)
-signon timestamp (ex.: 1460893072)
-user (ident result)
-IP address/domain
-*/
-
-	p = strchr(msg, '\001');
-	if (p == NULL) {
-		warnx("invalid user info line received, ignoring");
-		return;
-	}
-	*p = '\0';
-	if (p == msg + 1 && *msg == 'm')
-		push_stdout("*");
-	else
-		push_stdout(" ");
-	peer_nick = p + 1;
-	p = strchr(peer_nick, '\001');
-	if (p != NULL)
-		*p = '\0';
-	push_stdout_untrusted(peer_nick);
-
-	if (p == NULL)
-		goto end;
-	p++;
-	idle = strtoll(p, &endptr, 10);
-	*endptr = '\0';
-	push_stdout(" % 7llds", idle);
-	p = strchr(endptr + 1, '\001');
-	if (p == NULL)
-		goto end;
-	/* this field is always zero, no interest */
-	p++;
-	signedon = strtoll(p, &endptr, 10);
-	if (*endptr != '\001' && *endptr != '\0')
-		goto end;
-	localtime_r((time_t*)&signedon, &tm);
-	// TODO: omit date when not needed? print 'today'/'yesterday'?..
-	push_stdout(" %d-%02d-%02d %02d:%02d:%02d",
-	            tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday,
-	            tm.tm_hour, tm.tm_min, tm.tm_sec);
-	if (*endptr == '\0')
-		goto end;
-
-	ident = endptr + 1;
-	p = strchr(ident, '\001');
-	if (p != NULL)
-		*p = '\0';
-	push_stdout("\t");
-	push_stdout_untrusted(ident);
-	if (p == NULL)
-		goto end;
-
-	srcaddr = p + 1;
-	p = strchr(srcaddr, '\001');
-	if (p != NULL)
-		*p = '\0';
-	push_stdout("\t");
-	push_stdout_untrusted(srcaddr);
-
-end:
-	push_stdout("\n");
+	who_add(session, msg);
 }
 
 void
@@ -372,6 +455,7 @@ proceed_group_list(char *msg, size_t len) {
 	const int	 min_name_len = 30;
 
 	(void)len;
+	who_flush(session);
 
 	name = msg;
 	if ((topic = strchr(name, '\001')) == NULL) {
@@ -382,7 +466,7 @@ proceed_group_list(char *msg, size_t len) {
 	if ((msgid = strchr(topic, '\001')) != NULL)
 		*msgid++ = '\0';
 
-	push_stdout(strcmp(name, room) ? " " : "*");
+	push_stdout(strcmp(name, session->is_room) ? " " : "*");
 	name_out_len = push_stdout_untrusted(name);
 	if (name_out_len < min_name_len)
 		push_stdout("%*s", min_name_len - name_out_len, "");
@@ -401,141 +485,237 @@ proceed_group_list(char *msg, size_t len) {
 }
 
 /*
- * Handle reconstructed incoming ICB message.
+ * Handlers of incoming ICB messages. By the time they're called, message
+ * type and session state are already checked against msg_types[].
  */
-void
-proceed_icb_msg(char *msg, size_t len) {
-	char	type;
+static void
+proceed_login_ok(char type, char *msg, size_t len) {
+	struct icb_task	*it;
 
-	type = *msg++;
-	len--;
-	if (debug) {
-		warnx("got message of type %c with size %zu: %s",
-		    type, len, msg);
+	(void)type;
+	(void)msg;
+	(void)len;
+	push_stdout("Logged in to room %s as %s\n",
+	    session->is_room, session->is_nick);
+	session->is_state = Chat;
+	session->is_backoff = 0;
+	while ((it = SIMPLEQ_FIRST(&session->is_tasks_held)) != NULL) {
+		SIMPLEQ_REMOVE_HEAD(&session->is_tasks_held, it_entry);
+		sched_push(session, it);
 	}
-	switch (type) {
-	case 'a':	// login okay
-		if (state != LoginSent)
-			err_unexpected_msg(type);
-		push_stdout("Logged in to room %s as %s\n", room, nick);
-		state = Chat;
-		break;
+}
 
-	case 'b':	// open message
-	case 'c':	// private message
-	case 'd':	// status message
-	case 'f':	// important message
-	{
-		char	*text;
-		if (state != Chat)
-			err_unexpected_msg(type);
-		if ((text = strchr(msg, '\001')) == NULL)
-			err_invalid_msg(type, "missing text");
-		*text++ = '\0';
-		proceed_chat_msg(type, msg, text);
-		break;
-	}
+// open, private, status and important messages
+static void
+proceed_chat(char type, char *msg, size_t len) {
+	char	*text;
 
-	case 'e':	// error
-		if (state != Chat)
-			want_exit = 1;
-		if (strcmp(msg, "Undefined message type 108") == 0) {
-			/* server doesn't support ping-pong */
-			srv_features &= (~Ping);
-			/* XXX set socket timeout options? */
-			if (debug)
-				warnx("server doesn't support ping-pong,"
-				    " switching to no-op messages");
-			break;
-		}
-		push_stdout("\007");
-		proceed_chat_msg(type, hostname, msg);
-		break;
+	(void)len;
+	if ((text = strchr(msg, '\001')) == NULL)
+		err_invalid_msg(type, "missing text");
+	*text++ = '\0';
+	proceed_chat_msg(type, msg, text);
+}
 
-	case 'g':       // exit
-		if (state != Chat)
-			err_unexpected_msg(type);
-		push_stdout("ICB: server said bye-bye\n");
-		want_exit = 1;
-		break;
+static void
+proceed_error(char type, char *msg, size_t len) {
+	(void)len;
+	if (session->is_state != Chat)
+		session_close(session);
+	if (strcmp(msg, "Undefined message type 108") == 0) {
+		/* server doesn't support ping-pong */
+		session->is_features &= (~Ping);
+		/* XXX set socket timeout options? */
+		if (debug)
+			warnx("server doesn't support ping-pong,"
+			    " switching to no-op messages");
+		return;
+	}
+	push_stdout("\007");
+	proceed_chat_msg(type, session->is_hostname, msg);
+}
 
-	case 'i':       // command result
-	{
-		int	 i;
-		char	*outtype;
-
-		if (state != Chat)
-			err_unexpected_msg(type);
-		outtype = msg;
-		if ((msg = strchr(msg, '\001')) == NULL)
-			err_invalid_msg(type, "missing output type");
-		*msg++ = '\0';
-		len -= msg - outtype;
-		for (i = 0; i < (int)(sizeof(cmd_handlers)/sizeof(cmd_handlers[0]));
-		    i++)
-			if (strcmp(outtype, cmd_handlers[i].outtype) == 0) {
-				if (cmd_handlers[i].handler)
-					cmd_handlers[i].handler(msg, len);
-				goto cmd_handler_found;
-			}
+static void
+proceed_exit(char type, char *msg, size_t len) {
+	(void)type;
+	(void)msg;
+	(void)len;
+	push_stdout("ICB: server said bye-bye\n");
+	session_close(session);
+}
+
+static void
+proceed_cmd_output(char type, char *msg, size_t len) {
+	const struct cmd_result_handler	*ch;
+	unsigned int			 code;
+	char				*outtype;
+
+	outtype = msg;
+	if ((msg = strchr(msg, '\001')) == NULL)
+		err_invalid_msg(type, "missing output type");
+	*msg++ = '\0';
+	len -= msg - outtype;
+	if (outtype[0] == '\0' || (outtype[1] != '\0' && outtype[2] != '\0'))
 		err_invalid_msg(type, "unsupported output type");
-cmd_handler_found:
-		break;
+	code = OUTTYPE(outtype[0], outtype[1]);
+	ch = &cmd_handlers[OUTTYPE_SLOT(code)];
+	if (ch->code != code || ch->handler == NULL)
+		err_invalid_msg(type, "unsupported output type");
+	if (output_format != OutText) {
+		// already shown by push_record()
+		if (code == OUTTYPE('e', 'c'))
+			session->is_state = Chat;
+		return;
 	}
+	ch->handler(msg, len);
+}
 
-	case 'j':       // protocol
-	{
-		char	*hostid = "HIDDEN", *srvid = "unknown implementation", *p;
+static void
+proceed_protocol(char type, char *msg, size_t len) {
+	char	*hostid = "HIDDEN", *srvid = "unknown implementation", *p;
 
-		if (state != Connected)
-			err_unexpected_msg(type);
-		if ((p = strchr(msg, '\001')) != NULL) {
+	(void)type;
+	(void)len;
+	if ((p = strchr(msg, '\001')) != NULL) {
+		*p++ = '\0';
+		hostid = p;
+		if ((p = strchr(hostid, '\001')) != NULL) {
 			*p++ = '\0';
-			hostid = p;
-			if ((p = strchr(hostid, '\001')) != NULL) {
-				*p++ = '\0';
-				srvid = p;
-			}
+			srvid = p;
 		}
-		// TODO use srvid
-		(void)srvid;
-		if (strcmp(msg, "1") != 0)
-			err(2, "unsupported protocol version");
-		if (asprintf(&p, "%1$s\001%1$s\001%2$s\001login\001", nick, room) == -1)
-			err(1, __func__);
-		push_icb_msg('a', p, strlen(p));
-		free(p);
-		state = LoginSent;
-		break;
 	}
+	// TODO use srvid
+	(void)srvid;
+	if (strcmp(msg, "1") != 0)
+		err(2, "unsupported protocol version");
+	if (asprintf(&p, "%1$s\001%1$s\001%2$s\001login\001",
+	    session->is_nick, session->is_room) == -1)
+		err(1, __func__);
+	push_icb_msg('a', p, strlen(p));
+	free(p);
+	session->is_state = LoginSent;
+}
 
-	case 'k':       // beep
-		if (state != Chat)
-			err_unexpected_msg(type);
-		proceed_chat_msg(type, "SERVER", "\007BEEP!");
-		break;
+static void
+proceed_beep(char type, char *msg, size_t len) {
+	(void)msg;
+	(void)len;
+	proceed_chat_msg(type, "SERVER", "\007BEEP!");
+}
 
-	case 'l':       // ping
-		push_icb_msg('m', msg, len);
-		break;
+static void
+proceed_ping(char type, char *msg, size_t len) {
+	(void)type;
+	push_icb_msg('m', msg, len);
+}
 
-	case 'm':       // pong
-		/*
-		 * XXX silently ignoring other unexpected pongs,
-		 * even if server said it doesn't support them previously.
-		 *
-		 * The main purpose of pings sent are forcing server to send
-		 * something back, so we don't bother with message IDs.
-		 */
-		break;
+static void
+proceed_pong(char type, char *msg, size_t len) {
+	unsigned long long	 seq;
+	long long		*at;
+	char			*end;
 
-	case 'n':       // no-op
-		if (state != Chat)
-			err_unexpected_msg(type);
-		break;
+	(void)type;
+	(void)len;
+	/*
+	 * XXX silently ignoring other unexpected pongs,
+	 * even if server said it doesn't support them previously.
+	 *
+	 * The main purpose of pings sent are forcing server to send
+	 * something back; tags are used for round-trip measurement only.
+	 */
+	if (session->is_pongs_awaited > 0)
+		session->is_pongs_awaited--;
+
+	errno = 0;
+	seq = strtoull(msg, &end, 10);
+	at = &session->is_ping_at[seq % PING_SLOTS];
+	if (*msg == '\0' || *end != '\0' || errno != 0 ||
+	    session->is_ping_seq - (unsigned int)seq > PING_SLOTS ||
+	    seq >= session->is_ping_seq || *at == 0) {
+		metrics.m_pings_lost++;
+		return;
+	}
+	hist_add(&metrics.m_ping_rtt, (unsigned long long)
+	    (icb_now.ic_mono - *at));
+	*at = 0;
+}
 
-	default:
+static void
+proceed_noop(char type, char *msg, size_t len) {
+	(void)type;
+	(void)msg;
+	(void)len;
+}
+
+/*
+ * Registers handler for messages of given type, accepted only in states
+ * given as ICB_STATE() mask. Replaces the built-in one, if any.
+ */
+void
+register_icb_msg(char type, unsigned int states, icb_type_handler handler) {
+	msg_types[(unsigned char)type].mt_states = states;
+	msg_types[(unsigned char)type].mt_handler = handler;
+}
+
+/*
+ * Registers handler for command output of given type, which is one or
+ * two characters long. Returns -1 if the type cannot be handled.
+ */
+int
+register_cmd_result(const char *outtype, icb_msg_handler handler) {
+	struct cmd_result_handler	*ch;
+	unsigned int			 code;
+
+	if (outtype[0] == '\0' || (outtype[1] != '\0' && outtype[2] != '\0'))
+		return -1;
+	code = OUTTYPE(outtype[0], outtype[1]);
+	ch = &cmd_handlers[OUTTYPE_SLOT(code)];
+	if (ch->handler != NULL && ch->code != code)
+		return -1;    // slot is taken by similar looking one
+	ch->code = code;
+	ch->handler = handler;
+	return 0;
+}
+
+/*
+ * Handle reconstructed incoming ICB message.
+ */
+void
+proceed_icb_msg(char *msg, size_t len) {
+	const struct icb_msg_type	*mt;
+	char				*text, type;
+
+	type = *msg++;
+	len--;
+	metrics.m_in_msgs[(unsigned char)type]++;
+	metrics.m_in_bytes[(unsigned char)type] += len + 1;
+	if (debug) {
+		warnx("got message of type %c with size %zu: %s",
+		    type, len, msg);
+	}
+	mt = &msg_types[(unsigned char)type];
+
+	// rules are applied before anything is done with chat message
+	msg_filter = 0;
+	if (mt->mt_handler == proceed_chat &&
+	    (text = memchr(msg, '\001', len)) != NULL) {
+		msg_filter = filter_message(type, msg, (size_t)(text - msg),
+		    text + 1);
+		if (msg_filter & FilterIgnore)
+			return;
+	}
+
+	if (output_format != OutText)
+		push_record(type, msg, len);
+	if (mt->mt_handler == NULL) {
 		push_stdout("unsupported message of type '%c', ignored\n",
 		                type);
+		return;
 	}
+	if ((mt->mt_states & ICB_STATE(session->is_state)) == 0)
+		err_unexpected_msg(type);
+	if (type != 'i')
+		who_flush(session);    // keep users listed before it
+	mt->mt_handler(type, msg, len);
 }
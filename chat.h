@@ -17,8 +17,20 @@
 #ifndef OICB_CHAT_H
 #define OICB_CHAT_H
 
+typedef void	(*icb_msg_handler)(char *msg, size_t len);
+typedef void	(*icb_type_handler)(char type, char *msg, size_t len);
+
+#define ICB_STATE(s)	(1U << (s))
+#define ICB_ANY_STATE	(~0U)
+
+void	 register_icb_msg(char type, unsigned int states,
+	    icb_type_handler handler);
+int	 register_cmd_result(const char *outtype, icb_msg_handler handler);
+
 void	 proceed_user_input(char *line);
 void	 proceed_icb_msg(char *msg, size_t len);
 void	 push_icb_msg(char type, const char *src, size_t len);
+void	 push_ping(void);
+void	 chat_marks(char type, const char **preuser, const char **postuser);
 
 #endif // OICB_CHAT_H
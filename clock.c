@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <err.h>
+#include <time.h>
+
+#include "clock.h"
+
+struct icb_clock	 icb_now = { -1, 0, 0, "", "" };
+
+void
+clock_update(void) {
+	struct timespec	 ts;
+	struct tm	 tm;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+	icb_now.ic_mono = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	if (clock_gettime(CLOCK_REALTIME, &ts) == -1)
+		err(1, "clock_gettime");
+	icb_now.ic_ms = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	if (ts.tv_sec == icb_now.ic_time)
+		return;
+	icb_now.ic_time = ts.tv_sec;
+	localtime_r(&icb_now.ic_time, &tm);
+	strftime(icb_now.ic_hms, sizeof(icb_now.ic_hms), "[%H:%M:%S]", &tm);
+	strftime(icb_now.ic_date, sizeof(icb_now.ic_date),
+	    "%Y-%m-%d %H:%M:%S", &tm);
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef OICB_CLOCK_H
+#define OICB_CLOCK_H
+
+/*
+ * Time of the current main loop iteration, read once per wakeup.
+ * Text forms are rebuilt only when the second changes.
+ */
+struct icb_clock {
+	time_t		 ic_time;	// wall clock
+	long long	 ic_ms;		// wall clock, in milliseconds
+	long long	 ic_mono;	// monotonic, in milliseconds
+	char		 ic_hms[sizeof("[00:00:00]")];
+	char		 ic_date[sizeof("0000-00-00 00:00:00")];
+};
+
+extern struct icb_clock	 icb_now;
+
+void	 clock_update(void);
+
+#endif // OICB_CLOCK_H
@@ -21,6 +21,10 @@
 #define __dead	__attribute__((__noreturn__))
 #endif
 
+#ifndef IOV_MAX
+#define IOV_MAX	1024
+#endif
+
 #ifndef SIMPLEQ_HEAD
 #define SIMPLEQ_CONCAT		STAILQ_CONCAT
 #define SIMPLEQ_EMPTY		STAILQ_EMPTY
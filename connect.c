@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Connection establishment, not blocking the event loop.
+ *
+ * Host name is resolved by getaddrinfo(3) in a short-living thread, which
+ * passes the result back through a pipe watched by the event loop.
+ * Then addresses are tried in the order proposed by RFC 8305 ("Happy
+ * Eyeballs"): address families are interleaved, and a new attempt is
+ * started every connect_delay milliseconds, or as soon as the previous
+ * one fails, without cancelling the ones in progress. The first socket
+ * becoming writable without SO_ERROR set wins.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "oicb.h"
+#include "arena.h"
+#include "clock.h"
+#include "connect.h"
+#include "event.h"
+#include "session.h"
+#include "transport.h"
+
+struct resolve_job {
+	struct icb_session	*rj_session;
+	const char		*rj_host;
+	const char		*rj_port;
+	struct addrinfo		*rj_res;
+	int			 rj_error;
+};
+
+int		 connect_delay = 250;
+
+static int	 resolver_pipe[2] = { -1, -1 };
+static int	 resolver_pending;
+
+static void	*resolver_main(void *arg);
+static void	 resolve(struct resolve_job *rj);
+static void	 connect_resolved(struct resolve_job *rj);
+static void	 connect_attempt(struct icb_session *s);
+static void	 connect_check(struct icb_session *s);
+static void	 connect_won(struct icb_session *s, size_t idx);
+static void	 connect_cleanup(struct icb_session *s, int keep);
+
+
+void
+connect_init(void) {
+	if (pipe(resolver_pipe) == -1)
+		err(1, "%s: pipe", __func__);
+	// only the reading end is watched, thread may block on writing
+	if (fcntl(resolver_pipe[0], F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(resolver_pipe[0], F_SETFD, FD_CLOEXEC) == -1 ||
+	    fcntl(resolver_pipe[1], F_SETFD, FD_CLOEXEC) == -1)
+		err(1, "%s: fcntl", __func__);
+}
+
+static void
+resolve(struct resolve_job *rj) {
+	struct addrinfo	 hints;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	rj->rj_error = getaddrinfo(rj->rj_host, rj->rj_port, &hints,
+	    &rj->rj_res);
+}
+
+static void *
+resolver_main(void *arg) {
+	struct resolve_job	*rj = arg;
+
+	resolve(rj);
+	// writes of pointer size to pipe are atomic
+	while (write(resolver_pipe[1], &rj, sizeof(rj)) == -1)
+		if (errno != EINTR)
+			err(1, "%s: write", __func__);
+	return NULL;
+}
+
+/*
+ * Starts resolving session host name; connection attempts follow.
+ */
+void
+connect_start(struct icb_session *s) {
+	struct resolve_job	*rj;
+	pthread_attr_t		 attr;
+	pthread_t		 thr;
+	sigset_t		 all, old;
+	int			 ec;
+
+	if ((rj = calloc(1, sizeof(struct resolve_job))) == NULL)
+		err(1, __func__);
+	rj->rj_session = s;
+	rj->rj_host = s->is_hostname;
+	rj->rj_port = s->is_port ? s->is_port : "7326";
+	s->is_state = Connecting;
+	s->is_retry_at = -1;
+	s->is_resolving = 1;
+	resolver_pending++;
+	// don't mix up lines of several sessions
+	push_stdout((nsessions == 1) ? "Connecting to %s ... " :
+	    "Connecting to %s ...\n", s->is_hostname);
+
+	// don't want signal handlers to run in resolver thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ec = pthread_create(&thr, &attr, resolver_main, rj);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ec != 0) {
+		if (debug)
+			warnx("%s: pthread_create: %s, resolving in place",
+			    __func__, strerror(ec));
+		resolve(rj);
+		resolver_pending--;
+		connect_resolved(rj);
+	}
+}
+
+/*
+ * Takes addresses resolved and orders them: the first family returned
+ * by getaddrinfo(3) goes first, then families alternate.
+ */
+static void
+connect_resolved(struct resolve_job *rj) {
+	struct icb_session	 *s = rj->rj_session;
+	struct addrinfo		 *ai, **first, **other;
+	size_t			  n, nfirst, nother, i;
+
+	s->is_resolving = 0;
+	if (s->is_dead) {
+		if (rj->rj_error == 0)
+			freeaddrinfo(rj->rj_res);
+		free(rj);
+		return;
+	}
+	if (rj->rj_error != 0) {
+		session_fail(s, "could not resolve host/port name: %s",
+		    gai_strerror(rj->rj_error));
+		free(rj);
+		return;
+	}
+
+	s->is_ai = rj->rj_res;
+	free(rj);
+	for (n = 0, ai = s->is_ai; ai != NULL; ai = ai->ai_next)
+		n++;
+	s->is_addrv = reallocarray(NULL, n, sizeof(struct addrinfo *));
+	first = reallocarray(NULL, n, sizeof(struct addrinfo *));
+	other = reallocarray(NULL, n, sizeof(struct addrinfo *));
+	s->is_attempts = reallocarray(NULL, n, sizeof(int));
+	if (s->is_addrv == NULL || first == NULL || other == NULL ||
+	    s->is_attempts == NULL)
+		err(1, __func__);
+
+	nfirst = nother = 0;
+	for (ai = s->is_ai; ai != NULL; ai = ai->ai_next)
+		if (ai->ai_family == s->is_ai->ai_family)
+			first[nfirst++] = ai;
+		else
+			other[nother++] = ai;
+	for (i = 0, n = 0; i < nfirst || i < nother; i++) {
+		if (i < nfirst)
+			s->is_addrv[n++] = first[i];
+		if (i < nother)
+			s->is_addrv[n++] = other[i];
+	}
+	free(first);
+	free(other);
+	for (i = 0; i < n; i++)
+		s->is_attempts[i] = -1;
+	s->is_naddrs = n;
+	s->is_nextaddr = 0;
+	s->is_next_attempt = icb_now.ic_mono;
+	s->is_conn_error = 0;
+}
+
+/*
+ * Starts connecting to the next address. Addresses failing immediately
+ * are skipped right away.
+ */
+static void
+connect_attempt(struct icb_session *s) {
+	struct addrinfo	*ai;
+	size_t		 idx;
+	int		 fd;
+
+	while (s->is_nextaddr < s->is_naddrs) {
+		idx = s->is_nextaddr++;
+		ai = s->is_addrv[idx];
+		if ((fd = socket(ai->ai_family, ai->ai_socktype|SOCK_NONBLOCK,
+		    ai->ai_protocol)) == -1) {
+			s->is_conn_error = errno;
+			continue;
+		}
+		s->is_attempts[idx] = fd;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			connect_won(s, idx);
+			return;
+		}
+		if (errno == EINPROGRESS) {
+			s->is_next_attempt = icb_now.ic_mono + connect_delay;
+			return;
+		}
+		s->is_conn_error = errno;
+		close(fd);
+		s->is_attempts[idx] = -1;
+	}
+}
+
+/*
+ * Closes all attempts but the one given, and forgets addresses.
+ */
+static void
+connect_cleanup(struct icb_session *s, int keep) {
+	size_t	 i;
+
+	for (i = 0; i < s->is_nextaddr; i++)
+		if (s->is_attempts[i] != -1 && (int)i != keep) {
+			event_del(s->is_attempts[i]);
+			close(s->is_attempts[i]);
+		}
+	free(s->is_attempts);
+	free(s->is_addrv);
+	if (s->is_ai != NULL)
+		freeaddrinfo(s->is_ai);
+	s->is_attempts = NULL;
+	s->is_addrv = NULL;
+	s->is_ai = NULL;
+	s->is_naddrs = s->is_nextaddr = 0;
+}
+
+static void
+connect_won(struct icb_session *s, size_t idx) {
+	s->is_sock = s->is_attempts[idx];
+	connect_cleanup(s, (int)idx);
+	s->is_state = Connected;
+	s->is_lastnetinput = icb_now.ic_time;
+	s->is_transport->tr_start(s);
+	push_stdout((nsessions == 1) ? "connected\n" : "connected to %s\n",
+	    s->is_hostname);
+}
+
+void
+connect_abort(struct icb_session *s) {
+	connect_cleanup(s, -1);
+}
+
+/*
+ * Schedules connection to start from scratch after delay milliseconds.
+ */
+void
+connect_later(struct icb_session *s, int delay) {
+	connect_cleanup(s, -1);
+	s->is_state = Connecting;
+	s->is_retry_at = icb_now.ic_mono + delay;
+}
+
+/*
+ * Checks attempts in progress, starting new ones when it's time.
+ */
+static void
+connect_check(struct icb_session *s) {
+	socklen_t	 len;
+	size_t		 i;
+	int		 fd, soerr;
+
+	for (i = 0; i < s->is_nextaddr; i++) {
+		if ((fd = s->is_attempts[i]) == -1 ||
+		    !(event_get(fd) & (EVENT_WRITE|EVENT_ERROR)))
+			continue;
+		len = sizeof(soerr);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerr, &len) == -1)
+			soerr = errno;
+		if (soerr == 0) {
+			connect_won(s, i);
+			return;
+		}
+		if (debug)
+			warnx("connection attempt to %s failed: %s",
+			    s->is_hostname, strerror(soerr));
+		s->is_conn_error = soerr;
+		event_del(fd);
+		close(fd);
+		s->is_attempts[i] = -1;
+		// don't wait for the delay to pass
+		s->is_next_attempt = icb_now.ic_mono;
+	}
+
+	if (s->is_next_attempt <= icb_now.ic_mono)
+		connect_attempt(s);
+	if (s->is_state != Connecting)
+		return;
+	for (i = 0; i < s->is_nextaddr; i++)
+		if (s->is_attempts[i] != -1)
+			return;
+	if (s->is_nextaddr == s->is_naddrs) {
+		connect_cleanup(s, -1);
+		session_fail(s, "could not connect to %s: %s", s->is_hostname,
+		    strerror(s->is_conn_error ? s->is_conn_error : ENOENT));
+	}
+}
+
+void
+connect_events(void) {
+	struct icb_session	*s;
+	size_t			 i;
+
+	event_set(resolver_pipe[0], resolver_pending ? EVENT_READ : 0);
+	TAILQ_FOREACH(s, &sessions, is_entry) {
+		if (s->is_dead || s->is_state != Connecting)
+			continue;
+		for (i = 0; i < s->is_nextaddr; i++)
+			if (s->is_attempts[i] != -1)
+				event_set(s->is_attempts[i], EVENT_WRITE);
+	}
+}
+
+/*
+ * Returns number of milliseconds until the next connection attempt
+ * should be started, or -1 if there is no such.
+ */
+int
+connect_timeout(void) {
+	struct icb_session	*s;
+	long long		 when = -1;
+
+	TAILQ_FOREACH(s, &sessions, is_entry) {
+		if (s->is_dead || s->is_state != Connecting)
+			continue;
+		if (s->is_retry_at != -1 &&
+		    (when == -1 || s->is_retry_at < when))
+			when = s->is_retry_at;
+		if (s->is_nextaddr < s->is_naddrs &&
+		    (when == -1 || s->is_next_attempt < when))
+			when = s->is_next_attempt;
+	}
+	if (when == -1)
+		return -1;
+	return (when > icb_now.ic_mono) ? (int)(when - icb_now.ic_mono) : 0;
+}
+
+void
+connect_proceed(void) {
+	struct resolve_job	*rj;
+	struct icb_session	*s;
+	ssize_t			 n;
+
+	if (event_get(resolver_pipe[0]) & EVENT_READ) {
+		while ((n = read(resolver_pipe[0], &rj, sizeof(rj))) ==
+		    (ssize_t)sizeof(rj)) {
+			resolver_pending--;
+			session = rj->rj_session;
+			connect_resolved(rj);
+		}
+		if (n == -1 && errno != EAGAIN && errno != EINTR)
+			err(1, "%s: read", __func__);
+	}
+
+	TAILQ_FOREACH(session, &sessions, is_entry) {
+		s = session;
+		if (s->is_dead || s->is_state != Connecting ||
+		    s->is_resolving)
+			continue;
+		if (s->is_retry_at == -1)
+			connect_check(s);
+		else if (s->is_retry_at <= icb_now.ic_mono)
+			connect_start(s);
+	}
+	session = active_session;
+}
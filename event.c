@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Readiness notification: kqueue(2) on BSD, epoll(7) on Linux and
+ * poll(2) elsewhere. Interest is kept in kernel between calls and is
+ * touched only when event_set() is called with something new.
+ *
+ * Descriptors that can't be watched (regular files and some devices
+ * under epoll) are considered always ready for what was asked.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#if defined(HAVE_KQUEUE)
+#include <sys/event.h>
+#elif defined(HAVE_EPOLL)
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "metrics.h"
+
+struct event_fd {
+	int	 ef_events;	// wanted
+	int	 ef_revents;	// got after last event_wait()
+	int	 ef_active;	// registered
+	int	 ef_always;	// can't be watched, always ready
+};
+
+static struct event_fd	*efds;
+static int		 nefds;
+static int		 ev_nactive;	// number of registered descriptors
+
+#if defined(HAVE_KQUEUE)
+static int		 kq = -1;
+#elif defined(HAVE_EPOLL)
+static int		 epfd = -1;
+#else
+static struct pollfd	*pfds;
+static size_t		 npfds;
+static int		 pfds_dirty;
+#endif
+
+static struct event_fd	*get_efd(int fd);
+static int		 backend_set(int fd, struct event_fd *ef, int events);
+
+
+const char *
+event_backend(void) {
+#if defined(HAVE_KQUEUE)
+	return "kqueue";
+#elif defined(HAVE_EPOLL)
+	return "epoll";
+#else
+	return "poll";
+#endif
+}
+
+void
+event_init(void) {
+#if defined(HAVE_KQUEUE)
+	if ((kq = kqueue()) == -1)
+		err(1, "kqueue");
+#elif defined(HAVE_EPOLL)
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		err(1, "epoll_create1");
+#endif
+}
+
+static struct event_fd *
+get_efd(int fd) {
+	struct event_fd	*nefd;
+	int		 n;
+
+	if (fd < 0)
+		errx(1, "%s: invalid descriptor %d (internal error)", __func__, fd);
+	if (fd >= nefds) {
+		n = nefds ? nefds : 16;
+		while (n <= fd)
+			n *= 2;
+		if ((nefd = reallocarray(efds, n, sizeof(struct event_fd))) == NULL)
+			err(1, __func__);
+		memset(nefd + nefds, 0, (n - nefds) * sizeof(struct event_fd));
+		efds = nefd;
+		nefds = n;
+	}
+	return &efds[fd];
+}
+
+/*
+ * Apply new interest set in kernel. Returns -1 if descriptor can't be
+ * watched by the backend.
+ */
+static int
+backend_set(int fd, struct event_fd *ef, int events) {
+#if defined(HAVE_KQUEUE)
+	struct kevent	 kev[2];
+	int		 i, n = 0;
+
+	if ((events ^ ef->ef_events) & EVENT_READ || !ef->ef_active)
+		EV_SET(&kev[n++], fd, EVFILT_READ,
+		    ((events & EVENT_READ) ? EV_ADD|EV_ENABLE : EV_ADD|EV_DISABLE) |
+		    EV_RECEIPT, 0, 0, NULL);
+	if ((events ^ ef->ef_events) & EVENT_WRITE || !ef->ef_active)
+		EV_SET(&kev[n++], fd, EVFILT_WRITE,
+		    ((events & EVENT_WRITE) ? EV_ADD|EV_ENABLE : EV_ADD|EV_DISABLE) |
+		    EV_RECEIPT, 0, 0, NULL);
+	metrics.m_syscalls++;
+	if (kevent(kq, kev, n, kev, n, NULL) == -1)
+		err(1, "kevent");
+	for (i = 0; i < n; i++)
+		if ((kev[i].flags & EV_ERROR) && kev[i].data != 0) {
+			errno = (int)kev[i].data;
+			return -1;
+		}
+	return 0;
+#elif defined(HAVE_EPOLL)
+	struct epoll_event	 ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+	if (events & EVENT_READ)
+		ev.events |= EPOLLIN;
+	if (events & EVENT_WRITE)
+		ev.events |= EPOLLOUT;
+	metrics.m_syscalls++;
+	if (epoll_ctl(epfd, ef->ef_active ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+	    fd, &ev) == -1) {
+		if (errno == EPERM)
+			return -1;
+		err(1, "epoll_ctl");
+	}
+	return 0;
+#else
+	(void)fd;
+	(void)ef;
+	(void)events;
+	pfds_dirty = 1;
+	return 0;
+#endif
+}
+
+/*
+ * Set events of interest for the given descriptor.
+ * Cheap when called with unchanged set.
+ */
+void
+event_set(int fd, int events) {
+	struct event_fd	*ef;
+
+	ef = get_efd(fd);
+	if (ef->ef_active && ef->ef_events == events)
+		return;
+	if (!ef->ef_always && backend_set(fd, ef, events) == -1)
+		ef->ef_always = 1;
+	if (!ef->ef_active)
+		ev_nactive++;
+	ef->ef_active = 1;
+	ef->ef_events = events;
+	ef->ef_revents = 0;
+}
+
+/*
+ * Forget the descriptor. Must be called before closing it.
+ */
+void
+event_del(int fd) {
+	struct event_fd	*ef;
+#if defined(HAVE_KQUEUE)
+	struct kevent	 kev[2];
+#endif
+
+	ef = get_efd(fd);
+	if (!ef->ef_active)
+		return;
+	if (!ef->ef_always) {
+#if defined(HAVE_KQUEUE)
+		EV_SET(&kev[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+		EV_SET(&kev[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+		(void)kevent(kq, kev, 2, NULL, 0, NULL);
+#elif defined(HAVE_EPOLL)
+		(void)epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+#else
+		pfds_dirty = 1;
+#endif
+	}
+	memset(ef, 0, sizeof(struct event_fd));
+	ev_nactive--;
+}
+
+/*
+ * Returns events happened on descriptor during last event_wait() call.
+ */
+int
+event_get(int fd) {
+	if (fd < 0 || fd >= nefds)
+		return 0;
+	return efds[fd].ef_revents;
+}
+
+/*
+ * Wait for events, timeout is in milliseconds (-1 for infinite).
+ * Returns number of ready descriptors, or -1 with errno set.
+ */
+int
+event_wait(int timeout) {
+	int		 i, n, nready = 0;
+#if defined(HAVE_KQUEUE)
+	struct kevent	 kev[16];
+	struct timespec	 ts, *tsp = NULL;
+#elif defined(HAVE_EPOLL)
+	struct epoll_event ev[16];
+#else
+	size_t		 j;
+#endif
+
+	for (i = 0; i < nefds; i++) {
+		efds[i].ef_revents = 0;
+		if (efds[i].ef_active && efds[i].ef_always && efds[i].ef_events) {
+			efds[i].ef_revents = efds[i].ef_events;
+			nready++;
+		}
+	}
+	if (nready)
+		timeout = 0;
+
+#if defined(HAVE_KQUEUE)
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		tsp = &ts;
+	}
+	metrics.m_syscalls++;
+	if ((n = kevent(kq, NULL, 0, kev, 16, tsp)) == -1)
+		return -1;
+	for (i = 0; i < n; i++) {
+		struct event_fd	*ef = get_efd((int)kev[i].ident);
+
+		if (kev[i].flags & EV_ERROR)
+			ef->ef_revents |= EVENT_ERROR;
+		else if (kev[i].filter == EVFILT_READ)
+			ef->ef_revents |= EVENT_READ;
+		else if (kev[i].filter == EVFILT_WRITE)
+			ef->ef_revents |= EVENT_WRITE;
+	}
+#elif defined(HAVE_EPOLL)
+	metrics.m_syscalls++;
+	if ((n = epoll_wait(epfd, ev, 16, timeout)) == -1)
+		return -1;
+	for (i = 0; i < n; i++) {
+		struct event_fd	*ef = get_efd(ev[i].data.fd);
+
+		if (ev[i].events & EPOLLIN)
+			ef->ef_revents |= EVENT_READ;
+		if (ev[i].events & EPOLLOUT)
+			ef->ef_revents |= EVENT_WRITE;
+		if (ev[i].events & (EPOLLERR|EPOLLHUP))
+			ef->ef_revents |= EVENT_ERROR;
+	}
+#else
+	if (pfds_dirty) {
+		if ((size_t)ev_nactive > npfds) {
+			struct pollfd	*np;
+
+			np = reallocarray(pfds, ev_nactive, sizeof(struct pollfd));
+			if (np == NULL)
+				err(1, __func__);
+			pfds = np;
+		}
+		npfds = 0;
+		for (i = 0; i < nefds; i++) {
+			if (!efds[i].ef_active || efds[i].ef_always)
+				continue;
+			pfds[npfds].fd = i;
+			pfds[npfds].events = 0;
+			if (efds[i].ef_events & EVENT_READ)
+				pfds[npfds].events |= POLLIN;
+			if (efds[i].ef_events & EVENT_WRITE)
+				pfds[npfds].events |= POLLOUT;
+			npfds++;
+		}
+		pfds_dirty = 0;
+	}
+	metrics.m_syscalls++;
+	if ((n = poll(pfds, npfds, timeout)) == -1)
+		return -1;
+	for (j = 0; j < npfds && n > 0; j++) {
+		struct event_fd	*ef = &efds[pfds[j].fd];
+
+		if (pfds[j].revents == 0)
+			continue;
+		if (pfds[j].revents & POLLIN)
+			ef->ef_revents |= EVENT_READ;
+		if (pfds[j].revents & POLLOUT)
+			ef->ef_revents |= EVENT_WRITE;
+		if (pfds[j].revents & (POLLERR|POLLHUP|POLLNVAL))
+			ef->ef_revents |= EVENT_ERROR;
+	}
+#endif
+	return nready + n;
+}
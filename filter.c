@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "oicb.h"
+#include "arena.h"
+#include "chat.h"
+#include "clock.h"
+#include "filter.h"
+#include "metrics.h"
+#include "session.h"
+
+/*
+ * Rules file has one rule per line:
+ *
+ *	ignore from <nick>
+ *	ignore text <keyword>
+ *	highlight from <nick>
+ *	highlight text <keyword>
+ *	route <file> from <nick>
+ *	route <file> text <keyword>
+ *
+ * "from" matches author of message as a whole, "text" matches keyword
+ * surrounded by non-alphanumeric characters anywhere in message text.
+ * Both are case-insensitive for ASCII letters. Own nick of each session
+ * is highlighted implicitly.
+ */
+
+struct filter_route {
+	char		*fr_path;
+	int		 fr_fd;
+	unsigned int	 fr_serial;	// of message written last
+};
+
+struct filter_pattern {
+	unsigned int		 fp_action;
+	int			 fp_from;	// whole author, not text word
+	size_t			 fp_len;
+	struct icb_session	*fp_session;	// NULL for any
+	struct filter_route	*fp_route;
+	int			 fp_next;	// ending in the same state, or -1
+};
+
+/*
+ * The automaton is a full DFA: bytes are mapped to classes first, so the
+ * transition table has only as many columns as there are distinct bytes
+ * in patterns, plus class 0 for all other ones. State 0 is the root.
+ */
+static unsigned char		 fa_class[256];
+static size_t			 fa_nclasses = 1;
+static unsigned int		*fa_delta;	// [state * fa_nclasses + class]
+static int			*fa_out;	// first pattern ending here
+static unsigned int		*fa_dict;	// next state with output on
+						// failure chain, 0 if none
+static unsigned int		 fa_nstates;
+
+static struct filter_pattern	*patterns;
+static size_t			 npatterns;
+static struct filter_route	*routes;
+static size_t			 nroutes;
+static unsigned int		 serial;
+
+// trie words, kept until the automaton is built
+static char			**words;
+
+static void	 add_pattern(const char *word, size_t len, int from,
+		    unsigned int action, struct icb_session *s,
+		    struct filter_route *fr);
+static struct filter_route	*add_route(const char *path);
+static void	 load_rules(const char *path);
+static void	 build_automaton(void);
+static void	 route_message(struct filter_route *fr, char type,
+		    char *author, size_t authorlen, char *text);
+
+void
+add_pattern(const char *word, size_t len, int from, unsigned int action,
+    struct icb_session *s, struct filter_route *fr) {
+	struct filter_pattern	*fp;
+	size_t			 i;
+
+	if ((npatterns & (npatterns + 1)) == 0) {
+		// grow to the next power of two
+		if ((fp = reallocarray(patterns, npatterns * 2 + 1,
+		    sizeof(*patterns))) == NULL ||
+		    (words = reallocarray(words, npatterns * 2 + 1,
+		    sizeof(*words))) == NULL)
+			err(1, __func__);
+		patterns = fp;
+	}
+	fp = &patterns[npatterns];
+	fp->fp_action = action;
+	fp->fp_from = from;
+	fp->fp_len = len;
+	fp->fp_session = s;
+	fp->fp_route = fr;
+	fp->fp_next = -1;
+	if ((words[npatterns] = strndup(word, len)) == NULL)
+		err(1, __func__);
+	for (i = 0; i < len; i++)
+		if (words[npatterns][i] >= 'A' && words[npatterns][i] <= 'Z')
+			words[npatterns][i] += 'a' - 'A';
+	npatterns++;
+}
+
+/*
+ * Route files are opened at once, so they're not subject to unveil(2).
+ * Paths not starting with slash are relative to ~/.oicb.
+ */
+struct filter_route *
+add_route(const char *path) {
+	struct filter_route	*fr;
+	char			*fullpath;
+	size_t			 i;
+
+	if (*path == '/') {
+		if ((fullpath = strdup(path)) == NULL)
+			err(1, __func__);
+	} else if (asprintf(&fullpath, "%s/.oicb/%s", getenv("HOME"),
+	    path) == -1)
+		err(1, __func__);
+	for (i = 0; i < nroutes; i++)
+		if (strcmp(routes[i].fr_path, fullpath) == 0) {
+			free(fullpath);
+			return &routes[i];
+		}
+
+	// pointers to routes are stored in patterns, so never moved
+	if (nroutes == 64)
+		errx(1, "%s: too many route files", __func__);
+	if (routes == NULL &&
+	    (routes = calloc(64, sizeof(*routes))) == NULL)
+		err(1, __func__);
+	fr = &routes[nroutes++];
+	fr->fr_path = fullpath;
+	if ((fr->fr_fd = open(fullpath, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC,
+	    0666)) == -1)
+		err(1, "%s", fullpath);
+	return fr;
+}
+
+void
+load_rules(const char *path) {
+	FILE			*fp;
+	struct filter_route	*fr;
+	char			*line = NULL, *p, *word, *end, *file;
+	size_t			 linesz = 0, lineno = 0;
+	unsigned int		 action;
+	int			 from;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		if (errno != ENOENT)
+			warn("%s", path);
+		return;
+	}
+	while (getline(&line, &linesz, fp) != -1) {
+		lineno++;
+		for (p = line; isspace((unsigned char)*p); p++)
+			;
+		if (*p == '\0' || *p == '#')
+			continue;
+		word = strsep(&p, " \t\n");
+		fr = NULL;
+		if (strcmp(word, "ignore") == 0)
+			action = FilterIgnore;
+		else if (strcmp(word, "highlight") == 0)
+			action = FilterHighlight;
+		else if (strcmp(word, "route") == 0) {
+			action = FilterRoute;
+			while (p != NULL && isspace((unsigned char)*p))
+				p++;
+			if (p == NULL || *p == '\0')
+				errx(1, "%s:%zu: file name expected",
+				    path, lineno);
+			file = strsep(&p, " \t\n");
+			fr = add_route(file);
+		} else
+			errx(1, "%s:%zu: unknown action \"%s\"",
+			    path, lineno, word);
+
+		while (p != NULL && isspace((unsigned char)*p))
+			p++;
+		word = (p != NULL) ? strsep(&p, " \t\n") : "";
+		if (strcmp(word, "from") == 0)
+			from = 1;
+		else if (strcmp(word, "text") == 0)
+			from = 0;
+		else
+			errx(1, "%s:%zu: \"from\" or \"text\" expected",
+			    path, lineno);
+
+		// the rest of line, without surrounding whitespace
+		while (p != NULL && isspace((unsigned char)*p))
+			p++;
+		if (p == NULL || *p == '\0')
+			errx(1, "%s:%zu: %s expected", path, lineno,
+			    from ? "nick" : "keyword");
+		for (end = p + strlen(p);
+		    isspace((unsigned char)end[-1]); end--)
+			;
+		add_pattern(p, (size_t)(end - p), from, action, NULL, fr);
+	}
+	if (ferror(fp))
+		err(1, "%s", path);
+	free(line);
+	fclose(fp);
+}
+
+void
+build_automaton(void) {
+	unsigned int	*fail, *queue, *row, *frow;
+	unsigned int	 s, t, qhead, qtail, maxstates;
+	size_t		 i, j, c;
+	int		 b;
+
+	// byte classes, ASCII letters of both cases sharing one
+	for (i = 0; i < npatterns; i++)
+		for (j = 0; j < patterns[i].fp_len; j++) {
+			b = (unsigned char)words[i][j];
+			if (fa_class[b] != 0)
+				continue;
+			fa_class[b] = (unsigned char)fa_nclasses;
+			if (b >= 'a' && b <= 'z')
+				fa_class[b - 'a' + 'A'] =
+				    (unsigned char)fa_nclasses;
+			fa_nclasses++;
+		}
+
+	maxstates = 1;
+	for (i = 0; i < npatterns; i++)
+		maxstates += (unsigned int)patterns[i].fp_len;
+	if ((fa_delta = calloc((size_t)maxstates * fa_nclasses,
+	    sizeof(*fa_delta))) == NULL ||
+	    (fa_out = calloc(maxstates, sizeof(*fa_out))) == NULL ||
+	    (fa_dict = calloc(maxstates, sizeof(*fa_dict))) == NULL ||
+	    (fail = calloc(maxstates, sizeof(*fail))) == NULL ||
+	    (queue = calloc(maxstates, sizeof(*queue))) == NULL)
+		err(1, __func__);
+
+	// trie; zero transition means there's no child yet
+	fa_nstates = 1;
+	fa_out[0] = -1;
+	for (i = 0; i < npatterns; i++) {
+		s = 0;
+		for (j = 0; j < patterns[i].fp_len; j++) {
+			c = fa_class[(unsigned char)words[i][j]];
+			if (fa_delta[s * fa_nclasses + c] == 0) {
+				fa_out[fa_nstates] = -1;
+				fa_delta[s * fa_nclasses + c] = fa_nstates++;
+			}
+			s = fa_delta[s * fa_nclasses + c];
+		}
+		patterns[i].fp_next = fa_out[s];
+		fa_out[s] = (int)i;
+		free(words[i]);
+	}
+	free(words);
+	words = NULL;
+
+	/*
+	 * Breadth-first walk sets failure links and fills in missing
+	 * transitions from the failure state, whose row is complete
+	 * already, being closer to the root.
+	 */
+	qhead = qtail = 0;
+	for (c = 1; c < fa_nclasses; c++)
+		if ((s = fa_delta[c]) != 0)
+			queue[qtail++] = s;
+	while (qhead < qtail) {
+		t = queue[qhead++];
+		row = &fa_delta[t * fa_nclasses];
+		frow = &fa_delta[fail[t] * fa_nclasses];
+		for (c = 1; c < fa_nclasses; c++) {
+			if ((s = row[c]) == 0) {
+				row[c] = frow[c];
+				continue;
+			}
+			fail[s] = frow[c];
+			fa_dict[s] = (fa_out[fail[s]] != -1) ?
+			    fail[s] : fa_dict[fail[s]];
+			queue[qtail++] = s;
+		}
+	}
+	free(fail);
+	free(queue);
+}
+
+/*
+ * Loads rules from file, if given, and adds own nicks of sessions,
+ * which must exist already.
+ */
+void
+filter_init(const char *path) {
+	struct icb_session	*s;
+
+	if (path != NULL)
+		load_rules(path);
+	TAILQ_FOREACH(s, &sessions, is_entry)
+		add_pattern(s->is_nick, s->is_nicklen, 0, FilterHighlight,
+		    s, NULL);
+	build_automaton();
+}
+
+/*
+ * Route files get lines like on terminal, with date added.
+ */
+void
+route_message(struct filter_route *fr, char type, char *author,
+    size_t authorlen, char *text) {
+	struct iovec	 iov[8];
+	const char	*preuser, *postuser;
+	char		 pre[4], post[4];
+
+	if (fr->fr_fd == -1 || fr->fr_serial == serial)
+		return;    // written already
+	fr->fr_serial = serial;
+	chat_marks(type, &preuser, &postuser);
+	strlcpy(pre, preuser, sizeof(pre));
+	strlcpy(post, postuser, sizeof(post));
+	iov[0].iov_base = icb_now.ic_date;
+	iov[0].iov_len = sizeof(icb_now.ic_date) - 1;
+	iov[1].iov_base = (void *)" ";
+	iov[1].iov_len = 1;
+	iov[2].iov_base = pre;
+	iov[2].iov_len = strlen(pre);
+	iov[3].iov_base = author;
+	iov[3].iov_len = authorlen;
+	iov[4].iov_base = post;
+	iov[4].iov_len = strlen(post);
+	iov[5].iov_base = (void *)" ";
+	iov[5].iov_len = 1;
+	iov[6].iov_base = text;
+	iov[6].iov_len = strlen(text);
+	iov[7].iov_base = (void *)"\n";
+	iov[7].iov_len = 1;
+	if (writev(fr->fr_fd, iov, 8) == -1) {
+		warn("%s", fr->fr_path);
+		close(fr->fr_fd);
+		fr->fr_fd = -1;
+		return;
+	}
+	metrics.m_routed++;
+}
+
+/*
+ * Runs the automaton over author and text of incoming chat message,
+ * returning FilterAction bits of rules matched. Nothing is allocated,
+ * so ignored messages cost only this single pass.
+ */
+unsigned int
+filter_message(char type, char *author, size_t authorlen, char *text) {
+	const struct filter_pattern	*fp;
+	const char			*p, *start;
+	unsigned int			 actions = 0, s, t;
+	int				 i;
+
+	serial++;
+
+	// nick patterns must end at the last byte and span all of author
+	s = 0;
+	for (p = author; p < author + authorlen; p++)
+		s = fa_delta[s * fa_nclasses + fa_class[(unsigned char)*p]];
+	for (t = s; t != 0; t = fa_dict[t])
+		for (i = fa_out[t]; i != -1; i = fp->fp_next) {
+			fp = &patterns[i];
+			if (!fp->fp_from || fp->fp_len != authorlen)
+				continue;
+			if (fp->fp_session != NULL && fp->fp_session != session)
+				continue;
+			actions |= fp->fp_action;
+			if (fp->fp_route != NULL)
+				route_message(fp->fp_route, type,
+				    author, authorlen, text);
+		}
+
+	// keywords must be surrounded by non-alphanumeric characters
+	s = 0;
+	for (p = text; *p != '\0'; p++) {
+		s = fa_delta[s * fa_nclasses + fa_class[(unsigned char)*p]];
+		if (s == 0 || isalnum((unsigned char)p[1]))
+			continue;
+		for (t = s; t != 0; t = fa_dict[t])
+			for (i = fa_out[t]; i != -1; i = fp->fp_next) {
+				fp = &patterns[i];
+				if (fp->fp_from)
+					continue;
+				start = p + 1 - fp->fp_len;
+				if (start > text &&
+				    isalnum((unsigned char)start[-1]))
+					continue;
+				if (fp->fp_session != NULL &&
+				    fp->fp_session != session)
+					continue;
+				actions |= fp->fp_action;
+				if (fp->fp_route != NULL)
+					route_message(fp->fp_route, type,
+					    author, authorlen, text);
+			}
+	}
+
+	if (actions & FilterIgnore)
+		metrics.m_ignored++;
+	return actions;
+}
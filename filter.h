@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef OICB_FILTER_H
+#define OICB_FILTER_H
+
+#include <sys/types.h>
+
+/*
+ * Rules from ~/.oicb/rules, applied to incoming chat messages before
+ * they are displayed or logged. Nicks and keywords of all rules are
+ * compiled into a single Aho-Corasick automaton, so each message is
+ * looked at once, however many rules there are.
+ */
+enum FilterAction {
+	FilterIgnore	= 0x1,	// drop message
+	FilterHighlight	= 0x2,	// ring the bell
+	FilterRoute	= 0x4,	// copied to file already
+};
+
+void		 filter_init(const char *path);
+unsigned int	 filter_message(char type, char *author, size_t authorlen,
+		    char *text);
+
+#endif // OICB_FILTER_H
@@ -16,10 +16,14 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,72 +31,256 @@
 #include <unistd.h>
 
 #include "oicb.h"
+#include "archive.h"
+#include "arena.h"
+#include "clock.h"
 #include "history.h"
+#include "metrics.h"
+#include "session.h"
+#include "writer.h"
 
 
-struct history_files_list history_files;
+static struct history_files_list	 history_files[HISTORY_HASH_SIZE];
+static struct history_files_tailq	 history_lru =
+    TAILQ_HEAD_INITIALIZER(history_lru);
+static struct history_files_tailq	 history_dirty =
+    TAILQ_HEAD_INITIALIZER(history_dirty);
+static int				 history_nfds;
+static int				 history_exiting;
+static int				*history_slots;	// free ones, for writer
+static int				 history_nslots;
+static int				 history_dropping;
 
-static struct history_file	*get_history_file(char *path);
-static char			*get_save_path_for(char type, const char *peer,
-                                                   const char *msg);
+static struct history_file	*get_history_file(char type, const char *peer,
+                                                  const char *msg);
+static unsigned int		 history_hash(const char *root, char kind,
+                                              const char *peer);
+static int			 history_open(struct history_file *hf);
+static void			 history_close(struct history_file *hf);
+static void			 history_unref(struct history_file *hf);
+static int			 history_put(struct history_file *hf, size_t len);
+static void			 history_rotate(struct history_file *hf);
+static int			 history_write(struct history_file *hf, long long now);
+static int			 is_stamp(const char *s);
+static int			 cmp_names(const void *a, const void *b);
+static void			 history_flush(struct history_file *hf, long long now);
 
 int		 enable_history = 1;
-char		 history_path[PATH_MAX];
+int		 history_max_fds = 64;
+int		 history_buf_size = 16384;
+int		 history_delay = 500;
+int		 history_sync_lines = 0;
+int		 history_sync_secs = 0;
+int		 history_threaded = 0;
+int		 history_ring_size = 1024 * 1024;
+int		 history_drop = 0;
+int		 history_rotate_daily = 0;
+int		 history_rotate_size = 0;
 
 
-static char*
-get_save_path_for(char type, const char *peer, const char *msg) {
-	int		 rv;
-	const char	*prefix;
-	char		*path;
+/*
+ * Makes sure we won't run out of descriptors because of logs.
+ */
+void
+history_init(void) {
+	struct rlimit	 rl;
+	size_t		 i;
 
+	for (i = 0; i < HISTORY_HASH_SIZE; i++)
+		LIST_INIT(&history_files[i]);
+	if (atexit(flush_history) == -1)
+		warn("atexit");
+
+	// stdio, network and some spare ones
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		warn("getrlimit");
+	else if (rl.rlim_cur != RLIM_INFINITY &&
+	    rl.rlim_cur < (rlim_t)history_max_fds + 16)
+		history_max_fds = rl.rlim_cur > 17 ? (int)rl.rlim_cur - 16 : 1;
+
+	if (enable_history && history_threaded) {
+		history_slots = reallocarray(NULL, history_max_fds, sizeof(int));
+		if (history_slots == NULL)
+			err(1, __func__);
+		for (i = 0; i < (size_t)history_max_fds; i++)
+			history_slots[i] = history_max_fds - 1 - (int)i;
+		history_nslots = history_max_fds;
+		writer_start(history_ring_size, history_max_fds);
+	} else
+		history_threaded = 0;
+}
+
+/*
+ * FNV-1a over history directory, kind and peer name.
+ */
+static unsigned int
+history_hash(const char *root, char kind, const char *peer) {
+	uint32_t	 h = 2166136261U;
+
+	for (; *root; root++)
+		h = (h ^ (unsigned char)*root) * 16777619U;
+	h = (h ^ (unsigned char)kind) * 16777619U;
+	for (; *peer; peer++)
+		h = (h ^ (unsigned char)*peer) * 16777619U;
+	return h;
+}
+
+/*
+ * Returns kind of chat ('r'oom or 'p'rivate) the message belongs to,
+ * and updates peer to be the room name or the peer nick, respectively.
+ */
+char
+history_target(char type, const char **peer, const char *msg) {
 #define NO_SUCH_USER	"No such user "
 	if (type == 'e' &&
 	    strncmp(msg, NO_SUCH_USER, strlen(NO_SUCH_USER)) == 0) {
 		// Those errors occur happen in private chats,
 		// so it's logical to save them there.
-		peer = msg + strlen(NO_SUCH_USER);
-		prefix = "private-";
+		*peer = msg + strlen(NO_SUCH_USER);
+		return 'p';
 	} else if (type != 'c') {
-		peer = room;
-		prefix = "room-";
-	} else {
-		prefix = "private-";
+		*peer = session->is_room;
+		return 'r';
 	}
-
-	rv = asprintf(&path, "%s/%s%s.log", history_path, prefix, peer);
-	if (rv == -1)
-		return NULL;
-	return path;
+	return 'p';
 }
 
 static struct history_file*
-get_history_file(char *path) {
-	struct history_file	*hf;
+get_history_file(char type, const char *peer, const char *msg) {
+	struct history_files_list	*bucket;
+	struct history_file		*hf;
+	struct stat			 st;
+	struct tm			*tm;
+	unsigned int			 h;
+	const char			*root;
+	char				 kind;
+
+	kind = history_target(type, &peer, msg);
 
-	LIST_FOREACH(hf, &history_files, hf_entry) {
-		if (strcmp(hf->hf_path, path) == 0)
-			goto found;
+	// sessions on the same server share log files
+	root = session->is_history_path;
+	h = history_hash(root, kind, peer);
+	bucket = &history_files[h % HISTORY_HASH_SIZE];
+	LIST_FOREACH(hf, bucket, hf_entry) {
+		if (hf->hf_hash == h && hf->hf_kind == kind &&
+		    strcmp(hf->hf_peer, peer) == 0 &&
+		    (hf->hf_root == root || strcmp(hf->hf_root, root) == 0))
+			return hf;
 	}
 
 	hf = calloc(1, sizeof(struct history_file));
 	if (hf == NULL)
+		return NULL;
+	if ((hf->hf_peer = strdup(peer)) == NULL)
 		goto fail;
-	hf->hf_path = strdup(path);
-	if (create_dir_for(hf->hf_path) == -1)
+	if (asprintf(&hf->hf_path, "%s/%s%s.log", root,
+	    (kind == 'r') ? "room-" : "private-", peer) == -1) {
+		hf->hf_path = NULL;
 		goto fail;
+	}
+	hf->hf_root = root;
+	hf->hf_hash = h;
+	hf->hf_kind = kind;
+	hf->hf_synced = icb_now.ic_mono;
 	hf->hf_fd = -1;    /* to be opened later */
-	SIMPLEQ_INIT(&hf->hf_tasks);
-	LIST_INSERT_HEAD(&history_files, hf, hf_entry);
-
-found:
+	if ((history_rotate_daily || history_rotate_size) &&
+	    stat(hf->hf_path, &st) == 0 && st.st_size > 0) {
+		hf->hf_size = (size_t)st.st_size;
+		if ((tm = localtime(&st.st_mtime)) != NULL)
+			strftime(hf->hf_day, sizeof(hf->hf_day), "%Y-%m-%d", tm);
+	}
+	LIST_INSERT_HEAD(bucket, hf, hf_entry);
 	return hf;
 
 fail:
+	free(hf->hf_path);
+	free(hf->hf_peer);
 	free(hf);
 	return NULL;
 }
 
+/*
+ * Pending data and open descriptor keep the entry alive.
+ */
+static void
+history_unref(struct history_file *hf) {
+	if (--hf->hf_refs > 0)
+		return;
+	LIST_REMOVE(hf, hf_entry);
+	free(hf->hf_buf);
+	free(hf->hf_path);
+	free(hf->hf_peer);
+	free(hf);
+}
+
+static int
+history_open(struct history_file *hf) {
+	struct history_file	*victim;
+
+	if (history_nfds >= history_max_fds) {
+		// prefer the least recently used one having nothing to write
+		TAILQ_FOREACH(victim, &history_lru, hf_lru)
+			if (victim->hf_buflen == 0)
+				break;
+		if (victim == NULL)
+			victim = TAILQ_FIRST(&history_lru);
+		if (victim != NULL)
+			history_close(victim);
+	}
+
+	if (history_threaded) {
+		// descriptor is a writer slot number then
+		hf->hf_fd = history_slots[--history_nslots];
+		writer_open(hf->hf_fd, hf->hf_path);
+	} else {
+		hf->hf_fd = open(hf->hf_path,
+		    O_WRONLY|O_CREAT|O_APPEND|O_NONBLOCK|O_CLOEXEC, 0666);
+		if (hf->hf_fd == -1)
+			return -1;
+	}
+	TAILQ_INSERT_TAIL(&history_lru, hf, hf_lru);
+	history_nfds++;
+	hf->hf_refs++;
+	return 0;
+}
+
+static void
+history_close(struct history_file *hf) {
+	if (history_threaded) {
+		writer_close(hf->hf_fd);
+		history_slots[history_nslots++] = hf->hf_fd;
+	} else
+		close(hf->hf_fd);
+	hf->hf_fd = -1;
+	TAILQ_REMOVE(&history_lru, hf, hf_lru);
+	history_nfds--;
+	history_unref(hf);
+}
+
+/*
+ * Makes sure history directory of session exists, creating it when the
+ * first line is saved, so sessions having nothing to log don't touch the
+ * file system. The result is remembered; on failure history saving is
+ * disabled for the session.
+ */
+int
+history_prepare(struct icb_session *s) {
+	if (s->is_history_ready)
+		return 0;
+	if (s->is_history_path[0] == '\0')
+		return -1;
+	if (create_dir_for(s->is_history_path) == -1 ||
+	    (mkdir(s->is_history_path, 0777) == -1 && errno != EEXIST)) {
+		warn("cannot make sure history directory \"%s\" exists",
+		    s->is_history_path);
+		warnx("history saving is disabled");
+		memset(s->is_history_path, 0, PATH_MAX);
+		return -1;
+	}
+	s->is_history_ready = 1;
+	return 0;
+}
+
 /*
  * Creates directory recursively.
  * Given /foo/bar/buz as path, it'll attempt to create /foo/var directory.
@@ -125,99 +313,437 @@ create_dir_for(char *path) {
 void
 save_history(char type, const char *peer, const char *msg, int incoming) {
 	struct history_file	*hf;
-	struct icb_task		*it = NULL;
-	struct tm		*now;
-	size_t			 datasz;
-	time_t			 t;
-	char			*path;
-	const int		 datelen = 20;
-
-	if (!enable_history)
+	size_t			 datasz, newsize;
+	char			*p;
+	const int		 datelen = sizeof(icb_now.ic_date);
+
+	if (!enable_history || history_prepare(session) == -1)
 		return;
 
-	t = time(NULL);
-	now = localtime(&t);
-	path = get_save_path_for(type, peer, msg);
-	if (path == NULL)
-		goto fail;
-	hf = get_history_file(path);
-	if (hf == NULL)
-		goto fail;
+	hf = get_history_file(type, peer, msg);
+	if (hf == NULL) {
+		warn(__func__);
+		return;
+	}
+	if (hf->hf_permerr)
+		return;
+
+	if (history_rotate_daily && hf->hf_day[0] != '\0' && !hf->hf_newday &&
+	    memcmp(hf->hf_day, icb_now.ic_date, sizeof(hf->hf_day) - 1) != 0) {
+		hf->hf_newday = 1;
+		hf->hf_rotate_at = hf->hf_buflen;
+	}
+	memcpy(hf->hf_day, icb_now.ic_date, sizeof(hf->hf_day) - 1);
 
 	if (!incoming)
 		peer = "me";
 	datasz = datelen + strlen(peer) + 2 + strlen(msg) + 1;
-	it = calloc(1, sizeof(struct icb_task) + datasz);
-	if (it == NULL)
-		goto fail;
-	strftime(it->it_data, datasz, "%Y-%m-%d %H:%M:%S ", now);
-	strlcat(it->it_data, peer, datasz);
-	strlcat(it->it_data, ": ", datasz);
-	strlcat(it->it_data, msg, datasz);
-	it->it_len = datasz;
-	it->it_data[datasz - 1] = '\n';
-	SIMPLEQ_INSERT_TAIL(&hf->hf_tasks, it, it_entry);
-	return;
+	if (hf->hf_buflen + datasz + 1 > hf->hf_bufsize) {
+		newsize = hf->hf_bufsize ? hf->hf_bufsize : 256;
+		while (newsize < hf->hf_buflen + datasz + 1)
+			newsize *= 2;
+		if ((p = realloc(hf->hf_buf, newsize)) == NULL) {
+			warn(__func__);
+			return;
+		}
+		hf->hf_buf = p;
+		hf->hf_bufsize = newsize;
+	}
+	p = hf->hf_buf + hf->hf_buflen;
+	memcpy(p, icb_now.ic_date, datelen - 1);
+	p[datelen - 1] = ' ';
+	p[datelen] = '\0';
+	strlcat(p, peer, datasz);
+	strlcat(p, ": ", datasz);
+	strlcat(p, msg, datasz);
+	p[datasz - 1] = '\n';
 
-fail:
-	warn(__func__);
-	free(path);
+	if (hf->hf_buflen == 0) {
+		TAILQ_INSERT_TAIL(&history_dirty, hf, hf_dirty);
+		hf->hf_refs++;
+		hf->hf_deadline = icb_now.ic_mono + history_delay;
+	}
+	hf->hf_buflen += datasz;
+	hf->hf_nunsynced++;
+	if (hf->hf_buflen >= (size_t)history_buf_size)
+		history_flush(hf, icb_now.ic_mono);
+}
+
+/*
+ * Writes out the first len bytes buffered, opening the log if needed.
+ * Returns -1 if data could not be written; the part written is removed
+ * from buffer anyway.
+ */
+static int
+history_put(struct history_file *hf, size_t len) {
+	ssize_t		 nwritten;
+	size_t		 ndone = 0;
+
+	if (len == 0)
+		return 0;
+	if (hf->hf_fd == -1) {
+		// not opened yet, evicted or error happened
+		if (history_open(hf) == -1) {
+			warnx("cannot open '%s', disabling history", hf->hf_path);
+			enable_history = 0;
+			hf->hf_permerr = 1;
+			hf->hf_buflen = 0;
+			hf->hf_newday = 0;
+			return 0;
+		}
+	} else {
+		TAILQ_REMOVE(&history_lru, hf, hf_lru);
+		TAILQ_INSERT_TAIL(&history_lru, hf, hf_lru);
+	}
+
+	if (history_threaded) {
+		if (writer_write(hf->hf_fd, hf->hf_buf, len,
+		    !history_drop) == -1) {
+			if (!history_dropping)
+				warnx("history writer is too slow, dropping lines");
+			history_dropping = 1;
+		} else
+			history_dropping = 0;
+		ndone = len;
+	}
+	while (ndone < len) {
+		metrics.m_syscalls++;
+		nwritten = write(hf->hf_fd, hf->hf_buf + ndone, len - ndone);
+		if (nwritten == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				warn("cannit write history to %s", hf->hf_path);
+			break;
+		}
+		ndone += nwritten;
+	}
+	memmove(hf->hf_buf, hf->hf_buf + ndone, hf->hf_buflen - ndone);
+	hf->hf_buflen -= ndone;
+	hf->hf_size += ndone;
+	if (hf->hf_newday)
+		hf->hf_rotate_at -= ndone;
+	if (ndone < len) {
+		if (errno != EAGAIN)
+			history_close(hf);
+		return -1;
+	}
+	return 0;
 }
 
+/*
+ * Renames the current log to a segment, to be compressed later, so the
+ * next write starts a new log. The entry is kept alive by pending data.
+ */
+static void
+history_rotate(struct history_file *hf) {
+	struct stat	 st;
+	char		 seg[PATH_MAX], gzseg[PATH_MAX];
+	const char	*d = icb_now.ic_date;
+
+	// "YYYY-MM-DD HH:MM:SS" to "YYYYMMDD-HHMMSS"
+	if (snprintf(seg, sizeof(seg), "%s.%.4s%.2s%.2s-%.2s%.2s%.2s",
+	    hf->hf_path, d, d + 5, d + 8, d + 11, d + 14, d + 17) >=
+	    (int)sizeof(seg))
+		return;
+	if (snprintf(gzseg, sizeof(gzseg), "%s.gz", seg) >= (int)sizeof(gzseg))
+		return;
+	if (lstat(seg, &st) == 0 || lstat(gzseg, &st) == 0)
+		return;    // rotated during this second already
+
+	if (hf->hf_fd != -1)
+		history_close(hf);
+	if (history_threaded)
+		writer_rotate(hf->hf_path, seg);
+	else if (rename(hf->hf_path, seg) == -1) {
+		if (errno != ENOENT)
+			warn("cannot rotate %s", hf->hf_path);
+	} else
+		archive_queue(seg);
+	hf->hf_size = 0;
+}
+
+/*
+ * Writes out all buffered data of the given file, possibly syncing it.
+ * Lines of the previous day go to the log being rotated out.
+ * Returns -1 if data could not be written.
+ */
+static int
+history_write(struct history_file *hf, long long now) {
+	if (hf->hf_newday) {
+		if (history_put(hf, hf->hf_rotate_at) == -1)
+			return -1;
+		if (hf->hf_permerr)
+			return 0;
+		hf->hf_newday = 0;
+		if (hf->hf_size > 0)
+			history_rotate(hf);
+	} else if (history_rotate_size && hf->hf_size > 0 &&
+	    hf->hf_size + hf->hf_buflen > (size_t)history_rotate_size)
+		history_rotate(hf);
+	if (history_put(hf, hf->hf_buflen) == -1)
+		return -1;
+	if (hf->hf_permerr)
+		return 0;
+
+	if (hf->hf_bufsize > 2 * (size_t)history_buf_size) {
+		free(hf->hf_buf);
+		hf->hf_buf = NULL;
+		hf->hf_bufsize = 0;
+	}
+
+	if ((history_sync_lines && hf->hf_nunsynced >= history_sync_lines) ||
+	    (history_sync_secs && hf->hf_synced + history_sync_secs * 1000LL <= now) ||
+	    (history_exiting && (history_sync_lines || history_sync_secs))) {
+		if (history_threaded)
+			writer_sync(hf->hf_fd);
+		else {
+			metrics.m_syscalls++;
+			if (fsync(hf->hf_fd) == -1)
+				warn("fsync %s", hf->hf_path);
+		}
+		hf->hf_nunsynced = 0;
+		hf->hf_synced = now;
+	}
+	return 0;
+}
+
+static void
+history_flush(struct history_file *hf, long long now) {
+	if (history_write(hf, now) == -1) {
+		// try again a bit later
+		hf->hf_deadline = now + history_delay;
+		return;
+	}
+	TAILQ_REMOVE(&history_dirty, hf, hf_dirty);
+	history_unref(hf);
+}
+
+/*
+ * Writes buffered lines that are waiting long enough.
+ */
 void
 proceed_history(void) {
 	struct history_file	*hf, *thf;
-	struct icb_task	*it;
-	ssize_t			 nwritten;
+	long long		 now;
 
-	LIST_FOREACH_SAFE(hf, &history_files, hf_entry, thf) {
-		if (hf->hf_permerr)
+	if (history_threaded && enable_history && writer_failed()) {
+		warnx("cannot open history file, disabling history");
+		enable_history = 0;
+	}
+	if (TAILQ_EMPTY(&history_dirty))
+		return;
+	now = icb_now.ic_mono;
+	TAILQ_FOREACH_SAFE(hf, &history_dirty, hf_dirty, thf)
+		if (hf->hf_deadline <= now)
+			history_flush(hf, now);
+}
+
+/*
+ * Returns time in milliseconds until proceed_history() has something
+ * to do, or -1 if there is no buffered data.
+ */
+int
+history_timeout(void) {
+	struct history_file	*hf;
+	long long		 now, deadline = -1;
+
+	TAILQ_FOREACH(hf, &history_dirty, hf_dirty)
+		if (deadline == -1 || hf->hf_deadline < deadline)
+			deadline = hf->hf_deadline;
+	if (deadline == -1)
+		return -1;
+	now = icb_now.ic_mono;
+	return (deadline > now) ? (int)(deadline - now) : 0;
+}
+
+/*
+ * Returns number of files having buffered data, and amount of the latter.
+ */
+void
+history_pending(size_t *files, size_t *bytes) {
+	struct history_file	*hf;
+
+	*files = *bytes = 0;
+	TAILQ_FOREACH(hf, &history_dirty, hf_dirty) {
+		(*files)++;
+		*bytes += hf->hf_buflen;
+	}
+}
+
+/*
+ * Writes out everything buffered, without waiting for delays;
+ * returns after the data reached the files, even with writer thread.
+ */
+void
+history_write_all(void) {
+	struct history_file	*hf;
+
+	TAILQ_FOREACH(hf, &history_dirty, hf_dirty)
+		hf->hf_deadline = 0;
+	proceed_history();
+	if (history_threaded)
+		writer_drain();
+}
+
+/*
+ * Writes out everything buffered, called on exit.
+ */
+void
+flush_history(void) {
+	struct history_file	*hf;
+
+	history_exiting = 1;
+	TAILQ_FOREACH(hf, &history_dirty, hf_dirty)
+		hf->hf_deadline = 0;
+	proceed_history();
+	if (history_threaded)
+		writer_stop();
+	archive_stop();
+}
+
+static int
+is_stamp(const char *s) {
+	size_t	 i;
+
+	for (i = 0; i < HISTORY_STAMPLEN; i++)
+		if ((i == 8) ? s[i] != '-' : !isdigit((unsigned char)s[i]))
+			return 0;
+	return 1;
+}
+
+/*
+ * Returns non-zero if the name is of the current log or of its segment.
+ */
+int
+history_parse_name(const char *name, struct history_name *hn) {
+	size_t	 len;
+
+	memset(hn, 0, sizeof(struct history_name));
+	if (strncmp(name, "room-", 5) == 0) {
+		hn->hn_kind = 'r';
+		hn->hn_peer = name + 5;
+	} else if (strncmp(name, "private-", 8) == 0) {
+		hn->hn_kind = 'p';
+		hn->hn_peer = name + 8;
+	} else
+		return 0;
+
+	len = strlen(name);
+	if (len > 3 && strcmp(name + len - 3, ".gz") == 0) {
+		hn->hn_gz = 1;
+		len -= 3;
+	}
+	if (len > HISTORY_STAMPLEN + 1 &&
+	    name[len - HISTORY_STAMPLEN - 1] == '.' &&
+	    is_stamp(name + len - HISTORY_STAMPLEN)) {
+		hn->hn_stamp = name + len - HISTORY_STAMPLEN;
+		len -= HISTORY_STAMPLEN + 1;
+	} else if (hn->hn_gz)
+		return 0;
+	if (name + len < hn->hn_peer + 5 ||
+	    memcmp(name + len - 4, ".log", 4) != 0)
+		return 0;
+	hn->hn_baselen = len;
+	hn->hn_peerlen = (size_t)(name + len - 4 - hn->hn_peer);
+	return 1;
+}
+
+/*
+ * Groups logs of the same chat, in chronological order: segments by stamp
+ * and the current log after them. Compressed segment goes before the same
+ * one not removed yet, the latter is skipped by history_list().
+ */
+static int
+cmp_names(const void *a, const void *b) {
+	const char		*na = *(char * const *)a, *nb = *(char * const *)b;
+	struct history_name	 ha, hb;
+	size_t			 len;
+	int			 c;
+
+	(void)history_parse_name(na, &ha);
+	(void)history_parse_name(nb, &hb);
+	len = (ha.hn_baselen < hb.hn_baselen) ? ha.hn_baselen : hb.hn_baselen;
+	if ((c = memcmp(na, nb, len)) != 0)
+		return c;
+	if (ha.hn_baselen != hb.hn_baselen)
+		return (ha.hn_baselen < hb.hn_baselen) ? -1 : 1;
+	if (ha.hn_stamp == NULL || hb.hn_stamp == NULL)
+		return (ha.hn_stamp == NULL) - (hb.hn_stamp == NULL);
+	if ((c = memcmp(ha.hn_stamp, hb.hn_stamp, HISTORY_STAMPLEN)) != 0)
+		return c;
+	return hb.hn_gz - ha.hn_gz;
+}
+
+/*
+ * Returns NULL-terminated array of names of logs and segments in the
+ * directory, ordered as described above; or NULL with errno set.
+ */
+char **
+history_list(const char *dir) {
+	struct history_name	 hn, prev;
+	struct dirent		*de;
+	DIR			*d;
+	char			**names, **nnames;
+	size_t			 n = 0, size = 16, i, j;
+	int			 serrno;
+
+	if ((d = opendir(dir)) == NULL)
+		return NULL;
+	if ((names = reallocarray(NULL, size, sizeof(char *))) == NULL)
+		goto fail;
+	while ((de = readdir(d)) != NULL) {
+		if (!history_parse_name(de->d_name, &hn))
 			continue;
-		if (hf->hf_fd == -1) {
-			// error or reload happened
-			hf->hf_fd = open(hf->hf_path,
-			     O_WRONLY|O_CREAT|O_APPEND|O_NONBLOCK, 0666);
-			if (hf->hf_fd == -1) {
-				warnx("cannot open '%s', disabling history", hf->hf_path);
-				enable_history = 0;
-				while (!SIMPLEQ_EMPTY(&hf->hf_tasks)) {
-					it = SIMPLEQ_FIRST(&hf->hf_tasks);
-					SIMPLEQ_REMOVE_HEAD(&hf->hf_tasks, it_entry);
-					free(it);
-				}
-				hf->hf_ntasks = 0;
-				hf->hf_permerr = 1;
-			}
-		}
-		while (!SIMPLEQ_EMPTY(&hf->hf_tasks)) {
-			it = SIMPLEQ_FIRST(&hf->hf_tasks);
-			do {
-				nwritten = write(hf->hf_fd,
-				    it->it_data + it->it_ndone,
-				    it->it_len - it->it_ndone);
-				if (nwritten == -1) {
-					if (errno == EAGAIN)
-						goto next_file;
-					warn("cannit write history to %s",
-					    hf->hf_path);
-					close(hf->hf_fd);
-					hf->hf_fd = -1;
-					goto next_file;
-				}
-				it->it_ndone += nwritten;
-			} while (it->it_ndone < it->it_len);
-			SIMPLEQ_REMOVE_HEAD(&hf->hf_tasks, it_entry);
-			free(it);
+		if (n + 1 == size) {
+			nnames = reallocarray(names, size * 2, sizeof(char *));
+			if (nnames == NULL)
+				goto fail;
+			names = nnames;
+			size *= 2;
 		}
-		if (SIMPLEQ_EMPTY(&hf->hf_tasks) &&
-		    hf->hf_last_access < time(NULL)) {
-			LIST_REMOVE(hf, hf_entry);
-			close(hf->hf_fd);
-			free(hf->hf_path);
-			free(hf);
+		if ((names[n] = strdup(de->d_name)) == NULL)
+			goto fail;
+		n++;
+	}
+	closedir(d);
+	d = NULL;
+	qsort(names, n, sizeof(char *), cmp_names);
+
+	for (i = j = 0; i < n; i++) {
+		(void)history_parse_name(names[i], &hn);
+		if (j > 0 && hn.hn_stamp != NULL && !hn.hn_gz) {
+			(void)history_parse_name(names[j - 1], &prev);
+			if (prev.hn_stamp != NULL &&
+			    prev.hn_baselen == hn.hn_baselen &&
+			    strncmp(names[j - 1], names[i],
+			    hn.hn_baselen + 1 + HISTORY_STAMPLEN) == 0) {
+				free(names[i]);
+				continue;
+			}
 		}
-next_file:
-		;
+		names[j++] = names[i];
+	}
+	names[j] = NULL;
+	return names;
+
+fail:
+	serrno = errno;
+	if (d != NULL)
+		closedir(d);
+	if (names != NULL) {
+		names[n] = NULL;
+		history_list_free(names);
 	}
+	errno = serrno;
+	return NULL;
+}
+
+void
+history_list_free(char **names) {
+	char	**p;
 
+	for (p = names; *p != NULL; p++)
+		free(*p);
+	free(names);
 }
@@ -18,24 +18,83 @@
 #define OICB_HISTORY_H
 
 
+/*
+ * Log files are looked up by (kind, peer) in a hash table. Descriptors
+ * are kept open until evicted by LRU, to avoid reopening log on every line.
+ */
+#define HISTORY_HASH_SIZE	256
+
 LIST_HEAD(history_files_list, history_file);
-extern struct history_files_list history_files;
+TAILQ_HEAD(history_files_tailq, history_file);
 struct history_file {
-	LIST_ENTRY(history_file)	hf_entry;
-	struct icb_task_queue	hf_tasks;
+	LIST_ENTRY(history_file)	hf_entry;	// hash bucket
+	TAILQ_ENTRY(history_file)	hf_lru;		// open files only
+	TAILQ_ENTRY(history_file)	hf_dirty;	// ones having data
+	const char *hf_root;      // session history directory
+	char	*hf_peer;
 	char	*hf_path;
-	size_t	 hf_ntasks;
+	char	*hf_buf;          // lines not written yet
+	size_t	 hf_buflen;
+	size_t	 hf_bufsize;
+	long long hf_deadline;    // when to write hf_buf, in ms
+	long long hf_synced;      // last fsync(2), in ms
+	unsigned int	 hf_hash;
+	int	 hf_nunsynced;    // lines written after last fsync(2)
+	int	 hf_refs;         // open fd + pending data
 	int	 hf_fd;
 	int	 hf_permerr;      // failed to open?
-	time_t	 hf_last_access;
+	char	 hf_kind;         // 'r'oom or 'p'rivate
+
+	// rotation, see history_rotate()
+	size_t	 hf_size;         // of the current log
+	size_t	 hf_rotate_at;    // buffered bytes of the previous day
+	int	 hf_newday;       // hf_rotate_at is valid
+	char	 hf_day[sizeof("0000-00-00")];	// of the last line
+};
+
+/*
+ * Log names are "room-<name>.log" and "private-<nick>.log"; rotated
+ * segments have ".YYYYMMDD-HHMMSS" stamp of rotation time added,
+ * followed by ".gz" when compressed.
+ */
+#define HISTORY_STAMPLEN	(sizeof("00000000-000000") - 1)
+
+struct history_name {
+	const char	*hn_peer;	// points into the name
+	size_t		 hn_peerlen;
+	size_t		 hn_baselen;	// up to and including ".log"
+	const char	*hn_stamp;	// NULL for the current log
+	int		 hn_gz;
+	char		 hn_kind;	// 'r'oom or 'p'rivate
 };
 
+struct icb_session;
+
+void	 history_init(void);
+int	 history_prepare(struct icb_session *s);
 void	 save_history(char type, const char *peer, const char *msg,
 	              int incoming);
 void	 proceed_history(void);
+int	 history_timeout(void);
+void	 flush_history(void);
+void	 history_write_all(void);
+void	 history_pending(size_t *files, size_t *bytes);
+char	 history_target(char type, const char **peer, const char *msg);
 int	 create_dir_for(char *path);
+int	 history_parse_name(const char *name, struct history_name *hn);
+char	**history_list(const char *dir);
+void	 history_list_free(char **names);
 
 extern int		 enable_history;
-extern char		 history_path[PATH_MAX];
+extern int		 history_max_fds;
+extern int		 history_buf_size;
+extern int		 history_delay;
+extern int		 history_sync_lines;
+extern int		 history_sync_secs;
+extern int		 history_threaded;
+extern int		 history_ring_size;
+extern int		 history_drop;
+extern int		 history_rotate_daily;
+extern int		 history_rotate_size;
 
 #endif // OICB_HISTORY_H
@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Counters and histograms of what happens inside, shown with Ctrl+T
+ * and, if requested with -m, appended to file as JSON once in a while.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "oicb.h"
+#include "arena.h"
+#include "clock.h"
+#include "history.h"
+#include "metrics.h"
+#include "session.h"
+
+#define METRICS_DUMP_MAX	32768
+
+struct icb_metrics	 metrics;
+int			 metrics_fd = -1;
+int			 metrics_secs = 10;
+
+static long long	 metrics_next = -1;	// dump time, in ms
+static char		 dump_buf[METRICS_DUMP_MAX];
+static size_t		 dump_len;
+
+static void	 dump_printf(const char *fmt, ...)
+		    __attribute__((__format__ (printf, 1, 2)));
+static void	 dump_types(const char *name, const unsigned long long *msgs,
+		    const unsigned long long *bytes);
+static void	 dump_hist(const char *name, const struct metric_hist *h);
+static void	 net_queued(size_t *live, size_t *peak);
+
+void
+hist_add(struct metric_hist *h, unsigned long long v) {
+	int	 i;
+
+	for (i = 0; i < METRIC_HIST_BUCKETS - 1 && (v >> i) != 0; i++)
+		;
+	h->mh_buckets[i]++;
+	h->mh_count++;
+	h->mh_sum += v;
+	if (v > h->mh_max)
+		h->mh_max = v;
+}
+
+/*
+ * Returns upper bound of the bucket holding the given quantile,
+ * but not more than the maximum value seen.
+ */
+unsigned long long
+hist_quantile(const struct metric_hist *h, double q) {
+	unsigned long long	 seen = 0, need, bound;
+	int			 i;
+
+	if (h->mh_count == 0)
+		return 0;
+	need = (unsigned long long)(q * (double)h->mh_count);
+	if (need == 0)
+		need = 1;
+	for (i = 0; i < METRIC_HIST_BUCKETS; i++) {
+		seen += h->mh_buckets[i];
+		if (seen >= need)
+			break;
+	}
+	bound = (i == 0) ? 0 : (1ULL << i) - 1;
+	return (bound < h->mh_max) ? bound : h->mh_max;
+}
+
+static void
+net_queued(size_t *live, size_t *peak) {
+	struct icb_session	*s;
+
+	*live = *peak = 0;
+	TAILQ_FOREACH(s, &sessions, is_entry) {
+		*live += s->is_net_arena.ta_live;
+		*peak += s->is_net_arena.ta_peak;
+	}
+}
+
+void
+metrics_show(void) {
+	unsigned long long	 in_msgs = 0, in_bytes = 0;
+	unsigned long long	 out_msgs = 0, out_bytes = 0;
+	const char		*sep;
+	size_t			 net_live, net_peak, hist_files, hist_bytes;
+	int			 i;
+
+	for (i = 0; i < 256; i++) {
+		in_msgs += metrics.m_in_msgs[i];
+		in_bytes += metrics.m_in_bytes[i];
+		out_msgs += metrics.m_out_msgs[i];
+		out_bytes += metrics.m_out_bytes[i];
+	}
+	push_stdout("%s: received %llu messages, %llu bytes; sent %llu"
+	    " messages, %llu bytes\n", getprogname(),
+	    in_msgs, in_bytes, out_msgs, out_bytes);
+
+	push_stdout("%s: by type:", getprogname());
+	sep = " ";
+	for (i = 0; i < 256; i++) {
+		if (metrics.m_in_msgs[i] == 0 && metrics.m_out_msgs[i] == 0)
+			continue;
+		push_stdout((i > 0x20 && i < 0x7f) ? "%s%c" : "%s\\x%02x",
+		    sep, i);
+		push_stdout(" %llu/%llu", metrics.m_in_msgs[i],
+		    metrics.m_out_msgs[i]);
+		sep = ", ";
+	}
+	push_stdout("%s\n", (*sep == ' ') ? " none" : " (in/out)");
+	if (metrics.m_ignored > 0 || metrics.m_routed > 0)
+		push_stdout("%s: %llu messages ignored, %llu lines routed\n",
+		    getprogname(), metrics.m_ignored, metrics.m_routed);
+
+	push_stdout("%s: %llu wakeups, %llu syscalls, %llu per wakeup"
+	    " at p99; %llu tasks and %llu chunks allocated\n", getprogname(),
+	    metrics.m_wakeups, metrics.m_syscalls,
+	    hist_quantile(&metrics.m_iter_syscalls, 0.99),
+	    metrics.m_task_allocs, metrics.m_chunk_allocs);
+
+	if (metrics.m_ping_rtt.mh_count > 0)
+		push_stdout("%s: ping round-trip %llu ms median, %llu ms p99,"
+		    " %llu ms max, %llu pings\n", getprogname(),
+		    hist_quantile(&metrics.m_ping_rtt, 0.5),
+		    hist_quantile(&metrics.m_ping_rtt, 0.99),
+		    metrics.m_ping_rtt.mh_max, metrics.m_ping_rtt.mh_count);
+
+	net_queued(&net_live, &net_peak);
+	history_pending(&hist_files, &hist_bytes);
+	push_stdout("%s: queued %zu bytes for terminal (%zu peak),"
+	    " %zu for servers (%zu peak), %zu in %zu history files\n",
+	    getprogname(), stdout_arena.ta_live, stdout_arena.ta_peak,
+	    net_live, net_peak, hist_bytes, hist_files);
+}
+
+static void
+dump_printf(const char *fmt, ...) {
+	va_list	 ap;
+	int	 n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(dump_buf + dump_len, sizeof(dump_buf) - dump_len,
+	    fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		dump_len += (size_t)n;
+	if (dump_len >= sizeof(dump_buf))
+		dump_len = sizeof(dump_buf) - 1;
+}
+
+static void
+dump_types(const char *name, const unsigned long long *msgs,
+    const unsigned long long *bytes) {
+	const char	*sep = "";
+	int		 i;
+
+	dump_printf(",\"%s\":{", name);
+	for (i = 0; i < 256; i++) {
+		if (msgs[i] == 0)
+			continue;
+		if (i > 0x20 && i < 0x7f && i != '"' && i != '\\')
+			dump_printf("%s\"%c\":", sep, i);
+		else
+			dump_printf("%s\"\\u%04x\":", sep, i);
+		dump_printf("[%llu,%llu]", msgs[i], bytes[i]);
+		sep = ",";
+	}
+	dump_printf("}");
+}
+
+static void
+dump_hist(const char *name, const struct metric_hist *h) {
+	dump_printf(",\"%s\":{\"count\":%llu,\"sum\":%llu,\"max\":%llu,"
+	    "\"p50\":%llu,\"p99\":%llu}", name, h->mh_count, h->mh_sum,
+	    h->mh_max, hist_quantile(h, 0.5), hist_quantile(h, 0.99));
+}
+
+/*
+ * Appends a single line JSON object with all metrics to the -m file.
+ */
+void
+metrics_dump(void) {
+	size_t	 net_live, net_peak, hist_files, hist_bytes;
+
+	if (metrics_fd == -1)
+		return;
+	dump_len = 0;
+	dump_printf("{\"ts\":%lld", icb_now.ic_ms);
+	dump_types("in", metrics.m_in_msgs, metrics.m_in_bytes);
+	dump_types("out", metrics.m_out_msgs, metrics.m_out_bytes);
+	dump_printf(",\"wakeups\":%llu,\"syscalls\":%llu,"
+	    "\"task_allocs\":%llu,\"chunk_allocs\":%llu,\"pings_lost\":%llu,"
+	    "\"ignored\":%llu,\"routed\":%llu",
+	    metrics.m_wakeups, metrics.m_syscalls, metrics.m_task_allocs,
+	    metrics.m_chunk_allocs, metrics.m_pings_lost, metrics.m_ignored,
+	    metrics.m_routed);
+	dump_hist("ping_rtt_ms", &metrics.m_ping_rtt);
+	dump_hist("syscalls_per_wakeup", &metrics.m_iter_syscalls);
+	net_queued(&net_live, &net_peak);
+	history_pending(&hist_files, &hist_bytes);
+	dump_printf(",\"queued\":{\"stdout\":%zu,\"stdout_peak\":%zu,"
+	    "\"net\":%zu,\"net_peak\":%zu,\"history\":%zu,"
+	    "\"history_files\":%zu}}\n", stdout_arena.ta_live,
+	    stdout_arena.ta_peak, net_live, net_peak, hist_bytes, hist_files);
+	dump_buf[dump_len - 1] = '\n';    // even if truncated
+
+	if (write(metrics_fd, dump_buf, dump_len) == -1) {
+		warn("metrics dump");
+		close(metrics_fd);
+		metrics_fd = -1;
+	}
+}
+
+/*
+ * The file is opened at once, so it's not subject to unveil(2).
+ * The last dump is made at exit.
+ */
+void
+metrics_open(const char *path) {
+	if ((metrics_fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC,
+	    0666)) == -1)
+		err(1, "%s", path);
+	if (atexit(metrics_dump) == -1)
+		warn("atexit");
+}
+
+int
+metrics_timeout(void) {
+	if (metrics_fd == -1)
+		return -1;
+	if (metrics_next == -1)
+		metrics_next = icb_now.ic_mono + (long long)metrics_secs * 1000;
+	return (metrics_next > icb_now.ic_mono) ?
+	    (int)(metrics_next - icb_now.ic_mono) : 0;
+}
+
+void
+metrics_proceed(void) {
+	if (metrics_fd == -1 || metrics_next == -1 ||
+	    metrics_next > icb_now.ic_mono)
+		return;
+	metrics_dump();
+	metrics_next = icb_now.ic_mono + (long long)metrics_secs * 1000;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef OICB_METRICS_H
+#define OICB_METRICS_H
+
+#define METRIC_HIST_BUCKETS	32
+
+/*
+ * Histogram with power of two buckets: the bucket i counts values
+ * from 2^(i-1) to 2^i - 1, the bucket 0 counts zeroes.
+ */
+struct metric_hist {
+	unsigned long long	 mh_count;
+	unsigned long long	 mh_sum;
+	unsigned long long	 mh_max;
+	unsigned long long	 mh_buckets[METRIC_HIST_BUCKETS];
+};
+
+/*
+ * Counters are updated in place by the code being measured, so they
+ * cost a single increment each. Syscalls are counted for the main
+ * thread only.
+ */
+struct icb_metrics {
+	unsigned long long	 m_in_msgs[256];	// by ICB message type
+	unsigned long long	 m_in_bytes[256];
+	unsigned long long	 m_out_msgs[256];
+	unsigned long long	 m_out_bytes[256];
+	unsigned long long	 m_wakeups;
+	unsigned long long	 m_syscalls;
+	unsigned long long	 m_task_allocs;
+	unsigned long long	 m_chunk_allocs;
+	unsigned long long	 m_pings_lost;		// unmatched pongs
+	unsigned long long	 m_ignored;		// by rules
+	unsigned long long	 m_routed;		// lines written
+	struct metric_hist	 m_ping_rtt;		// in ms
+	struct metric_hist	 m_iter_syscalls;	// per wakeup
+};
+
+extern struct icb_metrics	 metrics;
+extern int			 metrics_fd;
+extern int			 metrics_secs;
+
+void			 hist_add(struct metric_hist *h, unsigned long long v);
+unsigned long long	 hist_quantile(const struct metric_hist *h, double q);
+
+void	 metrics_open(const char *path);
+void	 metrics_show(void);
+void	 metrics_dump(void);
+int	 metrics_timeout(void);
+void	 metrics_proceed(void);
+
+#endif // OICB_METRICS_H
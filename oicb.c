@@ -18,6 +18,7 @@
 #include <sys/queue.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <arpa/nameser.h>
@@ -30,7 +31,6 @@
 #include <limits.h>
 #include <locale.h>
 #include <netdb.h>
-#include <poll.h>
 #include <resolv.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -46,64 +46,127 @@
 #include <readline/readline.h>
 
 #include "oicb.h"
+#include "archive.h"
+#include "arena.h"
 #include "chat.h"
+#include "clock.h"
+#include "connect.h"
+#include "event.h"
+#include "filter.h"
 #include "history.h"
+#include "metrics.h"
+#include "record.h"
 #include "private.h"
+#include "sched.h"
+#include "scrollback.h"
+#include "search.h"
+#include "session.h"
+#include "transport.h"
 #include "utf8.h"
+#include "who.h"
 
 #ifndef HAVE_RL_BIND_KEYSEQ
 static inline int	rl_bind_keyseq(const char *keyseq, int(*function)(int, int));
 #endif
 
-enum ICBState state = Connecting;
-enum SrvFeatures srv_features = Ping;
-
 enum {
-	Network = 0,
-	Stdout,
+	Stdout = 0,
 	Stdin,
 	MainFDCount
 };
-struct pollfd	 *pfd;
-size_t		  npfd = 0;
+static int	 main_fds[MainFDCount];
 static const char *stream_names[] = {
-	"network",
 	"stdout",
 	"stdin",
 };
 
-struct icb_task_queue tasks_stdout, tasks_net;
+#define RENDER_MAX_PENDING	(256 * 1024)
+
+static int	 frame_ms = 16;
+static long long render_at = -1;	// when queued output is to be shown
+
+static int	 stdout_bol = 1;	// nothing queued after last newline
+
+// headless mode input
+static char	*in_buf;
+static size_t	 in_len, in_size;
+static int	 in_eof;
+static int	 in_eof_pinged;
+static int	 oneshot;	// lines given with -e, stdin isn't read
+
+/*
+ * Values adjustable with "-o name=value" command line option.
+ */
+static const struct tunable {
+	const char	*name;
+	int		*value;
+	int		 min, max;
+} tunables[] = {
+	{ "conndelay",	&connect_delay,	10,	60000 },
+	{ "frame",	&frame_ms,	0,	1000 },
+	{ "grepmax",	&search_max_matches, 1,	INT_MAX },
+	{ "histbuf",	&history_buf_size, 0,	INT_MAX },
+	{ "histdelay",	&history_delay,	0,	INT_MAX },
+	{ "histdrop",	&history_drop,	0,	1 },
+	{ "histfds",	&history_max_fds, 1,	INT_MAX },
+	{ "histgzip",	&archive_level,	0,	9 },
+	{ "histring",	&history_ring_size, 4096, INT_MAX / 2 },
+	{ "histrotate",	&history_rotate_daily, 0, 1 },
+	{ "histrotsize", &history_rotate_size, 0, INT_MAX },
+	{ "histsync",	&history_sync_lines, 0,	INT_MAX },
+	{ "histsyncsecs", &history_sync_secs, 0, INT_MAX / 1000 },
+	{ "histthread",	&history_threaded, 0,	1 },
+	{ "maxmsg",	&max_msg_size,	256,	INT_MAX },
+	{ "metricsecs",	&metrics_secs,	1,	INT_MAX / 1000 },
+	{ "privchats",	&priv_chats_max, 1,	INT_MAX },
+	{ "reconnmax",	&reconnect_max,	1000,	INT_MAX / 2 },
+	{ "reconnmin",	&reconnect_min,	100,	INT_MAX / 2 },
+	{ "scrollback",	&scrollback_size, 0,	INT_MAX / 2 },
+	{ "scrollwarm",	&scrollback_warm_size, 0, INT_MAX / 2 },
+	{ "sendburst",	&send_burst,	256,	INT_MAX / 1000 },
+	{ "sendmsgburst", &send_msg_burst, 1,	INT_MAX / 1000 },
+	{ "sendmsgrate", &send_msg_rate, 0,	INT_MAX / 1000 },
+	{ "sendrate",	&send_rate,	0,	INT_MAX / 1000 },
+	{ "tlsverify",	&tls_verify,	0,	1 },
+	{ "whosort",	&who_sort,	WhoSortNone, WhoSortSignon },
+};
+
+struct icb_task_queue tasks_stdout;
+struct task_arena stdout_arena;
 
 int		 debug = 0;
-int		 sock = -1, histfile = -1;
+int		 headless = 0;
+int		 histfile = -1;
 volatile int	 want_exit = 0;
 volatile int	 want_info = 0;
-char		*nick, *hostname, *room;
-size_t		 nicklen;
 char		*o_rl_buf = NULL;
 int		 o_rl_point, o_rl_mark;
-int		 pings_sent = 0;
 int		 utf8_ready = 0;
+int		 max_msg_size = 1024 * 1024;
 
 
-void	 usage(const char *msg);
+void	 set_tunables(char *opts);
 void	 pledge_me(void);
 int	 test_cmd(int count, int key);
 
-size_t	 push_data(int fd, char *data, size_t len);
-void	 proceed_output(struct icb_task_queue *q, int fd);
-char	*get_next_icb_msg(size_t *msglen);
+char	*get_next_icb_msg(struct icb_session *s, size_t *msglen);
 
-void	 update_pollfds(void);
+void	 update_events(void);
 #ifdef SIGINFO
 void	 siginfo_handler(int sig);
 #endif
 int	 siginfo_cmd(int count, int key);
 void	 prepare_stdout(void);
+static struct icb_task	*stdout_task(size_t datalen);
+static int	 vpush_stdout(int untrusted, const char *text, va_list ap);
 void	 restore_rl(void);
-void	 icb_connect(const char *addr, const char *port);
+static void	 render_stdout(void);
+static void	 add_input_line(const char *line);
+static void	 read_stdin_lines(void);
+static void	 proceed_stdin_lines(void);
+static int	 render_timeout(void);
 
-char	*null_completer(const char *text, int cmpl_state);
+char	*nick_completer(const char *text, int cmpl_state);
 
 // readline wrappers
 int	cycle_priv_chats_forward(int count, int key);
@@ -150,14 +213,14 @@ void
 restore_rl(void) {
 	size_t	 len;
 
-	if (repeat_priv_nick) {
+	if (repeat_priv_nick && priv_chats_last() != NULL) {
 		rl_clear_message();
 		rl_point = 0;
 		if (prefer_long_priv_cmd)
 			rl_insert_text("/msg ");
 		else
 			rl_insert_text("/m ");
-		rl_insert_text(priv_chats_nicks[0]);
+		rl_insert_text(priv_chats_last());
 		rl_insert_text(" ");
 		kill(getpid(), SIGWINCH);
 		repeat_priv_nick = 0;
@@ -168,88 +231,145 @@ restore_rl(void) {
 		rl_point = o_rl_point;
 		rl_mark = o_rl_mark;
 		rl_redisplay();
+		repeat_priv_nick = 0;
 	}
 
 	free(o_rl_buf);
 	o_rl_buf = NULL;
 }
 
+static struct icb_task *
+stdout_task(size_t datalen) {
+	struct icb_task	*it;
+
+	it = task_alloc(&stdout_arena, datalen);
+	SIMPLEQ_INSERT_TAIL(&tasks_stdout, it, it_entry);
+	return it;
+}
+
 /*
- * Queue text coming from trusted source to be displayed.
- *
- * The data at 'text' won't be accessed after return, its contents will be
- * copied to internal buffer for the further processing.
+ * Format text right at the end of stdout queue, growing the last queued
+ * task in place, so in most cases the text is formatted in a single pass
+ * without intermediate buffers. Text coming from untrusted source is
+ * sanitized: the valid prefix is kept as is, and the rest, starting from
+ * the first invalid byte, is processed with strvis(3).
+ * When there are several sessions, lines are prefixed with session number.
  *
  * Returns number of bytes queued, not including terminating NUL.
  */
-int
-push_stdout(const char *text, ...) {
+static int
+vpush_stdout(int untrusted, const char *text, va_list ap) {
+	static char	*scratch = NULL;
+	static size_t	 scratchsz = 0;
 	struct icb_task	*it;
-	int		 len;
-	va_list		 ap;
-
-	va_start(ap, text);
-	len = vsnprintf(NULL, 0, text, ap);
-	va_end(ap);
-	if (len == 0)
+	va_list		 aq;
+	size_t		 avail, len, valid, nsize;
+	char		*dst, *nbuf;
+	int		 n;
+
+	if (output_format != OutText) {
+		// keep the stream parseable, but don't hide what's going on
+		if (!untrusted)
+			vfprintf(stderr, text, ap);
 		return 0;
-	it = calloc(1, sizeof(struct icb_task) + len + 1);
-	if (it == NULL)
+	}
+	if (stdout_bol && nsessions > 1 && session != NULL && *text) {
+		stdout_bol = 0;
+		push_stdout("#%d ", session->is_id);
+	}
+
+	if ((it = task_arena_last(&stdout_arena)) == NULL)
+		it = stdout_task(0);
+	avail = task_room(it) - it->it_len;
+	va_copy(aq, ap);
+	n = vsnprintf(it->it_data + it->it_len, avail, text, aq);
+	va_end(aq);
+	if (n < 0)
 		err(1, __func__);
-	it->it_len = len + 1;
-	va_start(ap, text);
-	vsnprintf(it->it_data, len + 1, text, ap);
-	va_end(ap);
-	SIMPLEQ_INSERT_TAIL(&tasks_stdout, it, it_entry);
-	return len;
+	if (n == 0)
+		return 0;
+	len = (size_t)n;
+	if (len >= avail) {
+		// doesn't fit in current chunk, happens rarely
+		it = stdout_task(len + 1);
+		vsnprintf(it->it_data, len + 1, text, ap);
+	}
+	dst = it->it_data + it->it_len;
+
+	if (untrusted) {
+		valid = utf8_ready ? mbsvalidlen(dst, len) : 0;
+		if (valid < len) {
+			if (len + 1 > scratchsz) {
+				nsize = scratchsz ? scratchsz : 1024;
+				while (nsize < len + 1)
+					nsize *= 2;
+				if ((nbuf = realloc(scratch, nsize)) == NULL)
+					err(1, __func__);
+				scratch = nbuf;
+				scratchsz = nsize;
+			}
+			memcpy(scratch, dst, len + 1);
+			if (it->it_len + valid + (len - valid) * 4 + 1 >
+			    task_room(it)) {
+				it = stdout_task(valid + (len - valid) * 4 + 1);
+				dst = it->it_data;
+				memcpy(dst, scratch, valid);
+			}
+			len = valid + (size_t)strvis(dst + valid, scratch + valid,
+			    VIS_SAFE|VIS_NOSLASH|VIS_NL);
+		}
+	}
+
+	it->it_len += len;
+	task_resize(it, it->it_len);
+	stdout_bol = it->it_data[it->it_len - 1] == '\n';
+	return (int)len;
 }
 
+static struct icb_task	*reserved_task;
+
 /*
- * Queue text coming from possibly untrusted source to be displayed.
- * The data will be processed with strvis(3) internally, if needed.
- *
- * The data at 'text' won't be accessed after return, its contents will be
- * copied to internal buffer for the further processing.
- *
- * Returns number of bytes queued, not including terminating NUL.
+ * Returns buffer for up to len bytes at the end of stdout queue,
+ * to be filled by caller and confirmed with stdout_commit().
  */
+char *
+stdout_reserve(size_t len) {
+	struct icb_task	*it;
+
+	it = task_arena_last(&stdout_arena);
+	if (it == NULL || task_room(it) - it->it_len < len)
+		it = stdout_task(len);
+	reserved_task = it;
+	return it->it_data + it->it_len;
+}
+
+void
+stdout_commit(size_t len) {
+	reserved_task->it_len += len;
+	task_resize(reserved_task, reserved_task->it_len);
+	reserved_task = NULL;
+}
+
 int
-push_stdout_untrusted(const char *text, ...) {
-	struct icb_task	*it, *tmp = NULL;
-	size_t		 len, buflen;
-	va_list		 ap;
-	char		*fmtbuf;
+push_stdout(const char *text, ...) {
+	va_list	 ap;
+	int	 len;
 
 	va_start(ap, text);
-	len = vsnprintf(NULL, 0, text, ap);
+	len = vpush_stdout(0, text, ap);
 	va_end(ap);
-	if (len == 0)
-		return 0;
+	return len;
+}
 
-	it = calloc(1, sizeof(struct icb_task) + len + 1);
-	if (it == NULL)
-		err(1, __func__);
+int
+push_stdout_untrusted(const char *text, ...) {
+	va_list	 ap;
+	int	 len;
 
 	va_start(ap, text);
-	vsnprintf(it->it_data, len + 1, text, ap);
+	len = vpush_stdout(1, text, ap);
 	va_end(ap);
-
-	if (utf8_ready && mbsvalidate(it->it_data) != -1) {
-		it->it_len = len + 1;
-		goto finish;
-	}
-
-	buflen = len * 4 + 1;
-	tmp = calloc(1, sizeof(struct icb_task) + buflen);
-	if (tmp == NULL)
-		err(1, __func__);
-	tmp->it_len = strvis(tmp->it_data, it->it_data, VIS_SAFE|VIS_NOSLASH|VIS_NL) + 1;
-	free(it);
-	it = tmp;
-
-finish:
-	SIMPLEQ_INSERT_TAIL(&tasks_stdout, it, it_entry);
-	return (int)it->it_len;
+	return len;
 }
 
 // Input: line input from user
@@ -344,257 +464,489 @@ list_priv_chats_nicks_wrapper(int count, int key) {
 	return 0;
 }
 
-size_t
-push_data(int fd, char *data, size_t len) {
-	ssize_t	nwritten = 0;
-	size_t	total = 0;
-
-	while (len > 0 && (nwritten = write(fd, data, len)) >= 0) {
-		len -= (size_t) nwritten;
-		data += nwritten;
-		total += nwritten;
-	}
-	if (nwritten != -1 || errno == EAGAIN)
-		return total;
-	err(2, __func__);
-}
-
 /*
- * Push queued text.
+ * Push queued data, gathering up to IOV_MAX tasks in a single writev(2).
+ * Callbacks of tasks are called in queue order, as soon as task is done.
+ * Data for server goes through session transport, if s is not NULL.
  */
 void
-proceed_output(struct icb_task_queue *q, int fd) {
+proceed_output(struct icb_task_queue *q, int fd, struct icb_session *s) {
+	struct iovec	 iov[IOV_MAX];
 	struct icb_task	*it;
-	size_t		 nwritten;
+	size_t		 left, total;
+	ssize_t		 nwritten;
+	const char	*errstr;
+	int		 iovcnt;
 
 	while (!SIMPLEQ_EMPTY(q)) {
-		it = SIMPLEQ_FIRST(q);
-		nwritten = push_data(fd, it->it_data + it->it_ndone,
-			it->it_len - it->it_ndone);
+		iovcnt = 0;
+		total = 0;
+		SIMPLEQ_FOREACH(it, q, it_entry) {
+			if (iovcnt == IOV_MAX)
+				break;
+			iov[iovcnt].iov_base = it->it_data + it->it_ndone;
+			iov[iovcnt].iov_len = it->it_len - it->it_ndone;
+			total += iov[iovcnt].iov_len;
+			iovcnt++;
+		}
+		metrics.m_syscalls++;
+		if (s != NULL)
+			nwritten = s->is_transport->tr_writev(s, iov, iovcnt);
+		else
+			nwritten = writev(fd, iov, iovcnt);
+		if (nwritten == -1) {
+			if (errno == EAGAIN)
+				return;
+			if (s == NULL)
+				err(2, __func__);
+			// like read errors in get_next_icb_msg()
+			errstr = s->is_transport->tr_strerror(s, errno);
+			if (session_retry(s, "Server %s: %s", s->is_hostname,
+			    errstr))
+				return;
+			if (nsessions == 1)
+				errx(1, "%s: write: %s", __func__, errstr);
+			push_stdout("Server %s: %s\n", s->is_hostname, errstr);
+			session_close(s);
+			return;
+		}
 		if (debug >= 2) {
-			warnx("output %zu from %zu bytes at fileno %d",
-			    it->it_ndone, it->it_len, fd);
+			warnx("output %zd from %zu bytes in %d tasks at fileno %d",
+			    nwritten, total, iovcnt, fd);
+		}
+
+		while (iovcnt-- > 0) {
+			it = SIMPLEQ_FIRST(q);
+			left = it->it_len - it->it_ndone;
+			if (left > (size_t)nwritten) {
+				// short write, no more room for now
+				it->it_ndone += (size_t)nwritten;
+				return;
+			}
+			nwritten -= (ssize_t)left;
+			it->it_ndone = it->it_len;
+			SIMPLEQ_REMOVE_HEAD(q, it_entry);
+			if (it->it_cb)
+				(*it->it_cb)(it);
+			task_free(it);
 		}
-		it->it_ndone += nwritten;
-		if (it->it_ndone < it->it_len)
-			break;
-		SIMPLEQ_REMOVE_HEAD(q, it_entry);
-		if (it->it_cb)
-			(*it->it_cb)(it);
-		free(it);
 	}
 }
 
 /*
- * Extract next incoming ICB message on the network socket.
+ * Incoming data is read into the session ring buffer, where packets are
+ * scanned in place. Payloads of multi-packet messages are gathered into
+ * is_rx_msg, so every byte is copied at most once; single-packet messages
+ * already ending with NUL are handed out directly from the ring.
+ */
+static char	*rx_extract(struct icb_session *s, size_t *msglen);
+static int	 rx_append(struct icb_session *s, const unsigned char *data,
+		    size_t len);
+
+/*
+ * Append bytes to the message under reassembly, growing the buffer up to
+ * max_msg_size bytes. Returns -1 when limit is exceeded.
+ */
+static int
+rx_append(struct icb_session *s, const unsigned char *data, size_t len) {
+	size_t	 nsize;
+	char	*nmsg;
+
+	// +1 for trailing NUL
+	if (s->is_rx_msglen + len + 1 > s->is_rx_msgsize) {
+		if (s->is_rx_msglen + len + 1 > (size_t)max_msg_size)
+			return -1;
+		nsize = s->is_rx_msgsize ? s->is_rx_msgsize : 1024;
+		while (nsize < s->is_rx_msglen + len + 1)
+			nsize *= 2;
+		if (nsize > (size_t)max_msg_size)
+			nsize = (size_t)max_msg_size;
+		if ((nmsg = realloc(s->is_rx_msg, nsize)) == NULL)
+			err(1, "%s: realloc", __func__);
+		s->is_rx_msg = nmsg;
+		s->is_rx_msgsize = nsize;
+	}
+	memcpy(s->is_rx_msg + s->is_rx_msglen, data, len);
+	s->is_rx_msglen += len;
+	return 0;
+}
+
+/*
+ * Consume complete packets available in the ring.
+ * Returns a message when its ending packet was consumed, NULL otherwise.
+ */
+static char *
+rx_extract(struct icb_session *s, size_t *msglen) {
+	unsigned char	*pkt, type;
+	size_t		 pktlen, datalen, off, first;
+	int		 final;
+
+	while (s->is_rx_fill > 0) {
+		pkt = s->is_rx_ring + s->is_rx_head;
+		// zero length byte means 255 bytes of continuation packet
+		pktlen = (*pkt == 0) ? 256 : (size_t)*pkt + 1;
+		if (s->is_rx_fill < pktlen)
+			return NULL;    // not received whole packet yet
+		final = *pkt != 0;
+		type = s->is_rx_ring[(s->is_rx_head + 1) & (RX_RING_SIZE - 1)];
+
+		if (final && s->is_rx_msglen == 0 && !s->is_rx_discard &&
+		    s->is_rx_head + pktlen <= RX_RING_SIZE && pktlen > 2 &&
+		    pkt[pktlen - 1] == '\0') {
+			// fast path: NUL-terminated message, contiguous in ring
+			s->is_rx_head = (s->is_rx_head + pktlen) &
+			    (RX_RING_SIZE - 1);
+			s->is_rx_fill -= pktlen;
+			*msglen = pktlen - 2;
+			return (char *)(pkt + 1);
+		}
+
+		if (s->is_rx_msglen == 0 && !s->is_rx_discard)
+			(void)rx_append(s, &type, 1);
+		else if ((unsigned char)s->is_rx_msg[0] != type)
+			// XXX Or just ignore? Which to use then?
+			errx(2, "message types messed up in a single message");
+
+		// payload, stripping NUL ending the packet, if any
+		off = (s->is_rx_head + 2) & (RX_RING_SIZE - 1);
+		datalen = pktlen - 2;
+		if (datalen > 0 &&
+		    s->is_rx_ring[(off + datalen - 1) & (RX_RING_SIZE - 1)] == '\0')
+			datalen--;
+		if (!s->is_rx_discard) {
+			first = RX_RING_SIZE - off;
+			if (first > datalen)
+				first = datalen;
+			if (rx_append(s, s->is_rx_ring + off, first) == -1 ||
+			    rx_append(s, s->is_rx_ring, datalen - first) == -1) {
+				// keep type byte for the check above
+				s->is_rx_discard = 1;
+				s->is_rx_msglen = 1;
+			}
+		}
+		s->is_rx_head = (s->is_rx_head + pktlen) & (RX_RING_SIZE - 1);
+		s->is_rx_fill -= pktlen;
+
+		if (!final)
+			continue;
+		if (s->is_rx_discard) {
+			push_stdout("message of type '%c' is longer than %d"
+			    " bytes, ignored\n", s->is_rx_msg[0], max_msg_size);
+			s->is_rx_discard = 0;
+			s->is_rx_msglen = 0;
+			continue;
+		}
+		s->is_rx_msg[s->is_rx_msglen] = '\0';
+		// type byte included, as in fast path
+		*msglen = s->is_rx_msglen;
+		s->is_rx_msglen = 0;
+		return s->is_rx_msg;
+	}
+	return NULL;
+}
+
+/*
+ * Extract next incoming ICB message on the session socket.
  *
  * Returned pointer contains message type in the first byte,
  * with data bytes following it. Data always ends with NUL,
  * which isn't taken into account of msglen returned.
  *
- * Returned pointer will be valid until next call of get_next_icb_msg().
+ * Returned pointer will be valid until next call of get_next_icb_msg()
+ * for the same session.
  */
 char*
-get_next_icb_msg(size_t *msglen) {
-	static unsigned char	*buf = NULL, *msgend = NULL;
-	static size_t		 bufread = 0, bufsize = 1024;
-
-	unsigned char	*lastpkt, *pkt, *nbuf;
-	size_t		 roundread = 0;
-	ssize_t		 nread, shift;
-
-	if (buf == NULL) {
-		if ((buf = malloc(bufsize)) == NULL)
-			err(1, "%s: malloc", __func__);
-
-	} else if (msgend) {
-		// resetting state
-		memmove(buf, msgend, bufread - (msgend - buf));
-		bufread -= (msgend - buf);
-		msgend = NULL;
-	}
+get_next_icb_msg(struct icb_session *s, size_t *msglen) {
+	struct iovec	 iov[2];
+	size_t		 tail;
+	ssize_t		 nread;
+	const char	*errstr;
+	char		*msg;
+	int		 iovcnt;
 
 	for (;;) {
-		// Reserve one byte for ending NUL in case it's missing in the
-		// input packet, see the "msglen++" block at the end of function.
-		if (bufread == bufsize - 1) {
-			if (bufsize >= 1024*1024)
-				err(2, "too long message");
-			if ((nbuf = reallocarray(buf, 2, bufsize)) == NULL)
-				err(1, "%s: reallocarray", __func__);
-			buf = nbuf;
-			bufsize *= 2;
+		if ((msg = rx_extract(s, msglen)) != NULL)
+			return msg;
+
+		// read as much as fits, possibly wrapping around ring end
+		tail = (s->is_rx_head + s->is_rx_fill) & (RX_RING_SIZE - 1);
+		iov[0].iov_base = s->is_rx_ring + tail;
+		if (tail >= s->is_rx_head) {
+			iov[0].iov_len = RX_RING_SIZE - tail;
+			iov[1].iov_base = s->is_rx_ring;
+			iov[1].iov_len = s->is_rx_head;
+			iovcnt = s->is_rx_head ? 2 : 1;
+		} else {
+			iov[0].iov_len = RX_RING_SIZE - s->is_rx_fill;
+			iovcnt = 1;
 		}
-		nread = read(sock, buf + bufread, bufsize - bufread - 1);
+		metrics.m_syscalls++;
+		nread = s->is_transport->tr_readv(s, iov, iovcnt);
 		if (nread < 0) {
-			if (errno != EAGAIN)
-				err(1, "%s: read", __func__);
-			break;
+			if (errno == EAGAIN)
+				return NULL;
+			errstr = s->is_transport->tr_strerror(s, errno);
+			if (session_retry(s, "Server %s: %s", s->is_hostname,
+			    errstr))
+				return NULL;
+			if (nsessions == 1)
+				errx(1, "%s: read: %s", __func__, errstr);
+			push_stdout("Server %s: %s\n", s->is_hostname, errstr);
+			session_close(s);
+			return NULL;
 		} else if (nread == 0) {
-			push_stdout("Server %s closed connection, exiting...\n",
-			                hostname);
-			want_exit = 1;
-			break;
-		}
-		roundread += nread;
-		bufread += nread;
-	}
-	if (bufread == 0 && roundread == 0)
-		return NULL;
-
-	for (lastpkt = buf; lastpkt[0] == 0; lastpkt += 256) {
-		if (buf + bufread - 256 < lastpkt)
-			return NULL;    // not received ending packet yet
-	}
-	// now lastpkt points to the ending packet
-	if (buf + bufread - lastpkt[0] < lastpkt)
-		return NULL;    // not received ending packet fully yet
-
-	msgend = lastpkt + 1 + lastpkt[0];
-
-	// got full message, now remove extra data to get continious bytes
-	for (pkt = buf; pkt <= lastpkt; pkt += 256) {
-		if (pkt[1] != lastpkt[1])
-			// XXX Or just ignore? Which to use then?
-			err(2, "message types messed up in a single message");
-		if (pkt != buf) {
-			shift = (pkt[-1] == '\0') ? 3 : 2;
-			memmove(pkt + 2 - shift, pkt + 2, buf + bufread - (pkt + 2));
-			bufread -= shift;
-			lastpkt -= shift;
-			pkt -= shift;
+			if (session_retry(s, "Server %s closed connection",
+			    s->is_hostname))
+				return NULL;
+			push_stdout("Server %s closed connection%s\n",
+			                s->is_hostname,
+			                (nsessions == 1) ? ", exiting..." : "");
+			session_close(s);
+			return NULL;
 		}
+		s->is_rx_fill += (size_t)nread;
 	}
-
-	// There always will be a place for NUL, see main read loop.
-	if (msgend[-1] != '\0') {
-		memmove(msgend + 1, msgend, bufread - (msgend - buf));
-		*msgend++ = '\0';
-	}
-
-	// -1 to skip initial byte count byte, another -1 for trailing NUL
-	*msglen = msgend - buf - 2;
-	return (char*)(buf + 1);
 }
 
+/*
+ * Completes nicks seen in the last "/w" output of the active session.
+ */
 char *
-null_completer(const char *text, int cmpl_state) {
-	(void)text;
-	(void)cmpl_state;
-	return NULL;
+nick_completer(const char *text, int cmpl_state) {
+	static size_t	 pos;
+	const char	*nick;
+	char		*p;
+
+	if (cmpl_state == 0)
+		pos = 0;
+	if (active_session == NULL ||
+	    (nick = who_complete(active_session, text, &pos)) == NULL)
+		return NULL;
+	if ((p = strdup(nick)) == NULL)
+		err(1, __func__);
+	return p;
 }
 
 __dead void
 usage(const char *msg) {
 	if (msg)
 		fprintf(stderr, "%s\n", msg);
-	fprintf(stderr, "usage: %s [-dH] [-t secs] [nick@]host[:port] room\n",
+	fprintf(stderr, "usage: %s [-bdHrs] [-e message] [-f format] [-m file]"
+	    " [-o name=value[,...]] [-t secs]"
+	    " [nick@]host[:port] room ...\n",
 	    getprogname());
 	exit (1);
 }
 
+/*
+ * Parse comma-separated list of name=value pairs given to -o.
+ */
 void
-update_pollfds(void) {
-	const struct history_file	*hfile;
-	size_t				 newnpfd;
-	int				 i;
-
-	newnpfd = MainFDCount;
-	LIST_FOREACH(hfile, &history_files, hf_entry)
-		newnpfd++;
-	if (npfd < newnpfd) {
-		pfd = reallocarray(pfd, newnpfd, sizeof(struct pollfd));
-		if (pfd == NULL)
-			err(1, __func__);
-		npfd = newnpfd;
+set_tunables(char *opts) {
+	const struct tunable	*tp;
+	const char		*errstr;
+	char			*name, *value;
+	size_t			 i;
+
+	while ((name = strsep(&opts, ",")) != NULL) {
+		if (*name == '\0')
+			continue;
+		if ((value = strchr(name, '=')) == NULL)
+			errx(1, "missing value for option %s", name);
+		*value++ = '\0';
+		tp = NULL;
+		for (i = 0; i < sizeof(tunables)/sizeof(tunables[0]); i++)
+			if (strcmp(name, tunables[i].name) == 0) {
+				tp = &tunables[i];
+				break;
+			}
+		if (tp == NULL)
+			errx(1, "unknown option: %s", name);
+		*tp->value = (int)strtonum(value, tp->min, tp->max, &errstr);
+		if (errstr)
+			errx(1, "invalid %s value: %s", name, errstr);
 	}
+}
 
-	memset(pfd, 0, sizeof(struct pollfd) * npfd);
+/*
+ * Interest is kept by event backend, so only changes reach the kernel.
+ * History files are regular ones and never block, they're not watched.
+ */
+void
+update_events(void) {
+	struct icb_session	*s;
+
+	main_fds[Stdout] = STDOUT_FILENO;
+	main_fds[Stdin] = STDIN_FILENO;
+
+	// input lines are held until login, see push_icb_msg()
+	if (!headless)
+		event_set(STDIN_FILENO, EVENT_READ);
+	else if (!in_eof)
+		// don't read commands until they could be sent
+		event_set(STDIN_FILENO,
+		    (active_session->is_state == Chat) ? EVENT_READ : 0);
+	// until frame is over, we don't care whether stdout is writable
+	event_set(STDOUT_FILENO,
+	    (render_at != -1 && render_at <= icb_now.ic_mono) ? EVENT_WRITE : 0);
+	TAILQ_FOREACH(s, &sessions, is_entry)
+		if (!s->is_dead && s->is_state != Connecting)
+			event_set(s->is_sock, s->is_transport->tr_events(s,
+			    !SIMPLEQ_EMPTY(&s->is_tasks_net)));
+	// rate limited output is sent by timeout, see sched_timeout()
+	connect_events();
+}
 
-	pfd[Stdin].fd = STDIN_FILENO;
-	pfd[Stdin].events = (state == Connecting) ? 0 : POLLIN;
+/*
+ * Queued output is shown in frames: everything arrived during frame_ms
+ * since the first line got queued is printed in a single erase, print
+ * and redraw cycle. Too much output, exiting or prefilling input line
+ * cause immediate redraw.
+ */
+static void
+render_stdout(void) {
+	if (render_timeout() == -1 && !repeat_priv_nick)
+		return;
+	if (!repeat_priv_nick && !want_exit && render_at > icb_now.ic_mono &&
+	    stdout_arena.ta_live < RENDER_MAX_PENDING)
+		return;
 
-	pfd[Stdout].fd = STDOUT_FILENO;
-	pfd[Stdout].events = 0;
-	if (!SIMPLEQ_EMPTY(&tasks_stdout))
-		pfd[Stdout].events |= POLLOUT;
+	if (headless) {
+		repeat_priv_nick = 0;
+		proceed_output(&tasks_stdout, STDOUT_FILENO, NULL);
+	} else {
+		prepare_stdout();
+		proceed_output(&tasks_stdout, STDOUT_FILENO, NULL);
+		restore_rl();
+	}
+	// the rest goes out as soon as stdout becomes writable
+	render_at = SIMPLEQ_EMPTY(&tasks_stdout) ? -1 : icb_now.ic_mono;
+}
 
-	pfd[Network].fd = sock;
-	pfd[Network].events = POLLIN;
-	if (!SIMPLEQ_EMPTY(&tasks_net))
-		pfd[Network].events |= POLLOUT;
+/*
+ * Headless mode: read whatever is available on stdin.
+ */
+static void
+read_stdin_lines(void) {
+	ssize_t	 n;
+	char	*p;
 
-	i = 0;
-	LIST_FOREACH(hfile, &history_files, hf_entry) {
-		pfd[MainFDCount + i].fd = hfile->hf_fd;
-		if (hfile->hf_ntasks)
-			pfd[MainFDCount + i].events = POLLOUT;
-		i++;
+	if (in_size - in_len < 1024) {
+		if ((p = realloc(in_buf, in_size ? in_size * 2 : 4096)) == NULL)
+			err(1, __func__);
+		in_buf = p;
+		in_size = in_size ? in_size * 2 : 4096;
 	}
+	metrics.m_syscalls++;
+	n = read(STDIN_FILENO, in_buf + in_len, in_size - in_len - 1);
+	if (n == -1) {
+		if (errno != EAGAIN && errno != EINTR)
+			err(1, "stdin");
+	} else if (n == 0) {
+		in_eof = 1;
+		event_del(STDIN_FILENO);
+	} else
+		in_len += n;
 }
 
-void
-icb_connect(const char *addr, const char *port) {
-	struct addrinfo		*res, *p, hints;
-	int			 ec;
-
-	if (port == NULL)
-		port = "7326";
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = PF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	if ((ec = getaddrinfo(addr, port, &hints, &res)) != 0)
-		errx(1, "could not resolve host/port name: %s",
-		    gai_strerror(ec));
-	for (p = res; p != NULL; p = p->ai_next) {
-		if ((sock = socket(p->ai_family, p->ai_socktype|SOCK_NONBLOCK,
-		    p->ai_protocol)) == -1) {
-			warn("%s: socket", __func__);
-			continue;
-		}
-		if (connect(sock, (struct sockaddr *)p->ai_addr,
-		    p->ai_addrlen) == -1) {
-			if (errno != EINPROGRESS) {
-				/* make sure we'll report connect()'s error */
-				ec = errno;
-				close(sock);
-				errno = ec;
-				continue;
-			}
-			state = Connecting;
-			push_stdout("Connecting to %s ... ", hostname);
-		} else {
-			state = Connected;
-			push_stdout("Connected to %s\n", hostname);
+/*
+ * One-shot mode: queue line given on command line as if read from stdin.
+ */
+static void
+add_input_line(const char *line) {
+	size_t	 len;
+	char	*p;
+
+	len = strlen(line);
+	if (in_len + len + 1 > in_size) {
+		in_size = in_len + len + 1;
+		if ((p = realloc(in_buf, in_size)) == NULL)
+			err(1, __func__);
+		in_buf = p;
+	}
+	memcpy(in_buf + in_len, line, len);
+	in_buf[in_len + len] = '\n';
+	in_len += len + 1;
+}
+
+/*
+ * Headless mode: pass complete lines from stdin as if they were typed,
+ * once we're logged in. Incomplete last line is taken at end of file.
+ */
+static void
+proceed_stdin_lines(void) {
+	char	*line, *nl;
+	size_t	 off = 0;
+
+	// active session may be switched by any line
+	while (!want_exit && off < in_len &&
+	    active_session->is_state == Chat) {
+		line = in_buf + off;
+		if ((nl = memchr(line, '\n', in_len - off)) == NULL) {
+			if (!in_eof)
+				break;
+			nl = in_buf + in_len;
 		}
-		freeaddrinfo(res);
-		return;
+		*nl = '\0';
+		if (nl > line && nl[-1] == '\r')
+			nl[-1] = '\0';
+		off = (size_t)(nl - in_buf) + 1;
+		proceed_user_input(line);
 	}
-	freeaddrinfo(res);
-	err(1, "could not connect");
+	if (off > in_len)
+		off = in_len;
+	memmove(in_buf, in_buf + off, in_len - off);
+	in_len -= off;
+}
+
+/*
+ * Returns number of milliseconds until render_stdout() should be called,
+ * or -1 if there is nothing to render.
+ */
+static int
+render_timeout(void) {
+	if (render_at == -1 && !SIMPLEQ_EMPTY(&tasks_stdout))
+		render_at = icb_now.ic_mono + frame_ms;
+	if (render_at == -1)
+		return -1;
+	return (render_at > icb_now.ic_mono) ?
+	    (int)(render_at - icb_now.ic_mono) : 0;
 }
 
 void
 pledge_me() {
+#ifdef HAVE_UNVEIL
+	struct icb_session	*s;
+#endif
 #ifdef HAVE_PLEDGE
-	int	result;
+	char	promises[64];
 #endif
 
 #ifdef HAVE_UNVEIL
+	// for resolving names, see pledge(2) "dns" promise
+	if (unveil("/etc/hosts", "r") == -1 ||
+	    unveil("/etc/resolv.conf", "r") == -1 ||
+	    unveil("/etc/services", "r") == -1)
+		err(1, "dns unveil");
 	if (enable_history) {
-		if (unveil(history_path, "wc") == -1)
-			err(1, "history unveil");
+		// cannot wait for the first line to create directories then
+		TAILQ_FOREACH(s, &sessions, is_entry)
+			if (history_prepare(s) == 0 &&
+			    unveil(s->is_history_path, "rwc") == -1)
+				err(1, "history unveil");
 	}
 	if (unveil(NULL, NULL) == -1)
 		err(1, "final unveil");
 #endif
 
 #ifdef HAVE_PLEDGE
+	// connections may be not established yet
+	strlcpy(promises, "stdio inet dns", sizeof(promises));
 	if (enable_history)
-		result = pledge("stdio wpath cpath tty", NULL);
-	else
-		result = pledge("stdio tty", NULL);
-	if (result == -1)
+		strlcat(promises, " rpath wpath cpath", sizeof(promises));
+	if (!headless)
+		strlcat(promises, " tty", sizeof(promises));
+	if (pledge(promises, NULL) == -1)
 		err(1, "pledge");
 #endif
 }
@@ -612,14 +964,17 @@ main(int argc, char **argv) {
 #ifdef SIGINFO
 	struct sigaction sa;
 #endif
+	struct icb_session	*s;
 	size_t		 msglen;
-	time_t		 ts_lastnetinput, t;
-	int		 ch, i, net_timeout, poll_timeout, max_pings;
-	char		*msg, *port = NULL;
-	const char	*errstr, *locale;
+	time_t		 t;
+	int		 ch, i, net_timeout, poll_timeout, max_pings, use_tls = 0;
+	int		 timeout;
+	char		*msg, path[PATH_MAX];
+	const char	*errstr, *locale, *metrics_path = NULL;
+	unsigned long long	 syscalls;
 
 	SIMPLEQ_INIT(&tasks_stdout);
-	SIMPLEQ_INIT(&tasks_net);
+	task_arena_init(&stdout_arena, 16384);
 
 	locale = setlocale(LC_CTYPE, "");
 	if (strstr(locale, ".UTF-8")) {
@@ -629,14 +984,40 @@ main(int argc, char **argv) {
 	}
 
 	net_timeout = 30;
-	while ((ch = getopt(argc, argv, "dHt:")) != -1) {
+	while ((ch = getopt(argc, argv, "bde:f:Hm:o:rst:")) != -1) {
 		switch (ch) {
+		case 'b':
+			headless = 1;
+			break;
 		case 'd':
 			debug++;
 			break;
+		case 'e':
+			add_input_line(optarg);
+			headless = oneshot = in_eof = 1;
+			break;
+		case 'f':
+			if (set_output_format(optarg) == -1)
+				usage("unknown output format");
+			// mixing records with line editing makes no sense
+			if (output_format != OutText)
+				headless = 1;
+			break;
 		case 'H':
 			enable_history = 0;
 			break;
+		case 'm':
+			metrics_path = optarg;
+			break;
+		case 'o':
+			set_tunables(optarg);
+			break;
+		case 'r':
+			reconnect = 1;
+			break;
+		case 's':
+			use_tls = 1;
+			break;
 		case 't':
 			net_timeout = strtonum(optarg, 0, INT_MAX/1000,
 			    &errstr);
@@ -652,42 +1033,23 @@ main(int argc, char **argv) {
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 2)
+	if (argc < 2 || argc % 2 != 0)
 		usage(NULL);
-
-	room = argv[1];
-
-	if ((hostname = strchr(argv[0], '@')) != NULL) {
-		nick = argv[0];
-		*hostname++ = '\0';
-		if (*hostname == '\0')
-			usage("invalid hostname specification");
-	} else {
-		hostname = argv[0];
-		nick = getlogin();
-	}
-	nicklen = strlen(nick);
-	if (nicklen >= NICKNAME_MAX)
-		usage("too long nickname");
-
-	if (hostname[0] == '[') {
-		char	*hostend;
-
-		hostname++;
-		hostend = strrchr(hostname, ']');
-		if (hostend == NULL ||
-		    (hostend[1] != '\0' && hostend[1] != ':'))
-			usage("invalid hostname specification");
-		if (hostend[1] == ':')
-			port = hostend + 2;
-		*hostend = '\0';
-	} else {
-		if ((port = strrchr(hostname, ':')) != NULL)
-			*port++ = '\0';
-	}
-
-	icb_connect(hostname, port);
-	if (fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK) == -1)
+	if (reconnect_min > reconnect_max)
+		usage("reconnmin is greater than reconnmax");
+	if (metrics_path != NULL)
+		metrics_open(metrics_path);
+
+	transport_init(use_tls);
+	for (i = 0; i < argc; i += 2)
+		(void)session_new(argv[i], argv[i + 1]);
+
+	event_init();
+	connect_init();
+	TAILQ_FOREACH(session, &sessions, is_entry)
+		connect_start(session);
+	session = active_session;
+	if (!oneshot && fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK) == -1)
 		err(1, "stdin: fcntl");
 	if (fcntl(STDOUT_FILENO, F_SETFL, O_NONBLOCK) == -1)
 		err(1, "stdout: fcntl");
@@ -695,22 +1057,27 @@ main(int argc, char **argv) {
 	if (net_timeout)
 		poll_timeout = net_timeout * 100;
 	else
-		poll_timeout = INFTIM;
-	ts_lastnetinput = time(NULL);
+		poll_timeout = -1;
+	clock_update();
+	TAILQ_FOREACH(s, &sessions, is_entry)
+		s->is_lastnetinput = icb_now.ic_time;
 	max_pings = 3;
 
-	rl_callback_handler_install("", &proceed_user_input);
-	atexit(&rl_callback_handler_remove);
+	if (!headless) {
+		rl_callback_handler_install("", &proceed_user_input);
+		atexit(&rl_callback_handler_remove);
 
-	// disable completion, or readline will try to access file system
-	rl_completion_entry_function = null_completer;
+		// own completion, or readline will try to access file system
+		rl_completion_entry_function = nick_completer;
 
-	rl_bind_key('\t', cycle_priv_chats_forward);
-	rl_bind_keyseq("\\e[Z", cycle_priv_chats_backward);
-	rl_bind_key(CTRL('p'), list_priv_chats_nicks_wrapper);
-	rl_bind_key(CTRL('t'), siginfo_cmd);
-	if (debug)
-		rl_bind_key(CTRL('x'), test_cmd);
+		rl_bind_key('\t', cycle_priv_chats_forward);
+		rl_bind_keyseq("\\e[Z", cycle_priv_chats_backward);
+		rl_bind_keyseq("\\e\t", rl_complete);
+		rl_bind_key(CTRL('p'), list_priv_chats_nicks_wrapper);
+		rl_bind_key(CTRL('t'), siginfo_cmd);
+		if (debug)
+			rl_bind_key(CTRL('x'), test_cmd);
+	}
 
 #ifdef SIGINFO
 	if (sigaction(SIGINFO, NULL, &sa) == -1)
@@ -721,86 +1088,190 @@ main(int argc, char **argv) {
 			warn("sigaction(SIGINFO, &sa)");
 	}
 #endif
+	// broken connection is reported by write error, see proceed_output()
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+		warn("signal(SIGPIPE)");
 
-	if (enable_history) {
-		snprintf(history_path, PATH_MAX, "%s/.oicb/logs/%s",
-		    getenv("HOME"), hostname);
-		if (create_dir_for(history_path) == -1 ||
-		    (mkdir(history_path, 0777) == -1 && errno != EEXIST)) {
-			warn("cannot make sure history directory \"%s\" exists",
-			    history_path);
-			warnx("history saving is disabled");
-			enable_history = 0;
-			memset(history_path, 0, PATH_MAX);
-		}
+	// history directories are created on first use, see history_prepare()
+	if (enable_history)
+		TAILQ_FOREACH(s, &sessions, is_entry)
+			snprintf(s->is_history_path, PATH_MAX,
+			    "%s/.oicb/logs/%s", getenv("HOME"), s->is_hostname);
+	history_init();
+	snprintf(path, sizeof(path), "%s/.oicb/rules", getenv("HOME"));
+	filter_init(path);
+	// nobody is going to look at past lines in one-shot mode
+	TAILQ_FOREACH(s, &sessions, is_entry) {
+		if (oneshot)
+			break;
+		scrollback_warm(s);
+		if (enable_history)
+			archive_scan(s->is_history_path);
 	}
 
 	pledge_me();
 
+	syscalls = metrics.m_syscalls;
 	while (!want_exit) {
 		if (want_info) {
-			push_stdout("%s: sitting in room %s at %s",
-			                getprogname(), room, hostname);
-			if (port)
-				push_stdout(":%s", port);
-			push_stdout(" as %s\n", nick);
+			TAILQ_FOREACH(session, &sessions, is_entry) {
+				if (session->is_dead)
+					continue;
+				push_stdout("%s: sitting in room %s at %s",
+				    getprogname(), session->is_room,
+				    session->is_hostname);
+				if (session->is_port)
+					push_stdout(":%s", session->is_port);
+				push_stdout(" as %s\n", session->is_nick);
+			}
+			session = active_session;
 
-			if (debug)
+			if (debug && !headless)
 				push_stdout("%s: rl_line_buffer=0x%p '%s' [%zu] rl_point=%d rl_mark=%d\n",
 				                getprogname(),
 				                rl_line_buffer, rl_line_buffer,
 				                strlen(rl_line_buffer),
 				                rl_point, rl_mark);
+			if (debug)
+				push_stdout("%s: tasks memory: %zu bytes live, %zu peak\n",
+				                getprogname(),
+				                arena_live_bytes, arena_peak_bytes);
+			metrics_show();
 
 			want_info = 0;
 		}
 
-		proceed_output(&tasks_net, sock);
-		t = time(NULL);
-		if (net_timeout &&
-		    ts_lastnetinput + net_timeout * (pings_sent + 1) < t) {
-			if ((srv_features & Ping) == Ping) {
-				push_icb_msg('l', "", 0);
-				pings_sent++;
-			} else {
-				push_icb_msg('n', "", 0);
-				ts_lastnetinput = t;
+		t = icb_now.ic_time;
+		TAILQ_FOREACH(session, &sessions, is_entry) {
+			s = session;
+			if (s->is_dead || s->is_state == Connecting)
+				continue;
+			sched_output(s);
+			if (s->is_dead || s->is_state == Connecting)
+				continue;    // write failed
+			if (net_timeout && s->is_lastnetinput +
+			    net_timeout * (s->is_pings_sent + 1) < t) {
+				if ((s->is_features & Ping) == Ping) {
+					push_ping();
+					s->is_pings_sent++;
+					s->is_pongs_awaited++;
+				} else {
+					push_icb_msg('n', "", 0);
+					s->is_lastnetinput = t;
+				}
 			}
 		}
-		update_pollfds();
-		if (poll(pfd, npfd, poll_timeout) == -1) {
+		session = active_session;
+
+		update_events();
+		timeout = history_timeout();
+		if (timeout == -1 || (poll_timeout != -1 && poll_timeout < timeout))
+			timeout = poll_timeout;
+		if (render_timeout() != -1 &&
+		    (timeout == -1 || render_timeout() < timeout))
+			timeout = render_timeout();
+		if (connect_timeout() != -1 &&
+		    (timeout == -1 || connect_timeout() < timeout))
+			timeout = connect_timeout();
+		if (sched_timeout() != -1 &&
+		    (timeout == -1 || sched_timeout() < timeout))
+			timeout = sched_timeout();
+		if (metrics_timeout() != -1 &&
+		    (timeout == -1 || metrics_timeout() < timeout))
+			timeout = metrics_timeout();
+		if (search_timeout() != -1)
+			timeout = search_timeout();
+		hist_add(&metrics.m_iter_syscalls, metrics.m_syscalls - syscalls);
+		syscalls = metrics.m_syscalls;
+		if (event_wait(timeout) == -1) {
 			if (errno == EINTR)
 				continue;
-			err(1, "poll");
+			err(1, "%s", event_backend());
 		}
+		metrics.m_wakeups++;
+		clock_update();
 
+		TAILQ_FOREACH(session, &sessions, is_entry) {
+			if (session->is_dead || session->is_state == Connecting ||
+			    !(event_get(session->is_sock) & EVENT_ERROR))
+				continue;
+			if (session_retry(session, "error occured on network"))
+				continue;
+			if (nsessions == 1)
+				errx(1, "error occured on network");
+			push_stdout("error occured on network, closing session\n");
+			session_close(session);
+		}
+		session = active_session;
 		for (i = 0; i < MainFDCount; i++)
-			if ((pfd[i].revents & (POLLERR|POLLHUP|POLLNVAL)))
+			if ((event_get(main_fds[i]) & EVENT_ERROR) &&
+			    !(headless && i == Stdin))	// hangup is just EOF
 				errx(1, "error occured on %s", stream_names[i]);
 
-		if (state == Connecting) {
-			// the only cause we're here is that connect(2) succeeded
-			state = Connected;
-			push_stdout("connected\n");
-			continue;
-		}
-
-		if ((pfd[Stdin].revents & POLLIN))
+		if (headless) {
+			if (!in_eof && (event_get(STDIN_FILENO) &
+			    (EVENT_READ|EVENT_ERROR)))
+				read_stdin_lines();
+			proceed_stdin_lines();
+		} else if ((event_get(STDIN_FILENO) & EVENT_READ))
 			rl_callback_read_char();
-		if ((pfd[Network].revents & POLLIN)) {
-			ts_lastnetinput = time(NULL);
-			pings_sent = 0;
-			while (!want_exit && (msg = get_next_icb_msg(&msglen)) != NULL)
-				proceed_icb_msg(msg, msglen);
-		} else if (net_timeout &&
-		    ts_lastnetinput + net_timeout * max_pings < t) {
-			push_stdout("Server timed out, exiting\n");
-			want_exit = 1;
+
+		connect_proceed();
+		TAILQ_FOREACH(session, &sessions, is_entry) {
+			s = session;
+			if (s->is_dead || s->is_state == Connecting)
+				continue;
+			if (s->is_transport->tr_readable(s,
+			    event_get(s->is_sock))) {
+				s->is_lastnetinput = icb_now.ic_time;
+				s->is_pings_sent = 0;
+				while (!s->is_dead &&
+				    (msg = get_next_icb_msg(s, &msglen)) != NULL)
+					proceed_icb_msg(msg, msglen);
+			} else if (net_timeout &&
+			    s->is_lastnetinput + net_timeout * max_pings < t) {
+				if (session_retry(s, "Server timed out"))
+					continue;
+				push_stdout("Server timed out%s\n",
+				    (nsessions == 1) ? ", exiting" : "");
+				session_close(s);
+			}
 		}
-		prepare_stdout();
-		proceed_output(&tasks_stdout, STDOUT_FILENO);
-		restore_rl();
+		session = active_session;
+		proceed_search();
+		render_stdout();
 		proceed_history();
+		metrics_proceed();
+
+		/*
+		 * After all commands are sent, wait for the servers to process
+		 * them: pong comes only after replies to everything before.
+		 * Pings would overtake queued commands, see sched.c.
+		 */
+		TAILQ_FOREACH(s, &sessions, is_entry)
+			if (!s->is_dead &&
+			    (s->is_state != Chat || sched_pending(s)))
+				break;
+		if (headless && in_eof && in_len == 0 && !in_eof_pinged &&
+		    s == NULL) {
+			TAILQ_FOREACH(session, &sessions, is_entry)
+				if (!session->is_dead &&
+				    (session->is_features & Ping) == Ping) {
+					push_ping();
+					session->is_pongs_awaited++;
+				}
+			session = active_session;
+			in_eof_pinged = 1;
+		}
+		if (headless && in_eof && in_len == 0 &&
+		    SIMPLEQ_EMPTY(&tasks_stdout) && search_timeout() == -1) {
+			TAILQ_FOREACH(s, &sessions, is_entry)
+				if (!s->is_dead && (s->is_pongs_awaited > 0 ||
+				    sched_pending(s)))
+					break;
+			if (s == NULL)
+				want_exit = 1;
+		}
 	}
 	return 0;
 }
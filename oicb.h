@@ -28,24 +28,31 @@ enum ICBState {
 	LoginSent,
 	Chat,
 };
-extern enum ICBState state;
 
 enum SrvFeatures {
 	Ping	= 0x01,
 	ExtPkt	= 0x02,
 };
-extern enum SrvFeatures srv_features;
+
+// outgoing traffic priorities, see sched.c
+enum SendClass {
+	SendControl,	// login, pings, no-ops and pongs
+	SendPrivate,	// private messages
+	SendBulk,	// open messages and other commands, kept in order
+	SendClassCount
+};
 
 SIMPLEQ_HEAD(icb_task_queue, icb_task);
 struct icb_task {
 	SIMPLEQ_ENTRY(icb_task)	it_entry;
+	struct arena_chunk	*it_chunk;	// see arena.c
+	size_t	  it_size;	// allocated, including header
 	size_t	  it_len;
 	size_t	  it_ndone;
 	void	 *it_cb_data;
 	void	(*it_cb)(struct icb_task *);
 	char	  it_data[0];
 };
-extern struct icb_task_queue	tasks_net;
 
 struct line_cmd {
 	char	*start;	// same as the parse_cmd_line() argument
@@ -65,23 +72,24 @@ struct line_cmd {
 };
 
 int	 parse_cmd_line(char *line, struct line_cmd *cmd);
+__dead void	 usage(const char *msg);
 
 int	 push_stdout_untrusted(const char *text, ...);
+char	*stdout_reserve(size_t len);
+void	 stdout_commit(size_t len);
 int	 push_stdout(const char *text, ...)
 	__attribute__((__format__ (printf, 1, 2)))
 	__attribute__((__nonnull__ (1)));
+struct icb_session;
+void	 proceed_output(struct icb_task_queue *q, int fd,
+	    struct icb_session *s);
 
 
 extern int		 debug;
+extern int		 headless;
 extern int		 utf8_ready;
+extern int		 max_msg_size;
 
-extern char	*nick;
-extern size_t	 nicklen;	// less than NICKNAME_MAX
-extern char	*hostname;
-extern char	*room;
-
-#define	PRIV_CHATS_MAX	5
-extern char	 priv_chats_nicks[PRIV_CHATS_MAX][NICKNAME_MAX];
 extern int	 repeat_priv_nick;
 extern int	 prefer_long_priv_cmd;
 
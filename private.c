@@ -27,35 +27,239 @@
 #include "private.h"
 
 
-static int	match_nick_from_history(const char *prefix, size_t prefixlen,
-	                        int forward);
+/*
+ * Every nick seen is kept in a trie, for prefix lookups. Each node knows
+ * the most recently used for private chat nick below it, and the
+ * alphabetically first and last ones, so completion only walks along the
+ * prefix. Ones used for sending private messages are also linked in MRU
+ * list, most recent first, up to priv_chats_max entries.
+ *
+ * Up to KNOWN_NICKS_MAX nicks are remembered; beyond that, the least
+ * recently seen one not in MRU list is forgotten.
+ */
+#define KNOWN_NICKS_MAX	4096
+
+TAILQ_HEAD(known_nick_list, known_nick);
+struct known_nick {
+	TAILQ_ENTRY(known_nick)	 kn_mru;
+	TAILQ_ENTRY(known_nick)	 kn_seen;	// most recently seen first
+	struct nick_node	*kn_node;
+	unsigned long		 kn_used;	// MRU stamp, 0 if never used
+	int			 kn_inmru;
+	char			 kn_nick[0];
+};
+
+struct nick_node {
+	struct nick_node	 *nn_parent;
+	struct nick_node	**nn_kids;	// ordered by nn_byte
+	size_t			  nn_nkids;
+	unsigned char		  nn_byte;	// the last one of prefix
+	struct known_nick	 *nn_nick;	// ending here, if any
+	struct known_nick	 *nn_best;	// most recently used below
+	struct known_nick	 *nn_first, *nn_last;	// alphabetically
+};
+
+static struct nick_node		*node_kid(struct nick_node *n,
+				    unsigned char byte, int create);
+static void			 node_update(struct nick_node *n);
+static void			 nick_forget(struct known_nick *kn);
+static struct known_nick	*nick_lookup(const char *nick, size_t nicklen,
+				    int create);
+static struct known_nick	*match_nick(const char *prefix,
+				    size_t prefixlen, int forward);
+
+static struct nick_node		  nick_root;
+static struct known_nick_list	  known_nicks =
+				    TAILQ_HEAD_INITIALIZER(known_nicks);
+static size_t			  known_nicks_cnt;
+static struct known_nick_list	  priv_chats =
+				    TAILQ_HEAD_INITIALIZER(priv_chats);
+static unsigned long		  priv_chats_stamp;
 
-char		 priv_chats_nicks[PRIV_CHATS_MAX][NICKNAME_MAX];
 int		 priv_chats_cnt;
+int		 priv_chats_max = 5;
 int		 repeat_priv_nick;
 int		 prefer_long_priv_cmd;
 
 
-int
-match_nick_from_history(const char *prefix, size_t prefixlen, int forward) {
-	int	i;
+/*
+ * Returns child of node for the given next byte, or NULL if there is none
+ * and create is not set.
+ */
+static struct nick_node *
+node_kid(struct nick_node *n, unsigned char byte, int create) {
+	struct nick_node	*kid, **kids;
+	size_t			 lo = 0, hi = n->nn_nkids, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (n->nn_kids[mid]->nn_byte < byte)
+			lo = mid + 1;
+		else if (n->nn_kids[mid]->nn_byte > byte)
+			hi = mid;
+		else
+			return n->nn_kids[mid];
+	}
+	if (!create)
+		return NULL;
+
+	if ((kids = reallocarray(n->nn_kids, n->nn_nkids + 1,
+	    sizeof(*kids))) == NULL ||
+	    (kid = calloc(1, sizeof(*kid))) == NULL)
+		err(1, __func__);
+	memmove(kids + lo + 1, kids + lo, (n->nn_nkids - lo) * sizeof(*kids));
+	kids[lo] = kid;
+	n->nn_kids = kids;
+	n->nn_nkids++;
+	kid->nn_parent = n;
+	kid->nn_byte = byte;
+	return kid;
+}
 
-	if (forward) {
-		for (i = 0; i < priv_chats_cnt; i++)
-			if (!strncmp(prefix, priv_chats_nicks[i], prefixlen))
-				return i;
-	} else {
-		for (i = priv_chats_cnt - 1; i >= 0; i--)
-			if (!strncmp(prefix, priv_chats_nicks[i], prefixlen))
-				return i;
+/*
+ * Recalculates summary of node from its own nick and kids. Nick ending
+ * at node is a prefix of all the ones below, so it goes first.
+ */
+static void
+node_update(struct nick_node *n) {
+	struct nick_node	*kid;
+	size_t			 i;
+
+	n->nn_first = n->nn_last = n->nn_nick;
+	n->nn_best = (n->nn_nick != NULL && n->nn_nick->kn_used) ?
+	    n->nn_nick : NULL;
+	for (i = 0; i < n->nn_nkids; i++) {
+		kid = n->nn_kids[i];
+		if (n->nn_first == NULL)
+			n->nn_first = kid->nn_first;
+		n->nn_last = kid->nn_last;
+		if (kid->nn_best != NULL && (n->nn_best == NULL ||
+		    kid->nn_best->kn_used > n->nn_best->kn_used))
+			n->nn_best = kid->nn_best;
+	}
+}
+
+/*
+ * Removes nick from the trie, dropping nodes left empty.
+ */
+static void
+nick_forget(struct known_nick *kn) {
+	struct nick_node	*n, *parent;
+	size_t			 i;
+
+	n = kn->kn_node;
+	n->nn_nick = NULL;
+	for (; n != &nick_root; n = parent) {
+		parent = n->nn_parent;
+		if (n->nn_nick != NULL || n->nn_nkids != 0) {
+			node_update(n);
+			continue;
+		}
+		for (i = 0; parent->nn_kids[i] != n; i++)
+			;
+		memmove(parent->nn_kids + i, parent->nn_kids + i + 1,
+		    (parent->nn_nkids - i - 1) * sizeof(*parent->nn_kids));
+		parent->nn_nkids--;
+		free(n->nn_kids);
+		free(n);
 	}
-	return forward ? 0 :  priv_chats_cnt - 1;
+	node_update(&nick_root);
+	TAILQ_REMOVE(&known_nicks, kn, kn_seen);
+	known_nicks_cnt--;
+	free(kn);
+}
+
+static struct known_nick *
+nick_lookup(const char *nick, size_t nicklen, int create) {
+	struct known_nick	*kn;
+	struct nick_node	*n;
+	size_t			 i;
+
+	for (n = &nick_root, i = 0; n != NULL && i < nicklen; i++)
+		n = node_kid(n, (unsigned char)nick[i], create);
+	if (n == NULL || n->nn_nick != NULL || !create)
+		return (n != NULL) ? n->nn_nick : NULL;
+
+	if (known_nicks_cnt == KNOWN_NICKS_MAX) {
+		TAILQ_FOREACH_REVERSE(kn, &known_nicks, known_nick_list,
+		    kn_seen)
+			if (!kn->kn_inmru)
+				break;
+		if (kn != NULL)
+			nick_forget(kn);
+		// the path may be gone with it
+		for (n = &nick_root, i = 0; i < nicklen; i++)
+			n = node_kid(n, (unsigned char)nick[i], 1);
+	}
+
+	if ((kn = calloc(1, sizeof(*kn) + nicklen + 1)) == NULL)
+		err(1, __func__);
+	memcpy(kn->kn_nick, nick, nicklen);
+	kn->kn_node = n;
+	n->nn_nick = kn;
+	TAILQ_INSERT_HEAD(&known_nicks, kn, kn_seen);
+	known_nicks_cnt++;
+	for (; n != NULL; n = n->nn_parent) {
+		if (n->nn_first == NULL ||
+		    strcmp(kn->kn_nick, n->nn_first->kn_nick) < 0)
+			n->nn_first = kn;
+		if (n->nn_last == NULL ||
+		    strcmp(kn->kn_nick, n->nn_last->kn_nick) > 0)
+			n->nn_last = kn;
+	}
+	return kn;
+}
+
+/*
+ * Remembers nick seen in chat or users list, for completion.
+ */
+void
+nick_seen(const char *nick) {
+	struct known_nick	*kn;
+	size_t			 len;
+
+	len = strlen(nick);
+	if (len == 0 || len >= NICKNAME_MAX)
+		return;
+	if ((kn = nick_lookup(nick, len, 0)) != NULL) {
+		TAILQ_REMOVE(&known_nicks, kn, kn_seen);
+		TAILQ_INSERT_HEAD(&known_nicks, kn, kn_seen);
+	} else
+		(void)nick_lookup(nick, len, 1);
+}
+
+/*
+ * Finds known nick starting with given prefix, preferring the most recently
+ * used for private chat; otherwise the first (forward == 1) or the last
+ * (forward == 0) such nick in alphabetical order.
+ */
+static struct known_nick *
+match_nick(const char *prefix, size_t prefixlen, int forward) {
+	struct nick_node	*n;
+	size_t			 i;
+
+	for (n = &nick_root, i = 0; n != NULL && i < prefixlen; i++)
+		n = node_kid(n, (unsigned char)prefix[i], 0);
+	if (n == NULL)
+		return NULL;
+	if (n->nn_best != NULL)
+		return n->nn_best;
+	return forward ? n->nn_first : n->nn_last;
+}
+
+const char *
+priv_chats_last(void) {
+	struct known_nick	*kn;
+
+	kn = TAILQ_FIRST(&priv_chats);
+	return kn ? kn->kn_nick : NULL;
 }
 
 //
 // The logic as follows:     [a] forward == 1; [b] forward == 0
 //
-//  1.  If private chat nicknames history is empty, just beep.
+//  1.  If private chat nicknames history is empty, and there is no nickname
+//      to complete, just beep.
 //
 //  2a. If this is a public chat message, switch to last used private chat.
 //  2b. If this is a public chat message, switch to last used private chat.
@@ -72,9 +276,10 @@ match_nick_from_history(const char *prefix, size_t prefixlen, int forward) {
 //  5b. If the private chat nickname is the newest used in nick history,
 //      clear private command, making the message public.
 //
-//  6.  If private chat nickname is not remembered, but there is remembered
+//  6.  If private chat nickname is not remembered, but there is known
 //      nickname which starts like this, fill the latter nickname fully
-//      (matching first/last nickname from history depending on forward == 1/0)
+//      (the most recently used one, or first/last alphabetically depending
+//      on forward == 1/0)
 //
 //  7a. If there is no matching private chat nickname in history, switch to the
 //      last used private chat.
@@ -88,10 +293,10 @@ match_nick_from_history(const char *prefix, size_t prefixlen, int forward) {
 //
 int
 cycle_priv_chats(int forward) {
-	struct line_cmd cmd;
-	int		i;
-	int		newidx;		// index from history to use
-	int		oldcurpos;	// initial rl_point value
+	struct line_cmd		 cmd;
+	struct known_nick	*kn;
+	struct known_nick	*newkn;		// nick to use
+	int			 oldcurpos;	// initial rl_point value
 
 	enum {
 		BEFORE_NICK,
@@ -102,7 +307,7 @@ cycle_priv_chats(int forward) {
 	if (debug >= 3)
 		warnx("%s: forward=%d\n", __func__, forward);
 
-	if (priv_chats_cnt == 0) {
+	if (priv_chats_cnt == 0 && known_nicks_cnt == 0) {
 		// (1)
 		putchar('\007');
 		return 0;
@@ -132,12 +337,14 @@ cycle_priv_chats(int forward) {
 		if (cmd.peer_nick) {
 			// (5), (6), (7) or (8)
 
-			for (i = 0; i < priv_chats_cnt; i++)
-				if (strlen(priv_chats_nicks[i]) == (size_t)cmd.peer_nick_len &&
-				   memcmp(cmd.peer_nick, priv_chats_nicks[i], (size_t)cmd.peer_nick_len) == 0)
-					break;
-			if (( forward && i == priv_chats_cnt - 1) ||
-			    (!forward && i == 0)) {
+			kn = nick_lookup(cmd.peer_nick,
+			    (size_t)cmd.peer_nick_len, 0);
+			if (kn != NULL && !kn->kn_inmru)
+				kn = NULL;
+			if (kn != NULL &&
+			    (( forward && TAILQ_NEXT(kn, kn_mru) == NULL) ||
+			     (!forward && TAILQ_PREV(kn, known_nick_list,
+			      kn_mru) == NULL))) {
 				// (5)
 				rl_delete_text(0, cmd.private_prefix_len);
 				rl_point -= cmd.private_prefix_len;
@@ -146,22 +353,32 @@ cycle_priv_chats(int forward) {
 				return 0;
 			}
 
-			if (i == priv_chats_cnt) {
+			if (kn == NULL) {
 				// (6) or (7): do prefix matching check
-				newidx = match_nick_from_history(cmd.peer_nick,
+				newkn = match_nick(cmd.peer_nick,
 				    (size_t)cmd.peer_nick_len, forward);
+				if (newkn == NULL)
+					newkn = forward ? TAILQ_FIRST(&priv_chats) :
+					    TAILQ_LAST(&priv_chats, known_nick_list);
 				goto replace_nick;
 			}
 
 			// (8)
-			newidx = i + (forward ? 1 : -1);
+			newkn = forward ? TAILQ_NEXT(kn, kn_mru) :
+			    TAILQ_PREV(kn, known_nick_list, kn_mru);
 			goto replace_nick;
 		}
 
 		// (4)
-		newidx = forward ? 0 : priv_chats_cnt - 1;
+		newkn = forward ? TAILQ_FIRST(&priv_chats) :
+		    TAILQ_LAST(&priv_chats, known_nick_list);
 	} else {
 		// (2)
+		if (priv_chats_cnt == 0) {
+			// (1)
+			putchar('\007');
+			return 0;
+		}
 		rl_point = 0;
 		if (prefer_long_priv_cmd) {
 			rl_insert_text("/msg ");
@@ -173,20 +390,27 @@ cycle_priv_chats(int forward) {
 			cmd.private_prefix_len = 3;
 		}
 		oldcurpos += cmd.peer_nick_offset + 1;
-		newidx = forward ? 0 : priv_chats_cnt - 1;
+		newkn = forward ? TAILQ_FIRST(&priv_chats) :
+		    TAILQ_LAST(&priv_chats, known_nick_list);
 	}
 
 	// (2), (4), (6), (7) or (8)
 
 replace_nick:
+	if (newkn == NULL) {
+		// (1)
+		putchar('\007');
+		return 0;
+	}
+
 	// cmd fields used:
 	//   peer_nick_offset
 	//   peer_nick_len
 	//   private_prefix_len
 
 	if (debug >= 2) {
-		warnx("%s: replace_nick: rl_line_buffer='%s' rl_point=%d oldcurpos=%d newidx=%d",
-		    __func__, rl_line_buffer, rl_point, oldcurpos, newidx);
+		warnx("%s: replace_nick: rl_line_buffer='%s' rl_point=%d oldcurpos=%d newnick=%s",
+		    __func__, rl_line_buffer, rl_point, oldcurpos, newkn->kn_nick);
 		warnx("%s: replace_nick: peer_nick_offset=%d peer_nick_len=%d cursor_zone=%d",
 		    __func__, cmd.peer_nick_offset, cmd.peer_nick_len, cursor_zone);
 	}
@@ -194,7 +418,7 @@ replace_nick:
 	if (cmd.peer_nick_len)
 		rl_delete_text(cmd.peer_nick_offset, cmd.private_prefix_len);
 	rl_point = cmd.peer_nick_offset;
-	rl_insert_text(priv_chats_nicks[newidx]);
+	rl_insert_text(newkn->kn_nick);
 	rl_insert_text(" ");
 
 	// restoring cursor position
@@ -210,7 +434,7 @@ replace_nick:
 
 	case AFTER_NICK:
 		rl_point = oldcurpos
-		    + (int)strlen(priv_chats_nicks[newidx])
+		    + (int)strlen(newkn->kn_nick)
 		    - cmd.peer_nick_len;
 		break;
 	}
@@ -219,7 +443,7 @@ replace_nick:
 
 int
 list_priv_chats_nicks() {
-	int	i;
+	struct known_nick	*kn;
 
 	if (priv_chats_cnt == 0) {
 		push_stdout("there are no private chats yet\n");
@@ -227,52 +451,49 @@ list_priv_chats_nicks() {
 	}
 
 	push_stdout("there are %d private chats:\n", priv_chats_cnt);
-	for (i = 0; i < priv_chats_cnt; i++)
-		push_stdout("  * %s\n", priv_chats_nicks[i]);
+	TAILQ_FOREACH(kn, &priv_chats, kn_mru)
+		push_stdout("  * %s\n", kn->kn_nick);
 	return 0;
 }
 
 // Input: private message nick and text, or NULLs for public message.
 void
 update_nick_history(const char *peer_nick, const char *msg) {
+	struct known_nick	*kn, *oldest;
+	struct nick_node	*n;
+	size_t			 peer_nicklen;
+
 	if (debug >= 2)
 		warnx("%s: peer_nick='%s' msg='%s'", __func__, peer_nick, msg);
 
-	if (peer_nick != NULL) {
-		size_t	peer_nicklen;
-		int	i;
-
-		peer_nicklen = strlen(peer_nick);
-		if (peer_nicklen >= NICKNAME_MAX) {
-			push_stdout("%s: warning: nickname is too long\n",
-			                getprogname());
-			return;
-		}
-
-		if (priv_chats_cnt > 0 &&
-		    strcmp(priv_chats_nicks[0], peer_nick) == 0)
-			return;		// already topmost one
-		for (i = 1; i < priv_chats_cnt; i++) {
-			if (strcmp(priv_chats_nicks[i], peer_nick) == 0) {
-				if (debug >=2)
-					warnx("%s: found %s", __func__, priv_chats_nicks[i]);
-				// make current nick the newest one
-				memmove(priv_chats_nicks[1], priv_chats_nicks[0], i * NICKNAME_MAX);
-				goto set_top_nick;
-			}
-		}
-
-		// add nick to history, possibly kicking out oldest one
-		memmove(priv_chats_nicks[1], priv_chats_nicks[0],
-		    (PRIV_CHATS_MAX - 1) * NICKNAME_MAX);
-		if (priv_chats_cnt < PRIV_CHATS_MAX - 1)
-			priv_chats_cnt++;
-
-set_top_nick:
-		if (debug >= 2)
-			warnx("%s: copying '%s' [%zu] to %p",
-			    __func__, peer_nick, peer_nicklen, priv_chats_nicks[0]);
-		memcpy(priv_chats_nicks[0], peer_nick, peer_nicklen);
-		memset(priv_chats_nicks[0] + peer_nicklen, 0, NICKNAME_MAX - peer_nicklen);
+	if (peer_nick == NULL)
+		return;
+	peer_nicklen = strlen(peer_nick);
+	if (peer_nicklen >= NICKNAME_MAX) {
+		push_stdout("%s: warning: nickname is too long\n",
+		                getprogname());
+		return;
 	}
+
+	kn = nick_lookup(peer_nick, peer_nicklen, 1);
+	kn->kn_used = ++priv_chats_stamp;
+	// the newest stamp is the best one everywhere up the trie
+	for (n = kn->kn_node; n != NULL; n = n->nn_parent)
+		n->nn_best = kn;
+	if (kn == TAILQ_FIRST(&priv_chats))
+		return;		// already topmost one
+	if (kn->kn_inmru) {
+		if (debug >=2)
+			warnx("%s: found %s", __func__, kn->kn_nick);
+		TAILQ_REMOVE(&priv_chats, kn, kn_mru);
+	} else if (priv_chats_cnt == priv_chats_max) {
+		// kick out oldest one, it's still known for completion
+		oldest = TAILQ_LAST(&priv_chats, known_nick_list);
+		TAILQ_REMOVE(&priv_chats, oldest, kn_mru);
+		oldest->kn_inmru = 0;
+	} else
+		priv_chats_cnt++;
+	// make current nick the newest one
+	TAILQ_INSERT_HEAD(&priv_chats, kn, kn_mru);
+	kn->kn_inmru = 1;
 }
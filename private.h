@@ -20,5 +20,9 @@
 void	update_nick_history(const char *peer_nick, const char *msg);
 int	list_priv_chats_nicks(void);
 int	cycle_priv_chats(int forward);
+void	nick_seen(const char *nick);
+const char	*priv_chats_last(void);
+
+extern int	priv_chats_max;
 
 #endif // OICB_PRIVATE_H
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Machine-readable output: one record per ICB message, formatted right
+ * into the stdout queue from the raw message fields.
+ *
+ * JSON:  {"ts":1600000000123,"type":"b","author":"nick","text":"hello"}
+ * TSV:   1600000000123<TAB>b<TAB>nick<TAB>hello
+ *
+ * Command results ('i') carry "outtype" and "fields" array in JSON.
+ * With several sessions, JSON gets "session" number, and TSV gets it
+ * as a second column.
+ * In JSON, bytes not forming valid UTF-8 are escaped as \u00XX.
+ * In TSV, backslash, tab, CR and LF are escaped as \\, \t, \r and \n.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "oicb.h"
+#include "arena.h"
+#include "clock.h"
+#include "record.h"
+#include "session.h"
+#include "utf8.h"
+
+enum OutputFormat	 output_format = OutText;
+
+static const char	 hexdigits[] = "0123456789abcdef";
+
+static char	*put_json_str(char *dst, const char *src, size_t len);
+static char	*put_tsv_str(char *dst, const char *src, size_t len);
+
+
+int
+set_output_format(const char *name) {
+	if (strcmp(name, "text") == 0)
+		output_format = OutText;
+	else if (strcmp(name, "json") == 0)
+		output_format = OutJSON;
+	else if (strcmp(name, "tsv") == 0)
+		output_format = OutTSV;
+	else
+		return -1;
+	return 0;
+}
+
+static char *
+put_json_str(char *dst, const char *src, size_t len) {
+	const unsigned char	*s = (const unsigned char *)src;
+	size_t			 i, clen;
+
+	*dst++ = '"';
+	for (i = 0; i < len; i++) {
+		if (s[i] >= 0x80) {
+			clen = (s[i] >= 0xF0) ? 4 : (s[i] >= 0xE0) ? 3 : 2;
+			if (clen <= len - i &&
+			    mbsvalidlen(src + i, clen) == clen) {
+				memcpy(dst, s + i, clen);
+				dst += clen;
+				i += clen - 1;
+				continue;
+			}
+		} else if (s[i] == '"' || s[i] == '\\') {
+			*dst++ = '\\';
+			*dst++ = (char)s[i];
+			continue;
+		} else if (s[i] >= 0x20 && s[i] != 0x7f) {
+			*dst++ = (char)s[i];
+			continue;
+		} else if (s[i] == '\n') {
+			*dst++ = '\\';
+			*dst++ = 'n';
+			continue;
+		} else if (s[i] == '\t') {
+			*dst++ = '\\';
+			*dst++ = 't';
+			continue;
+		}
+		memcpy(dst, "\\u00", 4);
+		dst[4] = hexdigits[s[i] >> 4];
+		dst[5] = hexdigits[s[i] & 0xf];
+		dst += 6;
+	}
+	*dst++ = '"';
+	return dst;
+}
+
+static char *
+put_tsv_str(char *dst, const char *src, size_t len) {
+	size_t	 i;
+
+	for (i = 0; i < len; i++) {
+		switch (src[i]) {
+		case '\\':
+			*dst++ = '\\';
+			*dst++ = '\\';
+			break;
+		case '\t':
+			*dst++ = '\\';
+			*dst++ = 't';
+			break;
+		case '\r':
+			*dst++ = '\\';
+			*dst++ = 'r';
+			break;
+		case '\n':
+			*dst++ = '\\';
+			*dst++ = 'n';
+			break;
+		default:
+			*dst++ = src[i];
+		}
+	}
+	return dst;
+}
+
+/*
+ * Queue record for the given message, msg points after type byte,
+ * len doesn't include trailing NUL.
+ */
+void
+push_record(char type, const char *msg, size_t len) {
+	static const char *chat_fields[] = { "author", "text" };
+	const char	**names = NULL;
+	const char	 *field, *end, *sep;
+	char		 *buf, *dst;
+	size_t		  nnames = 0, i, flen;
+	int		  in_array = 0;
+
+	switch (type) {
+	case 'b':
+	case 'c':
+	case 'd':
+	case 'f':
+		names = chat_fields;
+		nnames = 2;
+		break;
+	case 'e':
+		names = chat_fields + 1;
+		nnames = 1;
+		break;
+	case 'i':
+	case 'a':
+	case 'g':
+	case 'k':
+		break;
+	default:
+		return;    // protocol internals
+	}
+
+	// worst case is JSON escaping of every byte as \u00XX
+	buf = dst = stdout_reserve(len * 6 + 128);
+	if (output_format == OutJSON) {
+		dst += sprintf(dst, "{\"ts\":%lld", icb_now.ic_ms);
+		if (nsessions > 1)
+			dst += sprintf(dst, ",\"session\":%d", session->is_id);
+		dst += sprintf(dst, ",\"type\":\"%c\"", type);
+	} else {
+		dst += sprintf(dst, "%lld", icb_now.ic_ms);
+		if (nsessions > 1)
+			dst += sprintf(dst, "\t%d", session->is_id);
+		dst += sprintf(dst, "\t%c", type);
+	}
+
+	end = msg + strnlen(msg, len);
+	for (field = msg, i = 0; len > 0 && field <= end; field = sep + 1, i++) {
+		if ((sep = memchr(field, '\001', end - field)) == NULL)
+			sep = end;
+		flen = sep - field;
+		if (output_format == OutTSV) {
+			*dst++ = '\t';
+			dst = put_tsv_str(dst, field, flen);
+			continue;
+		}
+
+		if (type == 'i' && i == 0) {
+			memcpy(dst, ",\"outtype\":", 11);
+			dst = put_json_str(dst + 11, field, flen);
+		} else if (i < nnames) {
+			dst += sprintf(dst, ",\"%s\":", names[i]);
+			dst = put_json_str(dst, field, flen);
+		} else {
+			if (!in_array) {
+				memcpy(dst, ",\"fields\":[", 11);
+				dst += 11;
+				in_array = 1;
+			} else
+				*dst++ = ',';
+			dst = put_json_str(dst, field, flen);
+		}
+	}
+	if (in_array)
+		*dst++ = ']';
+	if (output_format == OutJSON)
+		*dst++ = '}';
+	*dst++ = '\n';
+	stdout_commit(dst - buf);
+}
@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Scheduling of data sent to servers.
+ *
+ * Tasks wait in per-class queues, and are moved to is_tasks_net, which
+ * is actually written to socket, only once the latter gets drained. Every
+ * packet of a long message is a separate task, see push_icb_msg_ws(), so
+ * pings queued while a paste is going out are sent after at most
+ * SCHED_BATCH bytes or a bucket worth of it, not after the whole paste.
+ *
+ * Other messages are also limited with two token buckets,
+ * one for bytes and one for packets, to not trigger flood protection of
+ * server. Control messages are never delayed, but are accounted for.
+ * Tokens are kept in thousandths, to be refilled every millisecond.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "oicb.h"
+#include "arena.h"
+#include "clock.h"
+#include "sched.h"
+#include "session.h"
+
+#define SCHED_BATCH	4096	// bytes moved to socket queue at once
+
+int	 send_rate = 0;	// bytes per second, 0 means no limit
+int	 send_burst = 4096;
+int	 send_msg_rate = 0;	// packets per second, 0 means no limit
+int	 send_msg_burst = 10;
+
+static enum SendClass	 task_class(const struct icb_task *it);
+static long long	 count_packets(const struct icb_task *it);
+static long long	 bucket_fill(long long tokens, long long elapsed,
+			    int rate, int burst);
+static long long	 bucket_wait(long long tokens, long long cost,
+			    int rate, int burst);
+static void		 refill(struct icb_session *s);
+static long long	 release_delay(const struct icb_session *s,
+			    const struct icb_task *it);
+static int		 release(struct icb_session *s);
+
+/*
+ * Only private messages may overtake open ones: e.g., "/g" command must
+ * not be sent before a message typed earlier, for the latter to appear
+ * in the right group.
+ */
+static enum SendClass
+task_class(const struct icb_task *it) {
+	switch (it->it_data[1]) {
+	case 'b':
+		return SendBulk;
+	case 'h':
+		if (it->it_len >= 4 && memcmp(it->it_data + 2, "m\001", 2) == 0)
+			return SendPrivate;
+		return SendBulk;
+	default:
+		return SendControl;
+	}
+}
+
+// zero length byte is used by extended packets, see push_icb_msg_extended()
+static long long
+count_packets(const struct icb_task *it) {
+	const unsigned char	*p = (const unsigned char *)it->it_data;
+	size_t			 off;
+	long long		 n = 0;
+
+	for (off = 0; off < it->it_len; off += (p[off] ? p[off] : 255) + 1u)
+		n++;
+	return n;
+}
+
+static long long
+bucket_fill(long long tokens, long long elapsed, int rate, int burst) {
+	long long	 full = (long long)burst * 1000;
+
+	// avoid overflow after long idle periods
+	if (elapsed > full / rate + 1)
+		return full;
+	tokens += elapsed * rate;
+	return (tokens > full) ? full : tokens;
+}
+
+/*
+ * Returns number of milliseconds until bucket gets enough tokens.
+ * Single packets always fit in the burst, as sendburst is at least 256;
+ * only the extended message task, which cannot be split, may cost more.
+ * Such one is satisfied by full bucket, which then goes negative.
+ */
+static long long
+bucket_wait(long long tokens, long long cost, int rate, int burst) {
+	long long	 need;
+
+	if (rate == 0)
+		return 0;
+	need = ((cost < burst) ? cost : burst) * 1000;
+	if (tokens >= need)
+		return 0;
+	return (need - tokens + rate - 1) / rate;
+}
+
+static void
+refill(struct icb_session *s) {
+	long long	 elapsed;
+
+	elapsed = icb_now.ic_mono - s->is_send_at;
+	if (elapsed <= 0)
+		return;
+	s->is_send_at = icb_now.ic_mono;
+	if (send_rate)
+		s->is_send_bytes = bucket_fill(s->is_send_bytes, elapsed,
+		    send_rate, send_burst);
+	if (send_msg_rate)
+		s->is_send_pkts = bucket_fill(s->is_send_pkts, elapsed,
+		    send_msg_rate, send_msg_burst);
+}
+
+static long long
+release_delay(const struct icb_session *s, const struct icb_task *it) {
+	long long	 bytes_wait, pkts_wait;
+
+	bytes_wait = bucket_wait(s->is_send_bytes, (long long)it->it_len,
+	    send_rate, send_burst);
+	pkts_wait = bucket_wait(s->is_send_pkts, count_packets(it),
+	    send_msg_rate, send_msg_burst);
+	return (bytes_wait > pkts_wait) ? bytes_wait : pkts_wait;
+}
+
+/*
+ * Moves tasks allowed to be sent now to the socket queue, in class order.
+ * A delayed task holds the ones of lower classes, too.
+ * Returns non-zero if anything was moved.
+ */
+static int
+release(struct icb_session *s) {
+	struct icb_task		*it;
+	struct icb_task_queue	*q;
+	size_t			 moved = 0;
+	int			 cls;
+
+	refill(s);
+	for (cls = 0; cls < SendClassCount; cls++) {
+		q = &s->is_tasks_sched[cls];
+		while ((it = SIMPLEQ_FIRST(q)) != NULL) {
+			if (cls != SendControl && (moved >= SCHED_BATCH ||
+			    release_delay(s, it) > 0))
+				return moved != 0;
+			if (send_rate)
+				s->is_send_bytes -= (long long)it->it_len * 1000;
+			if (send_msg_rate)
+				s->is_send_pkts -= count_packets(it) * 1000;
+			moved += it->it_len;
+			SIMPLEQ_REMOVE_HEAD(q, it_entry);
+			SIMPLEQ_INSERT_TAIL(&s->is_tasks_net, it, it_entry);
+		}
+	}
+	return moved != 0;
+}
+
+void
+sched_init(struct icb_session *s) {
+	int	 cls;
+
+	SIMPLEQ_INIT(&s->is_tasks_net);
+	for (cls = 0; cls < SendClassCount; cls++)
+		SIMPLEQ_INIT(&s->is_tasks_sched[cls]);
+	s->is_send_bytes = (long long)send_burst * 1000;
+	s->is_send_pkts = (long long)send_msg_burst * 1000;
+	s->is_send_at = icb_now.ic_mono;
+}
+
+/*
+ * Forgets everything queued, e.g., when connection is lost.
+ */
+void
+sched_drop(struct icb_session *s) {
+	struct icb_task	*it;
+	int		 cls;
+
+	while ((it = SIMPLEQ_FIRST(&s->is_tasks_net)) != NULL) {
+		SIMPLEQ_REMOVE_HEAD(&s->is_tasks_net, it_entry);
+		task_free(it);
+	}
+	for (cls = 0; cls < SendClassCount; cls++)
+		while ((it = SIMPLEQ_FIRST(&s->is_tasks_sched[cls])) != NULL) {
+			SIMPLEQ_REMOVE_HEAD(&s->is_tasks_sched[cls], it_entry);
+			task_free(it);
+		}
+	s->is_send_bytes = (long long)send_burst * 1000;
+	s->is_send_pkts = (long long)send_msg_burst * 1000;
+	s->is_send_at = icb_now.ic_mono;
+}
+
+void
+sched_push(struct icb_session *s, struct icb_task *it) {
+	SIMPLEQ_INSERT_TAIL(&s->is_tasks_sched[task_class(it)], it, it_entry);
+}
+
+/*
+ * Writes out as much as socket, priorities and rate limits allow.
+ */
+void
+sched_output(struct icb_session *s) {
+	do {
+		proceed_output(&s->is_tasks_net, s->is_sock, s);
+	} while (SIMPLEQ_EMPTY(&s->is_tasks_net) && release(s));
+}
+
+int
+sched_pending(const struct icb_session *s) {
+	int	 cls;
+
+	if (!SIMPLEQ_EMPTY(&s->is_tasks_net))
+		return 1;
+	for (cls = 0; cls < SendClassCount; cls++)
+		if (!SIMPLEQ_EMPTY(&s->is_tasks_sched[cls]))
+			return 1;
+	return 0;
+}
+
+/*
+ * Returns number of milliseconds until rate limits allow sending more,
+ * or -1 if nothing waits for them.
+ */
+int
+sched_timeout(void) {
+	struct icb_session	*s;
+	struct icb_task		*it;
+	long long		 delay, when = -1;
+	int			 cls;
+
+	TAILQ_FOREACH(s, &sessions, is_entry) {
+		if (s->is_dead || s->is_state == Connecting ||
+		    !SIMPLEQ_EMPTY(&s->is_tasks_net))
+			continue;
+		for (cls = SendControl + 1; cls < SendClassCount; cls++)
+			if ((it = SIMPLEQ_FIRST(&s->is_tasks_sched[cls])) != NULL)
+				break;
+		if (it == NULL)
+			continue;
+		refill(s);
+		delay = release_delay(s, it);
+		if (when == -1 || delay < when)
+			when = delay;
+	}
+	return (when > INT_MAX) ? INT_MAX : (int)when;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef OICB_SCHED_H
+#define OICB_SCHED_H
+
+struct icb_session;
+struct icb_task;
+
+void	 sched_init(struct icb_session *s);
+void	 sched_drop(struct icb_session *s);
+void	 sched_push(struct icb_session *s, struct icb_task *it);
+void	 sched_output(struct icb_session *s);
+int	 sched_pending(const struct icb_session *s);
+int	 sched_timeout(void);
+
+extern int	 send_rate, send_burst;
+extern int	 send_msg_rate, send_msg_burst;
+
+#endif // OICB_SCHED_H
@@ -0,0 +1,526 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Recent chat lines kept in memory, for replaying with "/last" command.
+ *
+ * Every room and private chat of a session gets its own buffer of
+ * scrollback_size bytes, holding message texts one after another, with
+ * the oldest ones overwritten. Line descriptors live in a separate ring;
+ * authors are interned, since there are only a few of them.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "oicb.h"
+#include "archive.h"
+#include "arena.h"
+#include "chat.h"
+#include "clock.h"
+#include "history.h"
+#include "scrollback.h"
+#include "session.h"
+
+#define SB_HASH_SIZE		64
+#define SB_STRCHUNK_SIZE	4096
+#define SB_DEFAULT_LINES	10
+
+struct sb_line {
+	time_t		 sl_time;
+	const char	*sl_author;	// interned
+	size_t		 sl_off;	// of text in sb_text
+	size_t		 sl_len;	// including NUL
+	char		 sl_type;
+};
+
+LIST_HEAD(sb_buffer_list, sb_buffer);
+struct sb_buffer {
+	LIST_ENTRY(sb_buffer)	 sb_entry;
+	char			*sb_peer;
+	char			 sb_kind;	// as in history_target()
+	unsigned int		 sb_hash;
+
+	struct sb_line		*sb_lines;	// ring
+	size_t			 sb_first, sb_nlines;
+	size_t			 sb_linesz;	// power of two
+	char			*sb_text;	// scrollback_size bytes
+	size_t			 sb_head;	// where the next text goes
+};
+
+struct scrollback {
+	struct sb_buffer_list	 sb_buckets[SB_HASH_SIZE];
+};
+
+struct sb_strchunk {
+	struct sb_strchunk	*ss_next;
+	size_t			 ss_used, ss_size;
+	char			 ss_data[0];
+};
+
+int	 scrollback_size = 16384;
+int	 scrollback_warm_size = 0;
+
+// authors are shared by all sessions, and never forgotten
+static const char		**sb_strs;
+static size_t			 sb_nstrs, sb_strsz;	// power of two
+static struct sb_strchunk	*sb_chunks;
+
+static unsigned int	 sb_hash(const char *str, char kind);
+static const char	*sb_intern(const char *str);
+static struct sb_buffer	*sb_find(struct icb_session *s, char kind,
+			    const char *peer, int create);
+static void		 sb_append(struct sb_buffer *b, time_t t, char type,
+			    const char *author, const char *text, size_t len);
+static void		 sb_show(const struct sb_buffer *b, size_t count);
+static char		*sb_read_tail(const char *path, size_t maxlen,
+			    size_t *lenp, int *cutp);
+static void		 sb_warm_chat(struct icb_session *s, char kind,
+			    const char *peer, const char *logname,
+			    const char *segname);
+
+// case-insensitive, because so are nicks in ICB
+static unsigned int
+sb_hash(const char *str, char kind) {
+	uint32_t	 h = 2166136261U;
+
+	h = (h ^ (unsigned char)kind) * 16777619U;
+	for (; *str; str++)
+		h = (h ^ (unsigned char)tolower((unsigned char)*str)) *
+		    16777619U;
+	return h;
+}
+
+static const char *
+sb_intern(const char *str) {
+	struct sb_strchunk	*ss;
+	const char		**nstrs, **slot;
+	size_t			 len, mask, i, nsize;
+	char			*p;
+
+	if ((sb_nstrs + 1) * 2 > sb_strsz) {
+		nsize = sb_strsz ? sb_strsz * 2 : 64;
+		if ((nstrs = calloc(nsize, sizeof(char *))) == NULL)
+			err(1, __func__);
+		for (i = 0; i < sb_strsz; i++) {
+			if (sb_strs[i] == NULL)
+				continue;
+			slot = &nstrs[sb_hash(sb_strs[i], 0) & (nsize - 1)];
+			while (*slot != NULL)
+				if (++slot == nstrs + nsize)
+					slot = nstrs;
+			*slot = sb_strs[i];
+		}
+		free(sb_strs);
+		sb_strs = nstrs;
+		sb_strsz = nsize;
+	}
+
+	mask = sb_strsz - 1;
+	for (i = sb_hash(str, 0) & mask; sb_strs[i] != NULL; i = (i + 1) & mask)
+		if (strcmp(sb_strs[i], str) == 0)
+			return sb_strs[i];
+
+	len = strlen(str);
+	ss = sb_chunks;
+	if (ss == NULL || ss->ss_size - ss->ss_used < len + 1) {
+		nsize = len + 1 > SB_STRCHUNK_SIZE ? len + 1 : SB_STRCHUNK_SIZE;
+		if ((ss = malloc(sizeof(*ss) + nsize)) == NULL)
+			err(1, __func__);
+		ss->ss_used = 0;
+		ss->ss_size = nsize;
+		ss->ss_next = sb_chunks;
+		sb_chunks = ss;
+	}
+	p = ss->ss_data + ss->ss_used;
+	memcpy(p, str, len + 1);
+	ss->ss_used += len + 1;
+	sb_strs[i] = p;
+	sb_nstrs++;
+	return p;
+}
+
+static struct sb_buffer *
+sb_find(struct icb_session *s, char kind, const char *peer, int create) {
+	struct sb_buffer_list	*bucket;
+	struct sb_buffer	*b;
+	unsigned int		 h;
+	int			 i;
+
+	if (s->is_scrollback == NULL) {
+		if (!create)
+			return NULL;
+		if ((s->is_scrollback = malloc(sizeof(struct scrollback))) ==
+		    NULL)
+			err(1, __func__);
+		for (i = 0; i < SB_HASH_SIZE; i++)
+			LIST_INIT(&s->is_scrollback->sb_buckets[i]);
+	}
+
+	h = sb_hash(peer, kind);
+	bucket = &s->is_scrollback->sb_buckets[h % SB_HASH_SIZE];
+	LIST_FOREACH(b, bucket, sb_entry)
+		if (b->sb_hash == h && b->sb_kind == kind &&
+		    strcasecmp(b->sb_peer, peer) == 0)
+			return b;
+	if (!create)
+		return NULL;
+
+	if ((b = calloc(1, sizeof(struct sb_buffer))) == NULL ||
+	    (b->sb_peer = strdup(peer)) == NULL ||
+	    (b->sb_text = malloc((size_t)scrollback_size)) == NULL)
+		err(1, __func__);
+	b->sb_kind = kind;
+	b->sb_hash = h;
+	LIST_INSERT_HEAD(bucket, b, sb_entry);
+	return b;
+}
+
+/*
+ * Text is always put contiguously, wrapping around to the buffer start
+ * if it doesn't fit before the end. Lines overwritten are the oldest
+ * ones, in order.
+ */
+static void
+sb_append(struct sb_buffer *b, time_t t, char type, const char *author,
+    const char *text, size_t len) {
+	struct sb_line	*sl, *nlines;
+	size_t		 pos, i, nsize;
+
+	if (len + 1 > (size_t)scrollback_size)
+		len = (size_t)scrollback_size - 1;
+	pos = b->sb_head;
+	if (pos + len + 1 > (size_t)scrollback_size) {
+		// the skipped tail holds the oldest lines
+		while (b->sb_nlines > 0 &&
+		    b->sb_lines[b->sb_first].sl_off >= pos) {
+			b->sb_first = (b->sb_first + 1) & (b->sb_linesz - 1);
+			b->sb_nlines--;
+		}
+		pos = 0;
+	}
+	while (b->sb_nlines > 0) {
+		sl = &b->sb_lines[b->sb_first];
+		if (sl->sl_off >= pos + len + 1 ||
+		    sl->sl_off + sl->sl_len <= pos)
+			break;
+		b->sb_first = (b->sb_first + 1) & (b->sb_linesz - 1);
+		b->sb_nlines--;
+	}
+
+	if (b->sb_nlines == b->sb_linesz) {
+		nsize = b->sb_linesz ? b->sb_linesz * 2 : 64;
+		if ((nlines = reallocarray(NULL, nsize,
+		    sizeof(struct sb_line))) == NULL)
+			err(1, __func__);
+		for (i = 0; i < b->sb_nlines; i++)
+			nlines[i] = b->sb_lines[(b->sb_first + i) &
+			    (b->sb_linesz - 1)];
+		free(b->sb_lines);
+		b->sb_lines = nlines;
+		b->sb_linesz = nsize;
+		b->sb_first = 0;
+	}
+
+	sl = &b->sb_lines[(b->sb_first + b->sb_nlines) & (b->sb_linesz - 1)];
+	sl->sl_time = t;
+	sl->sl_author = sb_intern(author);
+	sl->sl_off = pos;
+	sl->sl_len = len + 1;
+	sl->sl_type = type;
+	memcpy(b->sb_text + pos, text, len);
+	b->sb_text[pos + len] = '\0';
+	b->sb_nlines++;
+	b->sb_head = pos + len + 1;
+}
+
+/*
+ * Remembers chat message, arguments are the same as for save_history().
+ */
+void
+scrollback_add(struct icb_session *s, char type, const char *peer,
+    const char *msg, int incoming) {
+	struct sb_buffer	*b;
+	const char		*author;
+	char			 kind;
+
+	if (scrollback_size == 0)
+		return;
+	author = incoming ? peer : s->is_nick;
+	kind = history_target(type, &peer, msg);
+	b = sb_find(s, kind, peer, 1);
+	sb_append(b, icb_now.ic_time, type, author, msg, strlen(msg));
+}
+
+/*
+ * Displays the last count lines of buffer, with dates for ones
+ * older than today.
+ */
+static void
+sb_show(const struct sb_buffer *b, size_t count) {
+	const struct sb_line	*sl;
+	const char		*preuser, *postuser;
+	struct tm		 tm, today;
+	size_t			 i;
+	char			 ts[sizeof("[0000-00-00 00:00:00]")];
+
+	if (count > b->sb_nlines)
+		count = b->sb_nlines;
+	localtime_r(&icb_now.ic_time, &today);
+	for (i = b->sb_nlines - count; i < b->sb_nlines; i++) {
+		sl = &b->sb_lines[(b->sb_first + i) & (b->sb_linesz - 1)];
+		localtime_r(&sl->sl_time, &tm);
+		if (tm.tm_year == today.tm_year && tm.tm_yday == today.tm_yday)
+			strftime(ts, sizeof(ts), "[%H:%M:%S]", &tm);
+		else
+			strftime(ts, sizeof(ts), "[%Y-%m-%d %H:%M:%S]", &tm);
+		chat_marks(sl->sl_type, &preuser, &postuser);
+		push_stdout_untrusted("%s %s%s%s %s", ts, preuser,
+		    sl->sl_author, postuser, b->sb_text + sl->sl_off);
+		push_stdout("\n");
+	}
+}
+
+/*
+ * "/last [count] [nick]": replays lines of the current room,
+ * or of private chat with nick.
+ */
+void
+scrollback_cmd(char *args) {
+	struct sb_buffer	*b;
+	const char		*errstr, *peer;
+	char			*word, *end;
+	size_t			 count = SB_DEFAULT_LINES;
+	char			 kind = 'r';
+
+	peer = session->is_room;
+	while (isspace((unsigned char)*args))
+		args++;
+	if (isdigit((unsigned char)*args)) {
+		for (word = args; *args && !isspace((unsigned char)*args);
+		    args++)
+			;
+		if (*args)
+			*args++ = '\0';
+		count = (size_t)strtonum(word, 1, INT_MAX, &errstr);
+		if (errstr) {
+			push_stdout("/last: line count is %s\n", errstr);
+			return;
+		}
+		while (isspace((unsigned char)*args))
+			args++;
+	}
+	if (*args) {
+		for (end = args; *end && !isspace((unsigned char)*end); end++)
+			;
+		if (*end) {
+			*end++ = '\0';
+			while (isspace((unsigned char)*end))
+				end++;
+		}
+		if (*end) {
+			push_stdout("usage: /last [count] [nick]\n");
+			return;
+		}
+		peer = args;
+		kind = 'p';
+	}
+
+	if ((b = sb_find(session, kind, peer, 0)) == NULL ||
+	    b->sb_nlines == 0) {
+		push_stdout_untrusted("no lines to show for %s", peer);
+		push_stdout("\n");
+		return;
+	}
+	sb_show(b, count);
+}
+
+/*
+ * Returns the last maxlen bytes of plain log, or NULL.
+ */
+static char *
+sb_read_tail(const char *path, size_t maxlen, size_t *lenp, int *cutp) {
+	struct stat	 st;
+	ssize_t		 n;
+	off_t		 off;
+	char		*buf;
+	int		 fd;
+
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	off = (st.st_size > (off_t)maxlen) ? st.st_size - (off_t)maxlen : 0;
+	if ((buf = malloc((size_t)(st.st_size - off) + 1)) == NULL)
+		err(1, __func__);
+	n = pread(fd, buf, (size_t)(st.st_size - off), off);
+	close(fd);
+	if (n <= 0) {
+		free(buf);
+		return NULL;
+	}
+	buf[n] = '\0';
+	*lenp = (size_t)n;
+	*cutp = off > 0;
+	return buf;
+}
+
+/*
+ * Loads the last scrollback_warm_size bytes of chat logs, skipping the
+ * first line if it's incomplete. If the current log is shorter, the
+ * rest is taken from the last rotated segment, if any.
+ * Lines are "YYYY-MM-DD HH:MM:SS nick: text".
+ */
+static void
+sb_warm_chat(struct icb_session *s, char kind, const char *peer,
+    const char *logname, const char *segname) {
+	struct sb_buffer	*b;
+	struct tm		 tm;
+	time_t			 t;
+	size_t			 len = 0, seglen;
+	const char		*author;
+	char			*buf = NULL, *seg, *line, *eol, *colon;
+	char			 path[PATH_MAX];
+	int			 cut = 0, segcut;
+
+	if (logname != NULL && snprintf(path, sizeof(path), "%s/%s",
+	    s->is_history_path, logname) < (int)sizeof(path))
+		buf = sb_read_tail(path, (size_t)scrollback_warm_size, &len,
+		    &cut);
+	if (!cut && segname != NULL && len < (size_t)scrollback_warm_size &&
+	    snprintf(path, sizeof(path), "%s/%s", s->is_history_path,
+	    segname) < (int)sizeof(path) &&
+	    (seg = archive_tail(path, (size_t)scrollback_warm_size - len,
+	    &seglen, &segcut)) != NULL) {
+		if ((line = realloc(seg, seglen + len + 1)) == NULL)
+			err(1, __func__);
+		if (buf != NULL)
+			memcpy(line + seglen, buf, len + 1);
+		free(buf);
+		buf = line;
+		len += seglen;
+		cut = segcut;
+	}
+	if (buf == NULL)
+		return;
+
+	line = buf;
+	if (cut && (line = memchr(buf, '\n', len)) != NULL)
+		line++;
+	b = sb_find(s, kind, peer, 1);
+	for (; line != NULL && *line; line = eol) {
+		if ((eol = strchr(line, '\n')) != NULL)
+			*eol++ = '\0';
+		memset(&tm, 0, sizeof(tm));
+		if (strlen(line) < 20 ||
+		    sscanf(line, "%4d-%2d-%2d %2d:%2d:%2d", &tm.tm_year,
+		    &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
+		    &tm.tm_sec) != 6 ||
+		    (colon = strstr(line + 20, ": ")) == NULL)
+			continue;
+		tm.tm_year -= 1900;
+		tm.tm_mon--;
+		tm.tm_isdst = -1;
+		if ((t = mktime(&tm)) == -1)
+			continue;
+		*colon = '\0';
+		author = line + 20;
+		if (strcmp(author, "me") == 0)
+			author = s->is_nick;
+		sb_append(b, t, (kind == 'p') ? 'c' : 'b', author, colon + 2,
+		    strlen(colon + 2));
+	}
+	free(buf);
+}
+
+/*
+ * Fills buffers from tails of session logs. Logs of a chat are listed
+ * together, the current one being the last.
+ */
+void
+scrollback_warm(struct icb_session *s) {
+	struct history_name	 hn, next;
+	char			**names, peer[PATH_MAX];
+	const char		*segname = NULL;
+	size_t			 i;
+
+	if (scrollback_size == 0 || scrollback_warm_size == 0 ||
+	    s->is_history_path[0] == '\0')
+		return;
+	if ((names = history_list(s->is_history_path)) == NULL) {
+		warn("%s", s->is_history_path);
+		return;
+	}
+	for (i = 0; names[i] != NULL; i++) {
+		(void)history_parse_name(names[i], &hn);
+		if (names[i + 1] != NULL) {
+			(void)history_parse_name(names[i + 1], &next);
+			if (next.hn_baselen == hn.hn_baselen &&
+			    strncmp(names[i], names[i + 1], hn.hn_baselen) == 0) {
+				if (hn.hn_stamp != NULL)
+					segname = names[i];
+				continue;
+			}
+		}
+		if (hn.hn_peerlen < sizeof(peer)) {
+			memcpy(peer, hn.hn_peer, hn.hn_peerlen);
+			peer[hn.hn_peerlen] = '\0';
+			if (hn.hn_stamp != NULL)
+				sb_warm_chat(s, hn.hn_kind, peer, NULL,
+				    names[i]);
+			else
+				sb_warm_chat(s, hn.hn_kind, peer, names[i],
+				    segname);
+		}
+		segname = NULL;
+	}
+	history_list_free(names);
+}
+
+void
+scrollback_free(struct icb_session *s) {
+	struct sb_buffer	*b;
+	int			 i;
+
+	if (s->is_scrollback == NULL)
+		return;
+	for (i = 0; i < SB_HASH_SIZE; i++)
+		while ((b = LIST_FIRST(&s->is_scrollback->sb_buckets[i])) !=
+		    NULL) {
+			LIST_REMOVE(b, sb_entry);
+			free(b->sb_lines);
+			free(b->sb_text);
+			free(b->sb_peer);
+			free(b);
+		}
+	free(s->is_scrollback);
+	s->is_scrollback = NULL;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef OICB_SCROLLBACK_H
+#define OICB_SCROLLBACK_H
+
+struct icb_session;
+
+void	 scrollback_add(struct icb_session *s, char type, const char *peer,
+	    const char *msg, int incoming);
+void	 scrollback_cmd(char *args);
+void	 scrollback_warm(struct icb_session *s);
+void	 scrollback_free(struct icb_session *s);
+
+extern int	 scrollback_size;
+extern int	 scrollback_warm_size;
+
+#endif // OICB_SCROLLBACK_H
@@ -0,0 +1,706 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "oicb.h"
+#include "archive.h"
+#include "arena.h"
+#include "history.h"
+#include "search.h"
+#include "session.h"
+
+/*
+ * Log files are searched with mmap(2), a slice at a time between event
+ * loop iterations, so chat goes on while searching.
+ *
+ * Every log has an index of offsets, where each day starts, in a file
+ * named like the log but with ".idx" suffix, so lookups limited by date
+ * skip the rest of the log. Index is updated on every search, scanning
+ * only lines added since the last one.
+ *
+ * Rotated segments are decompressed and searched a slice at a time
+ * instead, without index. Ones rotated before the first day asked are
+ * skipped by name.
+ */
+#define SEARCH_SLICE	(1024 * 1024)
+#define DAYLEN		(sizeof("0000-00-00") - 1)
+
+struct search_day {
+	char	 sd_day[DAYLEN];
+	size_t	 sd_offset;
+};
+
+enum SearchPhase {
+	SearchOpen,
+	SearchIndex,
+	SearchScan,
+	SearchStream,
+};
+
+struct search_job {
+	struct icb_session	*sj_session;	// gets the results
+	char			 sj_dir[PATH_MAX];
+	char			*sj_needle;
+	size_t			 sj_needlelen;
+	char			 sj_from[DAYLEN + 1];	// empty if unlimited
+	char			 sj_to[DAYLEN + 1];
+	char			**sj_files;
+	size_t			 sj_nfiles, sj_nextfile;
+	int			 sj_nmatches;
+
+	// current file
+	enum SearchPhase	 sj_phase;
+	char			 sj_path[PATH_MAX];
+	const char		*sj_label;	// log name without suffixes
+	int			 sj_labellen;
+	ino_t			 sj_ino;
+	char			*sj_map;	// read only
+	size_t			 sj_mapsz;
+	size_t			 sj_pos, sj_end;
+	struct search_day	*sj_days;
+	size_t			 sj_ndays, sj_daysz;
+	int			 sj_index_changed;
+
+	// current segment
+	struct archive_reader	*sj_reader;
+	char			*sj_buf;	// data not searched yet
+	size_t			 sj_buflen, sj_bufsz;
+};
+
+int	search_max_matches = 1000;
+
+static struct search_job	*job;
+
+static const char	*search_mem(const char *hay, size_t haylen,
+			    const char *needle, size_t nlen);
+static int		 is_day(const char *s);
+static int		 list_files(struct search_job *sj, const char *peer);
+static void		 load_index(struct search_job *sj);
+static void		 save_index(struct search_job *sj);
+static void		 add_day(struct search_job *sj, const char *day,
+			    size_t offset);
+static size_t		 day_offset(struct search_job *sj, const char *day,
+			    int after);
+static void		 close_file(struct search_job *sj);
+static void		 free_job(struct search_job *sj);
+static void		 search_done(const char *why);
+static size_t		 step_open(struct search_job *sj);
+static size_t		 step_index(struct search_job *sj);
+static size_t		 step_scan(struct search_job *sj);
+static size_t		 step_stream(struct search_job *sj);
+static void		 show_match(struct search_job *sj, const char *bol,
+			    const char *eol);
+
+/*
+ * Finds first occurrence of needle in hay. Candidate positions are
+ * found checking both the first and the last needle bytes, for whole
+ * block at once where possible.
+ */
+static const char *
+search_mem(const char *hay, size_t haylen, const char *needle, size_t nlen) {
+	const char	*p;
+	size_t		 i = 0;
+
+	if (nlen == 0 || nlen > haylen)
+		return NULL;
+#if defined(__SSE2__)
+	{
+		const __m128i	first = _mm_set1_epi8(needle[0]);
+		const __m128i	last = _mm_set1_epi8(needle[nlen - 1]);
+		__m128i		bf, bl;
+		unsigned int	m;
+
+		for (; i + nlen - 1 + 16 <= haylen; i += 16) {
+			bf = _mm_loadu_si128((const __m128i *)(hay + i));
+			bl = _mm_loadu_si128(
+			    (const __m128i *)(hay + i + nlen - 1));
+			m = (unsigned int)_mm_movemask_epi8(_mm_and_si128(
+			    _mm_cmpeq_epi8(bf, first),
+			    _mm_cmpeq_epi8(bl, last)));
+			for (; m != 0; m &= m - 1) {
+				p = hay + i + __builtin_ctz(m);
+				if (memcmp(p, needle, nlen) == 0)
+					return p;
+			}
+		}
+	}
+#endif
+	// memchr(3) is usually vectorized by libc
+	while (i + nlen <= haylen) {
+		p = memchr(hay + i, needle[0], haylen - nlen + 1 - i);
+		if (p == NULL)
+			return NULL;
+		if (memcmp(p, needle, nlen) == 0)
+			return p;
+		i = (size_t)(p - hay) + 1;
+	}
+	return NULL;
+}
+
+static int
+is_day(const char *s) {
+	size_t	 i;
+
+	for (i = 0; i < DAYLEN; i++)
+		if ((i == 4 || i == 7) ? s[i] != '-' :
+		    !isdigit((unsigned char)s[i]))
+			return 0;
+	return 1;
+}
+
+/*
+ * Collects logs and their segments to look in, in chronological order:
+ * of the given peer only, if any.
+ */
+static int
+list_files(struct search_job *sj, const char *peer) {
+	struct history_name	 hn;
+	char			**names;
+	size_t			 i, j;
+
+	if ((names = history_list(sj->sj_dir)) == NULL)
+		return -1;
+	for (i = j = 0; names[i] != NULL; i++) {
+		(void)history_parse_name(names[i], &hn);
+		if (peer != NULL && (hn.hn_peerlen != strlen(peer) ||
+		    memcmp(hn.hn_peer, peer, hn.hn_peerlen) != 0)) {
+			free(names[i]);
+			continue;
+		}
+		names[j++] = names[i];
+	}
+	sj->sj_files = names;
+	sj->sj_nfiles = j;
+	return 0;
+}
+
+static void
+add_day(struct search_job *sj, const char *day, size_t offset) {
+	struct search_day	*nd;
+	size_t			 nsize;
+
+	if (sj->sj_ndays == sj->sj_daysz) {
+		nsize = sj->sj_daysz ? sj->sj_daysz * 2 : 64;
+		nd = reallocarray(sj->sj_days, nsize, sizeof(*nd));
+		if (nd == NULL)
+			err(1, __func__);
+		sj->sj_days = nd;
+		sj->sj_daysz = nsize;
+	}
+	memcpy(sj->sj_days[sj->sj_ndays].sd_day, day, DAYLEN);
+	sj->sj_days[sj->sj_ndays].sd_offset = offset;
+	sj->sj_ndays++;
+}
+
+/*
+ * Index file format:
+ *
+ * oicb-index 2 <log inode> <log bytes indexed>
+ * <YYYY-MM-DD> <offset of the first line of that day>
+ * ...
+ *
+ * Index not matching the log is rebuilt from scratch; inode changes
+ * when the log is rotated.
+ */
+static void
+load_index(struct search_job *sj) {
+	FILE			*f;
+	char			 path[PATH_MAX], day[DAYLEN + 1];
+	unsigned long long	 ino, indexed, offset;
+
+	sj->sj_ndays = 0;
+	sj->sj_pos = 0;
+	snprintf(path, sizeof(path), "%.*s.idx",
+	    (int)(strlen(sj->sj_path) - 4), sj->sj_path);
+	if ((f = fopen(path, "r")) == NULL)
+		return;
+	if (fscanf(f, "oicb-index 2 %llu %llu\n", &ino, &indexed) != 2 ||
+	    ino != (unsigned long long)sj->sj_ino || indexed > sj->sj_mapsz)
+		goto rebuild;
+	while (fscanf(f, "%10s %llu\n", day, &offset) == 2) {
+		if (!is_day(day) || offset > indexed ||
+		    (sj->sj_ndays > 0 &&
+		     offset < sj->sj_days[sj->sj_ndays - 1].sd_offset))
+			goto rebuild;
+		add_day(sj, day, (size_t)offset);
+	}
+	if (!feof(f))
+		goto rebuild;
+	// indexed part should end with complete line
+	if (indexed > 0 && sj->sj_map[indexed - 1] != '\n')
+		goto rebuild;
+	fclose(f);
+	sj->sj_pos = (size_t)indexed;
+	return;
+
+rebuild:
+	fclose(f);
+	sj->sj_ndays = 0;
+	sj->sj_index_changed = 1;
+}
+
+static void
+save_index(struct search_job *sj) {
+	FILE	*f;
+	char	 path[PATH_MAX], tmppath[PATH_MAX];
+	size_t	 i;
+
+	snprintf(path, sizeof(path), "%.*s.idx",
+	    (int)(strlen(sj->sj_path) - 4), sj->sj_path);
+	if (snprintf(tmppath, sizeof(tmppath), "%s.tmp", path) >=
+	    (int)sizeof(tmppath))
+		return;
+	if ((f = fopen(tmppath, "w")) == NULL)
+		goto fail;
+	fprintf(f, "oicb-index 2 %llu %zu\n", (unsigned long long)sj->sj_ino,
+	    sj->sj_pos);
+	for (i = 0; i < sj->sj_ndays; i++)
+		fprintf(f, "%.*s %zu\n", (int)DAYLEN, sj->sj_days[i].sd_day,
+		    sj->sj_days[i].sd_offset);
+	if (fclose(f) == EOF || rename(tmppath, path) == -1)
+		goto fail;
+	return;
+
+fail:
+	// searching still works, just slower next time
+	warn("%s", path);
+	unlink(tmppath);
+}
+
+/*
+ * Returns offset of the first line of the given day, or of the first one
+ * after it; or log size if there are no such lines.
+ * Logs are expected to go in chronological order.
+ */
+static size_t
+day_offset(struct search_job *sj, const char *day, int after) {
+	size_t	 lo = 0, hi = sj->sj_ndays, mid;
+	int	 c;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		c = memcmp(sj->sj_days[mid].sd_day, day, DAYLEN);
+		if (c < 0 || (after && c == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < sj->sj_ndays) ? sj->sj_days[lo].sd_offset : sj->sj_mapsz;
+}
+
+static void
+close_file(struct search_job *sj) {
+	if (sj->sj_map != NULL)
+		munmap(sj->sj_map, sj->sj_mapsz);
+	sj->sj_map = NULL;
+	sj->sj_mapsz = 0;
+	if (sj->sj_reader != NULL)
+		archive_close(sj->sj_reader);
+	sj->sj_reader = NULL;
+	free(sj->sj_buf);
+	sj->sj_buf = NULL;
+	sj->sj_buflen = sj->sj_bufsz = 0;
+	sj->sj_phase = SearchOpen;
+}
+
+static void
+search_done(const char *why) {
+	struct icb_session	*cur;
+
+	cur = session;
+	session = job->sj_session;
+	if (why != NULL)
+		push_stdout("search stopped: %s, %d match%s shown\n", why,
+		    job->sj_nmatches, (job->sj_nmatches == 1) ? "" : "es");
+	else if (job->sj_nmatches == 0)
+		push_stdout("search finished: no matches found\n");
+	else
+		push_stdout("search finished: %d match%s found\n",
+		    job->sj_nmatches, (job->sj_nmatches == 1) ? "" : "es");
+	session = cur;
+
+	free_job(job);
+	job = NULL;
+}
+
+static void
+free_job(struct search_job *sj) {
+	size_t	 i;
+
+	close_file(sj);
+	if (sj->sj_files != NULL) {
+		for (i = 0; i < sj->sj_nfiles; i++)
+			free(sj->sj_files[i]);
+		free(sj->sj_files);
+	}
+	free(sj->sj_days);
+	free(sj->sj_needle);
+	free(sj);
+}
+
+static size_t
+step_open(struct search_job *sj) {
+	struct history_name	 hn;
+	struct stat		 st;
+	void			*map;
+	const char		*name, *from = sj->sj_from;
+	int			 fd;
+
+	name = sj->sj_files[sj->sj_nextfile++];
+	if (snprintf(sj->sj_path, sizeof(sj->sj_path), "%s/%s", sj->sj_dir,
+	    name) >= (int)sizeof(sj->sj_path))
+		return 0;
+	(void)history_parse_name(name, &hn);
+	sj->sj_label = strrchr(sj->sj_path, '/') + 1;
+	sj->sj_labellen = (int)(hn.hn_baselen - 4);
+
+	if (hn.hn_stamp != NULL) {
+		// "YYYYMMDD" against "YYYY-MM-DD"
+		if (from[0] && (memcmp(hn.hn_stamp, from, 4) < 0 ||
+		    (memcmp(hn.hn_stamp, from, 4) == 0 &&
+		     (memcmp(hn.hn_stamp + 4, from + 5, 2) < 0 ||
+		      (memcmp(hn.hn_stamp + 4, from + 5, 2) == 0 &&
+		       memcmp(hn.hn_stamp + 6, from + 8, 2) < 0)))))
+			return 0;
+		if ((sj->sj_reader = archive_open(sj->sj_path)) == NULL &&
+		    errno == ENOENT && !hn.hn_gz) {
+			// compressed by archive thread since listing
+			if (strlcat(sj->sj_path, ".gz", sizeof(sj->sj_path)) <
+			    sizeof(sj->sj_path))
+				sj->sj_reader = archive_open(sj->sj_path);
+		}
+		if (sj->sj_reader == NULL) {
+			if (errno != ENOENT)
+				warn("%s", sj->sj_path);
+			return 0;
+		}
+		sj->sj_phase = SearchStream;
+		return 0;
+	}
+
+	if ((fd = open(sj->sj_path, O_RDONLY)) == -1) {
+		if (errno != ENOENT)
+			warn("%s", sj->sj_path);
+		return 0;
+	}
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	sj->sj_ino = st.st_ino;
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		warn("%s", sj->sj_path);
+		return 0;
+	}
+	sj->sj_map = map;
+	sj->sj_mapsz = (size_t)st.st_size;
+	sj->sj_index_changed = 0;
+	load_index(sj);
+	sj->sj_phase = SearchIndex;
+	return 0;
+}
+
+/*
+ * Looks for day changes in lines not covered by index yet.
+ */
+static size_t
+step_index(struct search_job *sj) {
+	const char	*line, *nl = NULL, *end, *last;
+	size_t		 start, limit;
+
+	start = sj->sj_pos;
+	limit = sj->sj_pos + SEARCH_SLICE;
+	if (limit > sj->sj_mapsz)
+		limit = sj->sj_mapsz;
+	end = sj->sj_map + sj->sj_mapsz;
+	last = sj->sj_ndays ? sj->sj_days[sj->sj_ndays - 1].sd_day : NULL;
+	for (line = sj->sj_map + sj->sj_pos; line < sj->sj_map + limit;
+	    line = nl + 1) {
+		if ((nl = memchr(line, '\n', (size_t)(end - line))) == NULL)
+			break;    // being written right now
+		if (nl - line >= (ptrdiff_t)DAYLEN && is_day(line) &&
+		    (last == NULL || memcmp(last, line, DAYLEN) != 0)) {
+			add_day(sj, line, (size_t)(line - sj->sj_map));
+			last = sj->sj_days[sj->sj_ndays - 1].sd_day;
+		}
+	}
+	sj->sj_pos = (size_t)(line - sj->sj_map);
+	if (sj->sj_pos != start)
+		sj->sj_index_changed = 1;
+	if (nl != NULL && sj->sj_pos < sj->sj_mapsz)
+		return sj->sj_pos - start;
+
+	// index is up to date
+	if (sj->sj_index_changed)
+		save_index(sj);
+	sj->sj_end = sj->sj_to[0] ? day_offset(sj, sj->sj_to, 1) : sj->sj_mapsz;
+	sj->sj_pos = sj->sj_from[0] ? day_offset(sj, sj->sj_from, 0) : 0;
+	sj->sj_phase = SearchScan;
+	return 0;
+}
+
+static void
+show_match(struct search_job *sj, const char *bol, const char *eol) {
+	push_stdout_untrusted("%.*s: %.*s", sj->sj_labellen, sj->sj_label,
+	    (int)(eol - bol), bol);
+	push_stdout("\n");
+}
+
+static size_t
+step_scan(struct search_job *sj) {
+	struct icb_session	*cur;
+	const char		*base, *p, *bol, *eol;
+	size_t			 start, next, limit;
+
+	// matches starting in the slice may end a bit after it
+	base = sj->sj_map;
+	start = sj->sj_pos;
+	next = sj->sj_pos + SEARCH_SLICE;
+	if (next > sj->sj_end)
+		next = sj->sj_end;
+	limit = next + sj->sj_needlelen - 1;
+	if (limit > sj->sj_end)
+		limit = sj->sj_end;
+	cur = session;
+	session = sj->sj_session;
+	while ((p = search_mem(base + sj->sj_pos, limit - sj->sj_pos,
+	    sj->sj_needle, sj->sj_needlelen)) != NULL) {
+		for (bol = p; bol > base && bol[-1] != '\n'; bol--)
+			;
+		eol = memchr(p, '\n', (size_t)(base + sj->sj_end - p));
+		if (eol == NULL)
+			eol = base + sj->sj_end;
+		show_match(sj, bol, eol);
+		sj->sj_pos = (size_t)(eol - base);
+		if (sj->sj_pos < sj->sj_end)
+			sj->sj_pos++;
+		if (++sj->sj_nmatches >= search_max_matches ||
+		    sj->sj_pos >= next)
+			break;
+	}
+	session = cur;
+	if (sj->sj_pos < next)
+		sj->sj_pos = next;
+	if (sj->sj_pos >= sj->sj_end)
+		close_file(sj);
+	return sj->sj_pos - start;
+}
+
+/*
+ * Reads another slice of segment, searching it up to the last complete
+ * line; the rest is kept for the next step.
+ */
+static size_t
+step_stream(struct search_job *sj) {
+	struct icb_session	*cur;
+	const char		*pos, *p, *bol, *eol, *end;
+	char			*nbuf;
+	size_t			 nsize;
+	ssize_t			 n;
+	int			 done;
+
+	if (sj->sj_buflen == sj->sj_bufsz) {
+		nsize = sj->sj_bufsz ? sj->sj_bufsz * 2 : SEARCH_SLICE;
+		if ((nbuf = realloc(sj->sj_buf, nsize)) == NULL)
+			err(1, __func__);
+		sj->sj_buf = nbuf;
+		sj->sj_bufsz = nsize;
+	}
+	n = archive_read(sj->sj_reader, sj->sj_buf + sj->sj_buflen,
+	    sj->sj_bufsz - sj->sj_buflen);
+	if (n == -1) {
+		warnx("%s: cannot decompress", sj->sj_path);
+		close_file(sj);
+		return 0;
+	}
+	sj->sj_buflen += (size_t)n;
+	done = (n == 0);
+	end = sj->sj_buf + sj->sj_buflen;
+	if (!done) {
+		for (; end > sj->sj_buf && end[-1] != '\n'; end--)
+			;
+		if (end == sj->sj_buf)
+			return (size_t)n;    // no complete line yet
+	}
+
+	// lines go in chronological order
+	if (sj->sj_to[0] && end - sj->sj_buf >= (ptrdiff_t)DAYLEN &&
+	    is_day(sj->sj_buf) && memcmp(sj->sj_buf, sj->sj_to, DAYLEN) > 0)
+		end = sj->sj_buf, done = 1;
+
+	cur = session;
+	session = sj->sj_session;
+	pos = sj->sj_buf;
+	while ((p = search_mem(pos, (size_t)(end - pos), sj->sj_needle,
+	    sj->sj_needlelen)) != NULL) {
+		for (bol = p; bol > sj->sj_buf && bol[-1] != '\n'; bol--)
+			;
+		if ((eol = memchr(p, '\n', (size_t)(end - p))) == NULL)
+			eol = end;
+		pos = (eol < end) ? eol + 1 : end;
+		if (eol - bol >= (ptrdiff_t)DAYLEN && is_day(bol)) {
+			if (sj->sj_to[0] && memcmp(bol, sj->sj_to, DAYLEN) > 0) {
+				done = 1;
+				break;
+			}
+			if (sj->sj_from[0] &&
+			    memcmp(bol, sj->sj_from, DAYLEN) < 0)
+				continue;
+		}
+		show_match(sj, bol, eol);
+		if (++sj->sj_nmatches >= search_max_matches)
+			break;
+	}
+	session = cur;
+
+	sj->sj_buflen -= (size_t)(end - sj->sj_buf);
+	memmove(sj->sj_buf, end, sj->sj_buflen);
+	if (done)
+		close_file(sj);
+	return (size_t)n;
+}
+
+/*
+ * Does another slice of search work.
+ */
+void
+proceed_search(void) {
+	size_t	 done = 0;
+
+	while (job != NULL && done < SEARCH_SLICE) {
+		if (job->sj_nmatches >= search_max_matches) {
+			search_done("too many matches");
+			return;
+		}
+		switch (job->sj_phase) {
+		case SearchOpen:
+			if (job->sj_nextfile == job->sj_nfiles) {
+				search_done(NULL);
+				return;
+			}
+			done += step_open(job);
+			break;
+		case SearchIndex:
+			done += step_index(job);
+			break;
+		case SearchScan:
+			done += step_scan(job);
+			break;
+		case SearchStream:
+			done += step_stream(job);
+			break;
+		}
+	}
+}
+
+/*
+ * Returns 0 if there is search in progress, -1 otherwise.
+ */
+int
+search_timeout(void) {
+	return (job != NULL) ? 0 : -1;
+}
+
+/*
+ * Handles "/grep [-d day] [-f day] [-t day] [-p peer] text" command.
+ * Days are given as YYYY-MM-DD; "-d" limits search to the single day.
+ */
+void
+search_cmd(char *args) {
+	struct search_job	*sj;
+	char			*opt, *val, *peer = NULL;
+	const char		*usage_msg =
+	    "usage: /grep [-d day] [-f day] [-t day] [-p nick|room] text\n";
+
+	if (session->is_history_path[0] == '\0') {
+		push_stdout("chat history is disabled\n");
+		return;
+	}
+	if ((sj = calloc(1, sizeof(struct search_job))) == NULL)
+		err(1, __func__);
+
+	while (isspace((unsigned char)*args))
+		args++;
+	while (args[0] == '-' && isalpha((unsigned char)args[1]) &&
+	    isspace((unsigned char)args[2])) {
+		opt = args + 1;
+		for (val = args + 2; isspace((unsigned char)*val); val++)
+			;
+		for (args = val; *args && !isspace((unsigned char)*args);
+		    args++)
+			;
+		if (*args)
+			*args++ = '\0';
+		while (isspace((unsigned char)*args))
+			args++;
+		if (*opt == 'p') {
+			peer = val;
+			continue;
+		}
+		if (strlen(val) != DAYLEN || !is_day(val))
+			goto bad;
+		if (*opt == 'd' || *opt == 'f')
+			strlcpy(sj->sj_from, val, sizeof(sj->sj_from));
+		if (*opt == 'd' || *opt == 't')
+			strlcpy(sj->sj_to, val, sizeof(sj->sj_to));
+		if (strchr("dft", *opt) == NULL)
+			goto bad;
+	}
+	if (*args == '\0' || (peer != NULL &&
+	    (*peer == '\0' || strchr(peer, '/') != NULL)))
+		goto bad;
+
+	if ((sj->sj_needle = strdup(args)) == NULL)
+		err(1, __func__);
+	sj->sj_needlelen = strlen(args);
+	sj->sj_session = session;
+	strlcpy(sj->sj_dir, session->is_history_path, sizeof(sj->sj_dir));
+	if (job != NULL)
+		search_done("new search started");
+	// make sure recent lines are found, too
+	history_write_all();
+	if (list_files(sj, peer) == -1) {
+		push_stdout("cannot list chat history: %s\n", strerror(errno));
+		free_job(sj);
+		return;
+	}
+	job = sj;
+	return;
+
+bad:
+	push_stdout("%s", usage_msg);
+	free_job(sj);
+}
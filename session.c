@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <ctype.h>
+#include <err.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "oicb.h"
+#include "arena.h"
+#include "chat.h"
+#include "connect.h"
+#include "event.h"
+#include "sched.h"
+#include "scrollback.h"
+#include "session.h"
+#include "transport.h"
+#include "who.h"
+
+struct icb_session_list	 sessions = TAILQ_HEAD_INITIALIZER(sessions);
+struct icb_session	*session, *active_session;
+int			 nsessions, nsessions_alive;
+int			 reconnect = 0;
+int			 reconnect_min = 1000;
+int			 reconnect_max = 300000;
+
+static const char	*state_names[] = {
+	"connecting",
+	"connected",
+	"logging in",
+	"chatting",
+};
+
+static void	 session_list(void);
+static void	 session_disconnect(struct icb_session *s);
+static void	 vsession_retry(struct icb_session *s, const char *fmt,
+		    va_list ap);
+
+/*
+ * Creates session from "[nick@]host[:port]" specification and room name.
+ * The specification string is modified and referenced afterwards.
+ */
+struct icb_session *
+session_new(char *spec, char *room) {
+	struct icb_session	*s;
+	char			*hostend;
+
+	if ((s = calloc(1, sizeof(struct icb_session))) == NULL)
+		err(1, __func__);
+	if ((s->is_rx_ring = malloc(RX_RING_SIZE)) == NULL)
+		err(1, __func__);
+	s->is_sock = -1;
+	s->is_transport = default_transport;
+	s->is_state = Connecting;
+	s->is_features = Ping;
+	s->is_room = room;
+	s->is_retry_at = -1;
+	sched_init(s);
+	SIMPLEQ_INIT(&s->is_tasks_held);
+	task_arena_init(&s->is_net_arena, 16384);
+
+	if ((s->is_hostname = strchr(spec, '@')) != NULL) {
+		s->is_nick = spec;
+		*s->is_hostname++ = '\0';
+		if (*s->is_hostname == '\0')
+			usage("invalid hostname specification");
+	} else {
+		s->is_hostname = spec;
+		s->is_nick = getlogin();
+	}
+	s->is_nicklen = strlen(s->is_nick);
+	if (s->is_nicklen >= NICKNAME_MAX)
+		usage("too long nickname");
+
+	if (s->is_hostname[0] == '[') {
+		s->is_hostname++;
+		hostend = strrchr(s->is_hostname, ']');
+		if (hostend == NULL ||
+		    (hostend[1] != '\0' && hostend[1] != ':'))
+			usage("invalid hostname specification");
+		if (hostend[1] == ':')
+			s->is_port = hostend + 2;
+		*hostend = '\0';
+	} else {
+		if ((s->is_port = strrchr(s->is_hostname, ':')) != NULL)
+			*s->is_port++ = '\0';
+	}
+
+	s->is_id = ++nsessions;
+	nsessions_alive++;
+	TAILQ_INSERT_TAIL(&sessions, s, is_entry);
+	if (active_session == NULL)
+		active_session = s;
+	return s;
+}
+
+struct icb_session *
+session_find(int id) {
+	struct icb_session	*s;
+
+	TAILQ_FOREACH(s, &sessions, is_entry)
+		if (s->is_id == id)
+			return s;
+	return NULL;
+}
+
+/*
+ * Closes connection, dropping anything not sent yet, and resets protocol
+ * state. Messages could be sent partially, so they're not resent.
+ */
+static void
+session_disconnect(struct icb_session *s) {
+	connect_abort(s);
+	s->is_transport->tr_close(s, 0);
+	if (s->is_sock != -1) {
+		event_del(s->is_sock);
+		close(s->is_sock);
+		s->is_sock = -1;
+	}
+	sched_drop(s);
+	s->is_state = Connecting;
+	s->is_features = Ping;
+	s->is_rx_head = s->is_rx_fill = 0;
+	s->is_rx_msglen = 0;
+	s->is_rx_discard = 0;
+	s->is_pings_sent = 0;
+	s->is_pongs_awaited = 0;
+	who_reset(s, 0);
+}
+
+/*
+ * Disconnects given session for good.
+ * The whole program exits when the last session is closed.
+ */
+void
+session_close(struct icb_session *s) {
+	struct icb_session	*next;
+	struct icb_task		*it;
+
+	if (s->is_dead)
+		return;
+	session_disconnect(s);
+	while ((it = SIMPLEQ_FIRST(&s->is_tasks_held)) != NULL) {
+		SIMPLEQ_REMOVE_HEAD(&s->is_tasks_held, it_entry);
+		task_free(it);
+	}
+	who_reset(s, 1);
+	scrollback_free(s);
+	s->is_transport->tr_close(s, 1);
+	s->is_dead = 1;
+	if (--nsessions_alive == 0) {
+		want_exit = 1;
+		return;
+	}
+
+	if (s != active_session)
+		return;
+	TAILQ_FOREACH(next, &sessions, is_entry)
+		if (!next->is_dead)
+			break;
+	active_session = next;
+	push_stdout("switched to session #%d, %s at %s\n",
+	    next->is_id, next->is_room, next->is_hostname);
+}
+
+/*
+ * Reports session failure and closes it; the only session failing
+ * terminates the program, as before sessions were introduced.
+ */
+void
+session_fail(struct icb_session *s, const char *fmt, ...) {
+	va_list	 ap;
+	char	*msg;
+
+	va_start(ap, fmt);
+	if (reconnect) {
+		vsession_retry(s, fmt, ap);
+		va_end(ap);
+		return;
+	}
+	if (nsessions == 1)
+		verrx(1, fmt, ap);
+	if (vasprintf(&msg, fmt, ap) == -1)
+		err(1, __func__);
+	va_end(ap);
+	push_stdout("%s\n", msg);
+	free(msg);
+	session_close(s);
+}
+
+/*
+ * Reconnect delay grows exponentially, from reconnect_min up to
+ * reconnect_max milliseconds, and is randomized, so many clients
+ * kicked off at once don't reconnect at once too.
+ */
+static void
+vsession_retry(struct icb_session *s, const char *fmt, va_list ap) {
+	char	*msg;
+	int	 delay;
+
+	if (vasprintf(&msg, fmt, ap) == -1)
+		err(1, __func__);
+	session_disconnect(s);
+	if (s->is_backoff == 0)
+		s->is_backoff = reconnect_min;
+	else if (s->is_backoff <= reconnect_max / 2)
+		s->is_backoff *= 2;
+	else
+		s->is_backoff = reconnect_max;
+	delay = s->is_backoff / 2 +
+	    (int)arc4random_uniform((uint32_t)s->is_backoff / 2 + 1);
+	connect_later(s, delay);
+	push_stdout("%s, reconnecting in %d.%d seconds\n", msg,
+	    delay / 1000, delay % 1000 / 100);
+	free(msg);
+}
+
+/*
+ * Schedules reconnection of session that lost its connection, if asked
+ * to with -r. Returns 0 if the caller should handle it as before.
+ */
+int
+session_retry(struct icb_session *s, const char *fmt, ...) {
+	va_list	 ap;
+
+	if (!reconnect)
+		return 0;
+	va_start(ap, fmt);
+	vsession_retry(s, fmt, ap);
+	va_end(ap);
+	return 1;
+}
+
+static void
+session_list(void) {
+	struct icb_session	*s, *cur;
+
+	// lines are numbered already
+	cur = session;
+	session = NULL;
+	TAILQ_FOREACH(s, &sessions, is_entry)
+		push_stdout("%c#%d %s@%s %s, %s\n",
+		    (s == active_session) ? '*' : ' ', s->is_id,
+		    s->is_nick, s->is_hostname, s->is_room,
+		    s->is_dead ? "closed" : state_names[s->is_state]);
+	session = cur;
+}
+
+/*
+ * Handles "/session [N [text]]" command: without arguments, lists
+ * sessions; with session number only, makes it active; otherwise,
+ * text is handled as if it was typed in the given session.
+ */
+void
+session_cmd(char *args) {
+	struct icb_session	*s, *prev;
+	const char		*errstr;
+	char			*text;
+	int			 id;
+
+	while (isspace((unsigned char)*args))
+		args++;
+	if (*args == '\0') {
+		session_list();
+		return;
+	}
+
+	for (text = args; *text && !isspace((unsigned char)*text); text++)
+		;
+	if (*text)
+		*text++ = '\0';
+	while (isspace((unsigned char)*text))
+		text++;
+	if (*args == '#')
+		args++;
+
+	id = (int)strtonum(args, 1, nsessions, &errstr);
+	if (errstr || (s = session_find(id)) == NULL) {
+		push_stdout("no such session: %s\n", args);
+		return;
+	}
+	if (s->is_dead) {
+		push_stdout("session #%d is closed\n", id);
+		return;
+	}
+
+	if (*text == '\0') {
+		active_session = session = s;
+		push_stdout("switched to session #%d, %s at %s\n",
+		    s->is_id, s->is_room, s->is_hostname);
+		return;
+	}
+	if (s->is_state != Chat) {
+		push_stdout("session #%d is not logged in yet\n", id);
+		return;
+	}
+	prev = active_session;
+	active_session = s;
+	proceed_user_input(text);
+	if (active_session == s && !prev->is_dead)
+		active_session = prev;
+	session = active_session;
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef OICB_SESSION_H
+#define OICB_SESSION_H
+
+#include <limits.h>
+#include <time.h>
+
+struct addrinfo;
+struct icb_transport;
+struct scrollback;
+struct who_table;
+
+#define RX_RING_SIZE	16384	// must be a power of two, not less than 256
+#define PING_SLOTS	8	// pings tracked for round-trip time
+
+/*
+ * Everything related to a single server connection. All sessions share
+ * the event loop, the terminal and the history writer.
+ */
+TAILQ_HEAD(icb_session_list, icb_session);
+struct icb_session {
+	TAILQ_ENTRY(icb_session)	is_entry;
+	int		 is_id;		// starting from 1, as shown to user
+	int		 is_sock;
+	const struct icb_transport	*is_transport;
+	int		 is_dead;	// disconnected, kept for numbering
+	enum ICBState	 is_state;
+	enum SrvFeatures is_features;
+	char		*is_nick;
+	size_t		 is_nicklen;	// less than NICKNAME_MAX
+	char		*is_hostname;
+	char		*is_port;
+	char		*is_room;
+
+	struct icb_task_queue	 is_tasks_net;	// being written to socket
+	struct icb_task_queue	 is_tasks_sched[SendClassCount];	// sched.c
+	struct icb_task_queue	 is_tasks_held;	// user input until logged in
+	struct task_arena	 is_net_arena;
+	long long	 is_send_bytes;		// rate limit tokens, in 1/1000
+	long long	 is_send_pkts;
+	long long	 is_send_at;		// last tokens refill, in ms
+
+	// incoming data, see get_next_icb_msg()
+	unsigned char	*is_rx_ring;
+	size_t		 is_rx_head, is_rx_fill;	// unparsed data
+	char		*is_rx_msg;		// message being reassembled
+	size_t		 is_rx_msglen, is_rx_msgsize;
+	int		 is_rx_discard;		// skipping too long message
+
+	// connection establishment, see connect.c
+	struct addrinfo	 *is_ai;		// resolved addresses
+	struct addrinfo	**is_addrv;		// in order of trying
+	int		 *is_attempts;		// descriptors, -1 if none
+	size_t		  is_naddrs, is_nextaddr;
+	long long	  is_next_attempt;	// in ms
+	int		  is_resolving;
+	int		  is_conn_error;	// of the last failed attempt
+	long long	  is_retry_at;		// reconnect time, or -1
+	int		  is_backoff;		// last reconnect delay base
+
+	// TLS state, see transport.c
+	void		*is_tls;		// SSL, if connected
+	void		*is_tls_session;	// SSL_SESSION to resume
+	int		 is_tls_rwant;		// events reading waits for
+	int		 is_tls_wwant;		// events writing waits for
+	int		 is_tls_reported;
+
+	time_t		 is_lastnetinput;
+	int		 is_pings_sent;
+	int		 is_pongs_awaited;
+	unsigned int	 is_ping_seq;		// tag of the next ping
+	long long	 is_ping_at[PING_SLOTS]; // send time by tag, or 0
+
+	struct who_table	*is_who;	// last complete "/w" listing
+	struct who_table	*is_who_building;
+	struct scrollback	*is_scrollback;	// recent lines, for "/last"
+
+	char		 is_history_path[PATH_MAX];	// empty if disabled
+	int		 is_history_ready;	// directory exists
+};
+
+struct icb_session	*session_new(char *spec, char *room);
+struct icb_session	*session_find(int id);
+void			 session_close(struct icb_session *s);
+void			 session_fail(struct icb_session *s, const char *fmt, ...)
+	__attribute__((__format__ (printf, 2, 3)));
+int			 session_retry(struct icb_session *s, const char *fmt, ...)
+	__attribute__((__format__ (printf, 2, 3)));
+void			 session_cmd(char *args);
+
+extern struct icb_session_list	 sessions;
+extern struct icb_session	*session;	// one being handled
+extern struct icb_session	*active_session;	// gets user input
+extern int			 nsessions, nsessions_alive;
+extern int			 reconnect;
+extern int			 reconnect_min, reconnect_max;
+
+#endif // OICB_SESSION_H
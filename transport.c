@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Transports carrying ICB packets: plain TCP, and TLS when built with
+ * libssl (OpenSSL or LibreSSL).
+ *
+ * TLS is driven by read and write attempts made from the event loop, so
+ * handshake never blocks: the socket is polled for whatever the last
+ * SSL_read() or SSL_write() asked for. Session tickets received from
+ * server are kept in session, to resume TLS session on reconnect.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
+
+#include "oicb.h"
+#include "arena.h"
+#include "event.h"
+#include "session.h"
+#include "transport.h"
+
+const struct icb_transport	*default_transport = &plain_transport;
+int				 tls_verify = 1;
+
+static void		 plain_start(struct icb_session *s);
+static void		 plain_close(struct icb_session *s, int all);
+static ssize_t		 plain_readv(struct icb_session *s,
+			    const struct iovec *iov, int iovcnt);
+static ssize_t		 plain_writev(struct icb_session *s,
+			    const struct iovec *iov, int iovcnt);
+static int		 plain_events(struct icb_session *s, int sending);
+static int		 plain_readable(struct icb_session *s, int events);
+static const char	*plain_strerror(struct icb_session *s, int errnum);
+
+const struct icb_transport plain_transport = {
+	"tcp",
+	plain_start,
+	plain_close,
+	plain_readv,
+	plain_writev,
+	plain_events,
+	plain_readable,
+	plain_strerror,
+};
+
+static void
+plain_start(struct icb_session *s) {
+	(void)s;
+}
+
+static void
+plain_close(struct icb_session *s, int all) {
+	(void)s;
+	(void)all;
+}
+
+static ssize_t
+plain_readv(struct icb_session *s, const struct iovec *iov, int iovcnt) {
+	return readv(s->is_sock, iov, iovcnt);
+}
+
+static ssize_t
+plain_writev(struct icb_session *s, const struct iovec *iov, int iovcnt) {
+	return writev(s->is_sock, iov, iovcnt);
+}
+
+static int
+plain_events(struct icb_session *s, int sending) {
+	(void)s;
+	return EVENT_READ | (sending ? EVENT_WRITE : 0);
+}
+
+static int
+plain_readable(struct icb_session *s, int events) {
+	(void)s;
+	return (events & EVENT_READ) != 0;
+}
+
+static const char *
+plain_strerror(struct icb_session *s, int errnum) {
+	(void)s;
+	return strerror(errnum);
+}
+
+#ifdef HAVE_TLS
+
+#define TLS_RECORD_MAX	16384	// plaintext bytes in a single TLS record
+
+static void		 tls_start(struct icb_session *s);
+static void		 tls_close(struct icb_session *s, int all);
+static ssize_t		 tls_readv(struct icb_session *s,
+			    const struct iovec *iov, int iovcnt);
+static ssize_t		 tls_writev(struct icb_session *s,
+			    const struct iovec *iov, int iovcnt);
+static int		 tls_events(struct icb_session *s, int sending);
+static int		 tls_readable(struct icb_session *s, int events);
+static const char	*tls_strerror(struct icb_session *s, int errnum);
+static int		 tls_new_session(SSL *ssl, SSL_SESSION *sess);
+static ssize_t		 tls_result(struct icb_session *s, int rv, int *want,
+			    int idle);
+
+const struct icb_transport tls_transport = {
+	"tls",
+	tls_start,
+	tls_close,
+	tls_readv,
+	tls_writev,
+	tls_events,
+	tls_readable,
+	tls_strerror,
+};
+
+static SSL_CTX	*tls_ctx;
+static char	 tls_errbuf[256];	// of the last failure
+
+/*
+ * Called as soon as server sends a session ticket; the reference
+ * is kept until a newer ticket arrives or session is closed.
+ */
+static int
+tls_new_session(SSL *ssl, SSL_SESSION *sess) {
+	struct icb_session	*s = SSL_get_app_data(ssl);
+
+	if (s->is_tls_session != NULL)
+		SSL_SESSION_free(s->is_tls_session);
+	s->is_tls_session = sess;
+	return 1;
+}
+
+static void
+tls_start(struct icb_session *s) {
+	struct in6_addr	 addr;
+	SSL		*ssl;
+	int		 is_addr;
+
+	if ((ssl = SSL_new(tls_ctx)) == NULL)
+		errx(1, "%s: %s", __func__,
+		    ERR_error_string(ERR_get_error(), NULL));
+	SSL_set_app_data(ssl, s);
+	if (SSL_set_fd(ssl, s->is_sock) != 1)
+		errx(1, "%s: %s", __func__,
+		    ERR_error_string(ERR_get_error(), NULL));
+
+	// no SNI for addresses, see RFC 6066
+	is_addr = inet_pton(AF_INET, s->is_hostname, &addr) == 1 ||
+	    inet_pton(AF_INET6, s->is_hostname, &addr) == 1;
+	if (!is_addr && SSL_set_tlsext_host_name(ssl, s->is_hostname) != 1)
+		errx(1, "%s: %s", __func__,
+		    ERR_error_string(ERR_get_error(), NULL));
+	if (tls_verify) {
+		SSL_set_verify(ssl, SSL_VERIFY_PEER, NULL);
+		if ((is_addr ? X509_VERIFY_PARAM_set1_ip_asc(
+		    SSL_get0_param(ssl), s->is_hostname) :
+		    SSL_set1_host(ssl, s->is_hostname)) != 1)
+			errx(1, "%s: %s", __func__,
+			    ERR_error_string(ERR_get_error(), NULL));
+	}
+	if (s->is_tls_session != NULL)
+		SSL_set_session(ssl, s->is_tls_session);
+	SSL_set_connect_state(ssl);
+	s->is_tls = ssl;
+
+	// client speaks first, so make reading start the handshake
+	s->is_tls_rwant = EVENT_WRITE;
+	s->is_tls_wwant = EVENT_WRITE;
+	s->is_tls_reported = 0;
+}
+
+static void
+tls_close(struct icb_session *s, int all) {
+	if (s->is_tls != NULL) {
+		// don't care if close_notify doesn't get through
+		if (SSL_is_init_finished(s->is_tls))
+			(void)SSL_shutdown(s->is_tls);
+		SSL_free(s->is_tls);
+		s->is_tls = NULL;
+	}
+	if (all && s->is_tls_session != NULL) {
+		SSL_SESSION_free(s->is_tls_session);
+		s->is_tls_session = NULL;
+	}
+	ERR_clear_error();
+}
+
+/*
+ * Converts SSL_read() or SSL_write() result to readv(2)-like one,
+ * remembering what should be waited for before the next attempt:
+ * the idle event, unless TLS asks for something else.
+ */
+static ssize_t
+tls_result(struct icb_session *s, int rv, int *want, int idle) {
+	unsigned long	 e;
+
+	if (rv > 0) {
+		*want = idle;
+		if (debug && !s->is_tls_reported) {
+			s->is_tls_reported = 1;
+			warnx("%s: %s, %s, session %s", s->is_hostname,
+			    SSL_get_version(s->is_tls),
+			    SSL_get_cipher_name(s->is_tls),
+			    SSL_session_reused(s->is_tls) ?
+			    "resumed" : "new");
+		}
+		return rv;
+	}
+	switch (SSL_get_error(s->is_tls, rv)) {
+	case SSL_ERROR_WANT_READ:
+		*want = EVENT_READ;
+		errno = EAGAIN;
+		return -1;
+
+	case SSL_ERROR_WANT_WRITE:
+		*want = EVENT_WRITE;
+		errno = EAGAIN;
+		return -1;
+
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+
+	case SSL_ERROR_SYSCALL:
+		if ((e = ERR_get_error()) == 0) {
+			if (errno == 0)
+				return 0;    // EOF without close_notify
+			return -1;
+		}
+		break;
+
+	default:
+		e = ERR_get_error();
+	}
+
+	if (e != 0)
+		ERR_error_string_n(e, tls_errbuf, sizeof(tls_errbuf));
+	else
+		strlcpy(tls_errbuf, "TLS failure", sizeof(tls_errbuf));
+	if (SSL_get_verify_result(s->is_tls) != X509_V_OK)
+		strlcpy(tls_errbuf, X509_verify_cert_error_string(
+		    SSL_get_verify_result(s->is_tls)), sizeof(tls_errbuf));
+	ERR_clear_error();
+	errno = EPROTO;
+	return -1;
+}
+
+static ssize_t
+tls_readv(struct icb_session *s, const struct iovec *iov, int iovcnt) {
+	ssize_t	 n, total = 0;
+	int	 i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len == 0)
+			continue;
+		errno = 0;
+		n = tls_result(s, SSL_read(s->is_tls, iov[i].iov_base,
+		    (int)((iov[i].iov_len > INT_MAX) ? INT_MAX :
+		    iov[i].iov_len)), &s->is_tls_rwant, EVENT_READ);
+		if (n <= 0)
+			return total ? total : n;
+		total += n;
+		if ((size_t)n < iov[i].iov_len)
+			break;
+	}
+	return total;
+}
+
+/*
+ * Small buffers are gathered to be sent in a single TLS record. If the
+ * previous attempt wasn't completed, data passed now always starts with
+ * the same bytes, because it comes from the same tasks.
+ */
+static ssize_t
+tls_writev(struct icb_session *s, const struct iovec *iov, int iovcnt) {
+	static char	 buf[TLS_RECORD_MAX];
+	const void	*data;
+	size_t		 len, n;
+	int		 i;
+
+	if (iovcnt == 1 || iov[0].iov_len >= sizeof(buf)) {
+		data = iov[0].iov_base;
+		len = (iov[0].iov_len > INT_MAX) ? INT_MAX : iov[0].iov_len;
+	} else {
+		for (i = 0, len = 0; i < iovcnt && len < sizeof(buf); i++) {
+			n = sizeof(buf) - len;
+			if (n > iov[i].iov_len)
+				n = iov[i].iov_len;
+			memcpy(buf + len, iov[i].iov_base, n);
+			len += n;
+		}
+		data = buf;
+	}
+	errno = 0;
+	return tls_result(s, SSL_write(s->is_tls, data, (int)len),
+	    &s->is_tls_wwant, EVENT_WRITE);
+}
+
+/*
+ * When writing waits for data to arrive, don't wait for socket to become
+ * writable, or we'll spin; reading is always waited for anyway.
+ */
+static int
+tls_events(struct icb_session *s, int sending) {
+	int	 events = EVENT_READ | s->is_tls_rwant;
+
+	if (sending)
+		events |= s->is_tls_wwant;
+	return events;
+}
+
+static int
+tls_readable(struct icb_session *s, int events) {
+	return (events & s->is_tls_rwant) != 0;
+}
+
+static const char *
+tls_strerror(struct icb_session *s, int errnum) {
+	(void)s;
+	if (errnum == EPROTO && tls_errbuf[0] != '\0')
+		return tls_errbuf;
+	return strerror(errnum);
+}
+
+/*
+ * Certificates are loaded at once, before pledge(2) and unveil(2)
+ * could prevent reading them.
+ */
+static void
+tls_init(void) {
+	const char	*cafile;
+
+	if ((tls_ctx = SSL_CTX_new(TLS_client_method())) == NULL)
+		errx(1, "%s: %s", __func__,
+		    ERR_error_string(ERR_get_error(), NULL));
+	if (SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION) != 1)
+		errx(1, "%s: %s", __func__,
+		    ERR_error_string(ERR_get_error(), NULL));
+	SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+	    SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	SSL_CTX_set_session_cache_mode(tls_ctx,
+	    SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(tls_ctx, tls_new_session);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	// servers dropping connection often don't care; failing would
+	// also make session not resumable
+	SSL_CTX_set_options(tls_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+	if (!tls_verify)
+		return;
+	if ((cafile = getenv(X509_get_default_cert_file_env())) == NULL)
+		cafile = X509_get_default_cert_file();
+	if (SSL_CTX_load_verify_locations(tls_ctx, cafile, NULL) != 1)
+		errx(1, "cannot load CA certificates from %s: %s", cafile,
+		    ERR_error_string(ERR_get_error(), NULL));
+}
+
+#endif // HAVE_TLS
+
+/*
+ * Makes sessions created from now on use TLS, if tls is non-zero.
+ */
+void
+transport_init(int tls) {
+	if (!tls)
+		return;
+#ifdef HAVE_TLS
+	tls_init();
+	default_transport = &tls_transport;
+#else
+	errx(1, "built without TLS support");
+#endif
+}
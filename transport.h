@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef OICB_TRANSPORT_H
+#define OICB_TRANSPORT_H
+
+struct icb_session;
+struct iovec;
+
+/*
+ * Byte stream to server, on top of the connected socket. Functions
+ * follow readv(2) and writev(2) semantics, setting errno to EAGAIN
+ * when they would block.
+ */
+struct icb_transport {
+	const char	*tr_name;
+	void		 (*tr_start)(struct icb_session *s);
+	void		 (*tr_close)(struct icb_session *s, int all);
+	ssize_t		 (*tr_readv)(struct icb_session *s,
+			    const struct iovec *iov, int iovcnt);
+	ssize_t		 (*tr_writev)(struct icb_session *s,
+			    const struct iovec *iov, int iovcnt);
+	// events to wait for on socket, given whether there is data to send
+	int		 (*tr_events)(struct icb_session *s, int sending);
+	// whether reading should be attempted after events happened
+	int		 (*tr_readable)(struct icb_session *s, int events);
+	const char	*(*tr_strerror)(struct icb_session *s, int errnum);
+};
+
+extern const struct icb_transport	 plain_transport;
+#ifdef HAVE_TLS
+extern const struct icb_transport	 tls_transport;
+#endif
+
+void	 transport_init(int tls);
+
+extern const struct icb_transport	*default_transport;
+extern int				 tls_verify;
+
+#endif // OICB_TRANSPORT_H
@@ -17,29 +17,153 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <stdlib.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <wchar.h>
 #include <wctype.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include "utf8.h"
 
+static size_t	ascii_prefix(const unsigned char *s, size_t len);
+static int	ascii_isbreak(unsigned char c);
+static int	u8_decode(const unsigned char *s, size_t len, uint32_t *cp);
+
+/*
+ * Returns number of leading ASCII bytes in s, looking at no more than
+ * len bytes. Whole blocks are checked at once where possible.
+ */
+static size_t
+ascii_prefix(const unsigned char *s, size_t len)
+{
+	size_t		i = 0;
+	uint64_t	w;
+
+#if defined(__AVX2__)
+	for (; i + 32 <= len; i += 32) {
+		__m256i	v = _mm256_loadu_si256((const __m256i *)(s + i));
+		int	m = _mm256_movemask_epi8(v);
+		if (m != 0)
+			return i + (size_t)__builtin_ctz((unsigned)m);
+	}
+#endif
+#if defined(__SSE2__)
+	for (; i + 16 <= len; i += 16) {
+		__m128i	v = _mm_loadu_si128((const __m128i *)(s + i));
+		int	m = _mm_movemask_epi8(v);
+		if (m != 0)
+			return i + (size_t)__builtin_ctz((unsigned)m);
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for (; i + 16 <= len; i += 16)
+		if (vmaxvq_u8(vld1q_u8(s + i)) >= 0x80)
+			break;    // exact position is found below
+#endif
+	for (; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, s + i, sizeof(w));
+		if (w & UINT64_C(0x8080808080808080))
+			break;
+	}
+	while (i < len && s[i] < 0x80)
+		i++;
+	return i;
+}
+
+/*
+ * ASCII blank or punctuation character, same as in "C" locale.
+ */
+static int
+ascii_isbreak(unsigned char c)
+{
+	return c == ' ' || c == '\t' ||
+	    (c >= '!' && c <= '/') || (c >= ':' && c <= '@') ||
+	    (c >= '[' && c <= '`') || (c >= '{' && c <= '~');
+}
+
+/*
+ * Decodes single UTF-8 encoded character, looking at no more than len
+ * bytes, and returns its length, or -1 for invalid or truncated sequence.
+ * Overlong forms, surrogates and values above U+10FFFF are invalid.
+ * Never looks beyond the first byte that isn't a continuation one, thus
+ * strings could be passed with len lasting past terminating NUL.
+ */
+static int
+u8_decode(const unsigned char *s, size_t len, uint32_t *cp)
+{
+	uint32_t	c;
+	int		i, n;
+
+	if (len == 0)
+		return -1;
+	c = s[0];
+	if (c < 0x80) {
+		*cp = c;
+		return 1;
+	} else if (c < 0xC2)
+		return -1;  /* continuation byte or overlong form */
+	else if (c < 0xE0) {
+		n = 2;
+		c &= 0x1F;
+	} else if (c < 0xF0) {
+		n = 3;
+		c &= 0x0F;
+	} else if (c < 0xF5) {
+		n = 4;
+		c &= 0x07;
+	} else
+		return -1;
+	if ((size_t)n > len)
+		return -1;
+	for (i = 1; i < n; i++) {
+		if ((s[i] & 0xC0) != 0x80)
+			return -1;
+		c = (c << 6) | (s[i] & 0x3F);
+	}
+	if ((n == 3 && c < 0x800) || (n == 4 && c < 0x10000) ||
+	    c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+		return -1;
+	*cp = c;
+	return n;
+}
+
 /*
  * Return -1 for string containing invalid bytes or non-printable characters,
  * columns length for valid ones.
  * Empty strings are considered valid and result in 0 being returned.
+ *
+ * Decoding is done internally and doesn't depend on locale, but display
+ * width of non-ASCII characters comes from wcwidth(3).
  */
 int
 mbsvalidate(const char *mbs)
 {
-	wchar_t	  wc;
-	int	  len;  /* length in bytes of UTF-8 encoded character */
-	int	  width;  /* display width of a single Unicode char */
-	int	  total_width;  /* display width of the whole string */
+	const unsigned char	*s = (const unsigned char *)mbs;
+	size_t			 i, len, n;
+	uint32_t		 cp;
+	int			 clen;  /* length in bytes of UTF-8 encoded character */
+	int			 width;  /* display width of a single Unicode char */
+	int			 total_width;  /* display width of the whole string */
 
-	for (total_width = 0; *mbs != '\0'; mbs += len) {
-		if ((len = mbtowc(&wc, mbs, MB_CUR_MAX)) == -1)
+	len = strlen(mbs);
+	for (i = 0, total_width = 0; i < len; i += (size_t)clen) {
+		n = ascii_prefix(s + i, len - i);
+		total_width += (int)n;
+		if ((i += n) == len)
+			break;
+		if ((clen = u8_decode(s + i, len - i, &cp)) == -1)
 			return -1;
-		else if ((width = wcwidth(wc)) == -1)
+		else if ((width = wcwidth((wchar_t)cp)) == -1)
 			total_width++;
 		else
 			total_width += width;
@@ -48,29 +172,108 @@ mbsvalidate(const char *mbs)
 }
 
 /*
- * Finds place where the given string may be split, no longer than maxbytes.
- * If there is whitespace or punctuation, the last one in the given bounds is
- * used as last character.
- * Otherwise, the string is simply split between multi-byte characters.
- * Returned value is always not exceeding maxbytes.
+ * Returns length of the longest prefix of mbs not exceeding len bytes,
+ * that contains no invalid bytes.
  */
 size_t
-mbsbreak(const char *mbs, size_t maxbytes) {
-	wchar_t		  wc;
-	int		  len;  /* length in bytes of UTF-8 encoded character */
-	const char	 *lastgood = NULL;  /* position of last space or punctuation */
-	const char	 *p;
-
-	for (p = mbs; *p != '\0';) {
-		if ((len = mbtowc(&wc, p, MB_CUR_MAX)) == -1)
-			len = 1;
-		if (p + len > mbs + maxbytes)
+mbsvalidlen(const char *mbs, size_t len)
+{
+	const unsigned char	*s = (const unsigned char *)mbs;
+	size_t			 i;
+	uint32_t		 cp;
+	int			 clen;
+
+	for (i = 0; i < len; i += (size_t)clen) {
+		if ((i += ascii_prefix(s + i, len - i)) == len)
 			break;
-		p += len;
-		if (iswblank(wc) || iswpunct(wc))
-			lastgood = p;
+		if ((clen = u8_decode(s + i, len - i, &cp)) == -1)
+			break;
+	}
+	return i;
+}
+
+/*
+ * Splits the given string into pieces not longer than maxbytes each.
+ * If words is set, pieces end after the last whitespace or punctuation
+ * character fitting in, when there is one; otherwise, the string is
+ * simply split between characters. Non-UTF-8 strings (utf8 == 0) are
+ * handled bytewise, according to current locale.
+ *
+ * The string is scanned once, pieces are returned by mbssplit_next()
+ * in order. Breaking on words, two successive pieces are always longer
+ * than maxbytes - 4 together.
+ */
+void
+mbssplit_init(struct mbs_splitter *ms, const char *mbs, size_t len,
+    size_t maxbytes, int words, int utf8)
+{
+	ms->ms_s = (const unsigned char *)mbs;
+	ms->ms_len = len;
+	ms->ms_max = maxbytes;
+	ms->ms_start = ms->ms_pos = ms->ms_lastgood = 0;
+	ms->ms_words = words;
+	ms->ms_utf8 = utf8;
+}
+
+/*
+ * Returns length of the next piece, or 0 if there is nothing left.
+ */
+size_t
+mbssplit_next(struct mbs_splitter *ms)
+{
+	const unsigned char	*s = ms->ms_s;
+	size_t			 limit, cut, j, n;
+	uint32_t		 cp;
+	int			 clen;  /* length in bytes of UTF-8 encoded character */
+	int			 isbreak;
+
+	if (ms->ms_start == ms->ms_len)
+		return 0;
+	limit = ms->ms_start + ms->ms_max;
+	if (limit >= ms->ms_len)
+		cut = ms->ms_len;
+	else if (!ms->ms_words)
+		cut = limit;
+	else {
+		/* continue from where the previous piece was looked up */
+		while (ms->ms_pos < limit) {
+			n = ascii_prefix(s + ms->ms_pos, limit - ms->ms_pos);
+			for (j = ms->ms_pos + n; j > ms->ms_pos; j--)
+				if (ascii_isbreak(s[j - 1])) {
+					ms->ms_lastgood = j;
+					break;
+				}
+			if ((ms->ms_pos += n) == limit)
+				break;
+			if (!ms->ms_utf8) {
+				clen = 1;
+				isbreak = isblank(s[ms->ms_pos]) ||
+				    ispunct(s[ms->ms_pos]);
+			} else if ((clen = u8_decode(s + ms->ms_pos,
+			    ms->ms_len - ms->ms_pos, &cp)) == -1) {
+				clen = 1;
+				isbreak = 0;
+			} else
+				isbreak = iswblank((wint_t)cp) ||
+				    iswpunct((wint_t)cp);
+			/* character may last beyond maxbytes */
+			if (ms->ms_pos + (size_t)clen > limit)
+				break;
+			ms->ms_pos += (size_t)clen;
+			if (isbreak)
+				ms->ms_lastgood = ms->ms_pos;
+		}
+		/* bytewise, like before, piece isn't cut after first byte */
+		if (ms->ms_lastgood > ms->ms_start + (ms->ms_utf8 ? 0 : 1))
+			cut = ms->ms_lastgood;
+		else if (ms->ms_pos > ms->ms_start)
+			cut = ms->ms_pos;
+		else
+			cut = limit;  /* maxbytes is less than character */
 	}
-	if (lastgood != NULL)
-		p = lastgood;
-	return (size_t)(p - mbs);
+	n = cut - ms->ms_start;
+	ms->ms_start = cut;
+	if (ms->ms_pos < cut)
+		ms->ms_pos = cut;
+	return n;
 }
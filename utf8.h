@@ -15,4 +15,18 @@
  */
 
 int mbsvalidate(const char *mbs);
-size_t mbsbreak(const char *mbs, size_t maxbytes);
+size_t mbsvalidlen(const char *mbs, size_t len);
+
+struct mbs_splitter {
+	const unsigned char	*ms_s;
+	size_t			 ms_len, ms_max;
+	size_t			 ms_start;	/* of the next piece */
+	size_t			 ms_pos;	/* looked up to */
+	size_t			 ms_lastgood;	/* after last break found */
+	int			 ms_words;
+	int			 ms_utf8;
+};
+
+void mbssplit_init(struct mbs_splitter *ms, const char *mbs, size_t len,
+    size_t maxbytes, int words, int utf8);
+size_t mbssplit_next(struct mbs_splitter *ms);
@@ -0,0 +1,425 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <err.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vis.h>
+
+#include "oicb.h"
+#include "arena.h"
+#include "clock.h"
+#include "private.h"
+#include "session.h"
+#include "utf8.h"
+#include "who.h"
+
+#define WHO_STRCHUNK_SIZE	4096
+
+struct who_strchunk {
+	struct who_strchunk	*ws_next;
+	size_t			 ws_used, ws_size;
+	char			 ws_data[0];
+};
+
+int	who_sort = WhoSortNone;
+
+static uint32_t		 who_hash(const char *str);
+static const char	*who_intern(struct who_table *t, const char *str,
+			    int *width, int *escaped);
+static unsigned int	*who_slot(struct who_table *t, const char *nick);
+static void		 who_index_grow(struct who_table *t);
+static void		 who_free(struct who_table *t);
+static int		 who_cmp(const void *a, const void *b);
+static void		 who_date(long long t, char *buf, size_t bufsz);
+
+static uint32_t
+who_hash(const char *str) {
+	uint32_t	 h = 2166136261U;
+
+	for (; *str; str++)
+		h = (h ^ (unsigned char)*str) * 16777619U;
+	return h;
+}
+
+/*
+ * Returns interned copy of str, sanitized the same way push_stdout_untrusted()
+ * does, and optionally its width in columns.
+ */
+static const char *
+who_intern(struct who_table *t, const char *str, int *width, int *escaped) {
+	struct who_strchunk	*ws;
+	const char		**nstrs, **slot;
+	char			*buf = NULL, *p;
+	size_t			 len, valid, mask, i, nsize;
+	int			 w;
+
+	len = strlen(str);
+	valid = utf8_ready ? mbsvalidlen(str, len) : 0;
+	if (valid < len) {
+		if ((buf = malloc(valid + (len - valid) * 4 + 1)) == NULL)
+			err(1, __func__);
+		memcpy(buf, str, valid);
+		len = valid + (size_t)strvis(buf + valid, str + valid,
+		    VIS_SAFE|VIS_NOSLASH|VIS_NL);
+		if (escaped)
+			*escaped = strcmp(buf, str) != 0;
+		str = buf;
+	} else if (escaped)
+		*escaped = 0;
+
+	if ((t->wt_nstrs + 1) * 2 > t->wt_strsz) {
+		nsize = t->wt_strsz ? t->wt_strsz * 2 : 64;
+		if ((nstrs = calloc(nsize, sizeof(char *))) == NULL)
+			err(1, __func__);
+		for (i = 0; i < t->wt_strsz; i++) {
+			if (t->wt_strs[i] == NULL)
+				continue;
+			slot = &nstrs[who_hash(t->wt_strs[i]) & (nsize - 1)];
+			while (*slot != NULL)
+				if (++slot == nstrs + nsize)
+					slot = nstrs;
+			*slot = t->wt_strs[i];
+		}
+		free(t->wt_strs);
+		t->wt_strs = nstrs;
+		t->wt_strsz = nsize;
+	}
+
+	mask = t->wt_strsz - 1;
+	for (i = who_hash(str) & mask; t->wt_strs[i] != NULL; i = (i + 1) & mask)
+		if (strcmp(t->wt_strs[i], str) == 0)
+			break;
+	if (t->wt_strs[i] == NULL) {
+		ws = t->wt_chunks;
+		if (ws == NULL || ws->ws_size - ws->ws_used < len + 1) {
+			nsize = len + 1 > WHO_STRCHUNK_SIZE ?
+			    len + 1 : WHO_STRCHUNK_SIZE;
+			if ((ws = malloc(sizeof(*ws) + nsize)) == NULL)
+				err(1, __func__);
+			ws->ws_used = 0;
+			ws->ws_size = nsize;
+			ws->ws_next = t->wt_chunks;
+			t->wt_chunks = ws;
+		}
+		p = ws->ws_data + ws->ws_used;
+		memcpy(p, str, len + 1);
+		ws->ws_used += len + 1;
+		t->wt_strs[i] = p;
+		t->wt_nstrs++;
+	}
+	free(buf);
+
+	if (width) {
+		w = utf8_ready ? mbsvalidate(t->wt_strs[i]) : -1;
+		*width = (w == -1) ? (int)len : w;
+	}
+	return t->wt_strs[i];
+}
+
+/*
+ * Returns index slot for given nick: either the one taken by it,
+ * or the free one it should be put in.
+ */
+static unsigned int *
+who_slot(struct who_table *t, const char *nick) {
+	size_t	 i, mask;
+
+	mask = t->wt_indexsz - 1;
+	for (i = who_hash(nick) & mask; t->wt_index[i] != 0; i = (i + 1) & mask)
+		if (strcmp(t->wt_users[t->wt_index[i] - 1].wu_nick, nick) == 0)
+			break;
+	return &t->wt_index[i];
+}
+
+static void
+who_index_grow(struct who_table *t) {
+	size_t	 i;
+
+	if ((t->wt_nusers + 1) * 2 <= t->wt_indexsz)
+		return;
+	t->wt_indexsz = t->wt_indexsz ? t->wt_indexsz * 2 : 64;
+	free(t->wt_index);
+	if ((t->wt_index = calloc(t->wt_indexsz, sizeof(unsigned int))) == NULL)
+		err(1, __func__);
+	for (i = 0; i < t->wt_nusers; i++)
+		*who_slot(t, t->wt_users[i].wu_nick) = (unsigned int)i + 1;
+}
+
+static void
+who_free(struct who_table *t) {
+	struct who_strchunk	*ws;
+
+	if (t == NULL)
+		return;
+	while ((ws = t->wt_chunks) != NULL) {
+		t->wt_chunks = ws->ws_next;
+		free(ws);
+	}
+	free(t->wt_strs);
+	free(t->wt_index);
+	free(t->wt_users);
+	free(t);
+}
+
+/*
+ * Adds user from "wl" record to the listing being collected:
+ *
+ * moderator ("m" or else)
+ * nickname
+ * idle time
+ * 0 (always zero)
+ * signon timestamp (ex.: 1460893072)
+ * user (ident result)
+ * IP address/domain
+ */
+void
+who_add(struct icb_session *s, char *msg) {
+	struct who_table	*t;
+	struct who_user		*u;
+	unsigned int		*slot;
+	char			*fields[7], *p, *endptr;
+	size_t			 nf;
+
+	for (nf = 0, p = msg; nf < 7 && p != NULL; nf++) {
+		fields[nf] = p;
+		if ((p = strchr(p, '\001')) != NULL)
+			*p++ = '\0';
+	}
+	if (nf < 2) {
+		warnx("invalid user info line received, ignoring");
+		return;
+	}
+
+	if ((t = s->is_who_building) == NULL) {
+		if ((t = calloc(1, sizeof(struct who_table))) == NULL)
+			err(1, __func__);
+		s->is_who_building = t;
+	}
+	if (t->wt_nusers == t->wt_size) {
+		t->wt_size = t->wt_size ? t->wt_size * 2 : 32;
+		u = reallocarray(t->wt_users, t->wt_size, sizeof(*u));
+		if (u == NULL)
+			err(1, __func__);
+		t->wt_users = u;
+	}
+	who_index_grow(t);
+
+	u = &t->wt_users[t->wt_nusers];
+	memset(u, 0, sizeof(*u));
+	u->wu_nick = who_intern(t, fields[1], &u->wu_nickwidth,
+	    &u->wu_escaped);
+	slot = who_slot(t, u->wu_nick);
+	if (*slot != 0) {
+		// listed twice, keep the latest data but the first place
+		*(u = &t->wt_users[*slot - 1]) = t->wt_users[t->wt_nusers];
+	} else
+		*slot = (unsigned int)++t->wt_nusers;
+	if (!u->wu_escaped)
+		nick_seen(u->wu_nick);
+
+	u->wu_moderator = strcmp(fields[0], "m") == 0;
+	u->wu_idle = (nf > 2) ? strtoll(fields[2], NULL, 10) : -1;
+	u->wu_signon = -1;
+	u->wu_ident = u->wu_host = NULL;
+	if (nf > 4) {
+		u->wu_signon = strtoll(fields[4], &endptr, 10);
+		if (*endptr != '\0')
+			u->wu_signon = -1;
+	}
+	if (u->wu_signon == -1)
+		return;
+	if (nf > 5)
+		u->wu_ident = who_intern(t, fields[5], &u->wu_identwidth, NULL);
+	if (nf > 6)
+		u->wu_host = who_intern(t, fields[6], NULL, NULL);
+}
+
+static int
+who_cmp(const void *a, const void *b) {
+	const struct who_user	*ua = a, *ub = b;
+	long long		 va, vb;
+
+	if (who_sort == WhoSortIdle) {
+		va = ua->wu_idle;
+		vb = ub->wu_idle;
+	} else {
+		va = ua->wu_signon;
+		vb = ub->wu_signon;
+	}
+	if (va != vb)
+		return (va < vb) ? -1 : 1;
+	return strcmp(ua->wu_nick, ub->wu_nick);
+}
+
+/*
+ * Users are usually sorted or bunched by signon time, so localtime_r(3)
+ * results are reused for the whole hour.
+ */
+static void
+who_date(long long t, char *buf, size_t bufsz) {
+	static long long	 hour_start = LLONG_MIN;
+	static struct tm	 tm;
+	time_t			 tt;
+
+	if (hour_start == LLONG_MIN || t < hour_start ||
+	    t >= hour_start + 3600) {
+		tt = (time_t)t;
+		localtime_r(&tt, &tm);
+		hour_start = t - tm.tm_min * 60 - tm.tm_sec;
+	}
+	snprintf(buf, bufsz, " %d-%02d-%02d %02d:%02d:%02d",
+	    tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+	    (int)((t - hour_start) / 60), (int)((t - hour_start) % 60));
+}
+
+/*
+ * Displays users collected since the last call, each one in a single
+ * line, with columns aligned.
+ */
+void
+who_flush(struct icb_session *s) {
+	struct who_table	*t;
+	struct who_user		*u, *users, *end;
+	char			 idle[32], date[32];
+	int			 nickw = 0, idlew = 0, identw = 0, n;
+
+	if ((t = s->is_who_building) == NULL || t->wt_shown == t->wt_nusers)
+		return;
+	users = t->wt_users + t->wt_shown;
+	end = t->wt_users + t->wt_nusers;
+	if (who_sort != WhoSortNone) {
+		qsort(users, (size_t)(end - users), sizeof(*users), who_cmp);
+		for (u = users; u < end; u++)
+			*who_slot(t, u->wu_nick) =
+			    (unsigned int)(u - t->wt_users) + 1;
+	}
+
+	for (u = users; u < end; u++) {
+		if (u->wu_nickwidth > nickw)
+			nickw = u->wu_nickwidth;
+		if (u->wu_idle != -1 &&
+		    (n = snprintf(NULL, 0, "%lld", u->wu_idle)) > idlew)
+			idlew = n;
+		if (u->wu_host != NULL && u->wu_identwidth > identw)
+			identw = u->wu_identwidth;
+	}
+
+	for (u = users; u < end; u++) {
+		idle[0] = date[0] = '\0';
+		if (u->wu_idle != -1)
+			snprintf(idle, sizeof(idle), " %*llds", idlew, u->wu_idle);
+		if (u->wu_signon != -1)
+			who_date(u->wu_signon, date, sizeof(date));
+		push_stdout("%c%s%*s%s%s%s%s%*s%s%s\n",
+		    u->wu_moderator ? '*' : ' ', u->wu_nick,
+		    (u->wu_idle != -1) ? nickw - u->wu_nickwidth : 0, "",
+		    idle, date,
+		    u->wu_ident ? "  " : "", u->wu_ident ? u->wu_ident : "",
+		    u->wu_host ? identw - u->wu_identwidth : 0, "",
+		    u->wu_host ? "  " : "", u->wu_host ? u->wu_host : "");
+	}
+	t->wt_shown = t->wt_nusers;
+}
+
+/*
+ * Called at the end of any command output; when users were listed,
+ * the listing replaces the previous one.
+ */
+void
+who_end(struct icb_session *s) {
+	if (s->is_who_building == NULL)
+		return;
+	who_flush(s);
+	who_free(s->is_who);
+	s->is_who = s->is_who_building;
+	s->is_who_building = NULL;
+	s->is_who->wt_time = icb_now.ic_time;
+}
+
+/*
+ * Drops listing being collected, and the complete one too if asked.
+ */
+void
+who_reset(struct icb_session *s, int all) {
+	who_free(s->is_who_building);
+	s->is_who_building = NULL;
+	if (all) {
+		who_free(s->is_who);
+		s->is_who = NULL;
+	}
+}
+
+/*
+ * Looks up user in the last complete listing.
+ */
+const struct who_user *
+who_find(struct icb_session *s, const char *nick) {
+	struct who_table	*t;
+	unsigned int		*slot;
+
+	if ((t = s->is_who) == NULL)
+		return NULL;
+	slot = who_slot(t, nick);
+	return (*slot != 0) ? &t->wt_users[*slot - 1] : NULL;
+}
+
+/*
+ * Tells that private message is going to user who was idle for long
+ * in the last complete listing, so the answer may take a while.
+ * Users not listed are left for the server to complain about.
+ */
+void
+who_idle_hint(struct icb_session *s, const char *nick) {
+	const struct who_user	*u;
+	long long		 idle;
+
+	if ((u = who_find(s, nick)) == NULL || u->wu_idle == -1)
+		return;
+	idle = u->wu_idle + (long long)(icb_now.ic_time - s->is_who->wt_time);
+	if (idle < WHO_IDLE_HINT)
+		return;
+	push_stdout("%s is idle for %lld minutes, according to the last"
+	    " /w output\n", u->wu_nick, idle / 60);
+}
+
+/*
+ * Returns next nick from the last complete listing starting with prefix,
+ * looking from the user at *pos, and advances *pos; NULL if none left.
+ * Nicks that cannot be typed in as shown are skipped.
+ */
+const char *
+who_complete(struct icb_session *s, const char *prefix, size_t *pos) {
+	struct who_table	*t;
+	struct who_user		*u;
+	size_t			 len;
+
+	if ((t = s->is_who) == NULL)
+		return NULL;
+	len = strlen(prefix);
+	while (*pos < t->wt_nusers) {
+		u = &t->wt_users[(*pos)++];
+		if (!u->wu_escaped && strncmp(u->wu_nick, prefix, len) == 0)
+			return u->wu_nick;
+	}
+	return NULL;
+}
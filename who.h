@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef OICB_WHO_H
+#define OICB_WHO_H
+
+struct icb_session;
+
+/*
+ * Users listed by server in "wl" records, collected until the end of
+ * command output and then displayed at once. The last complete listing
+ * is kept for nick completion and presence checks.
+ *
+ * Strings are interned and already sanitized for display, so the same
+ * idents and hosts are stored and escaped only once.
+ */
+struct who_user {
+	const char	*wu_nick;
+	const char	*wu_ident;	// NULL if not given
+	const char	*wu_host;	// NULL if not given
+	long long	 wu_idle;	// in seconds, -1 if not given
+	long long	 wu_signon;	// -1 if not given or invalid
+	int		 wu_nickwidth;	// in columns
+	int		 wu_identwidth;
+	int		 wu_moderator;
+	int		 wu_escaped;	// nick isn't shown as is
+};
+
+struct who_strchunk;
+struct who_table {
+	struct who_user		*wt_users;
+	size_t			 wt_nusers, wt_size;
+	size_t			 wt_shown;	// users displayed already
+	time_t			 wt_time;	// when listing was complete
+
+	unsigned int		*wt_index;	// user number + 1, by nick
+	size_t			 wt_indexsz;	// power of two
+
+	const char		**wt_strs;	// interned strings
+	size_t			 wt_nstrs, wt_strsz;	// power of two
+	struct who_strchunk	*wt_chunks;
+};
+
+enum WhoSort {
+	WhoSortNone,	// as sent by server
+	WhoSortIdle,
+	WhoSortSignon,
+};
+
+void			 who_add(struct icb_session *s, char *msg);
+void			 who_flush(struct icb_session *s);
+void			 who_end(struct icb_session *s);
+void			 who_reset(struct icb_session *s, int all);
+const struct who_user	*who_find(struct icb_session *s, const char *nick);
+const char		*who_complete(struct icb_session *s, const char *prefix,
+			    size_t *pos);
+void			 who_idle_hint(struct icb_session *s,
+			    const char *nick);
+
+#define WHO_IDLE_HINT	600	// seconds, see who_idle_hint()
+
+extern int	 who_sort;
+
+#endif // OICB_WHO_H
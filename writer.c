@@ -0,0 +1,375 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The ring is a power of two sized byte array with free running head
+ * (owned by main thread) and tail (owned by writer) counters. Records
+ * are a header followed by payload, both may wrap around the end.
+ *
+ * Nobody takes the mutex unless the other side is sleeping: writer
+ * sleeps when ring is empty, main thread sleeps only when ring is full
+ * and blocking is requested.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "writer.h"
+
+enum writer_op {
+	WriterOpen,
+	WriterWrite,
+	WriterSync,
+	WriterClose,
+	WriterRotate,
+	WriterQuit,
+};
+
+struct writer_rec {
+	uint32_t	 wr_op;
+	int32_t		 wr_slot;
+	uint32_t	 wr_len;	// of payload following
+};
+
+static char		*ring;
+static size_t		 ring_size, ring_mask;
+static _Atomic size_t	 ring_head, ring_tail;
+static _Atomic int	 writer_sleeping, main_sleeping;
+static _Atomic int	 writer_error;
+static pthread_mutex_t	 writer_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 writer_cv = PTHREAD_COND_INITIALIZER;   // got data
+static pthread_cond_t	 main_cv = PTHREAD_COND_INITIALIZER;     // got space
+static pthread_t	 writer_thread;
+static int		 writer_running;
+static int		*writer_fds;
+static int		 writer_nslots;
+
+static void	*writer_main(void *arg);
+static int	 writer_push(enum writer_op op, int slot, const void *data,
+		             size_t len, int block);
+static void	 ring_put(size_t pos, const void *data, size_t len);
+static void	 ring_get(size_t pos, void *data, size_t len);
+static void	 ring_write(int fd, size_t pos, size_t len);
+
+
+void
+writer_start(size_t ringsize, int nslots) {
+	int	 i, ec;
+
+	ring_size = 4096;
+	while (ring_size < ringsize)
+		ring_size *= 2;
+	ring_mask = ring_size - 1;
+	if ((ring = malloc(ring_size)) == NULL)
+		err(1, __func__);
+	if ((writer_fds = calloc(nslots, sizeof(int))) == NULL)
+		err(1, __func__);
+	for (i = 0; i < nslots; i++)
+		writer_fds[i] = -1;
+	writer_nslots = nslots;
+	if ((ec = pthread_create(&writer_thread, NULL, writer_main, NULL)) != 0) {
+		errno = ec;
+		err(1, "pthread_create");
+	}
+	writer_running = 1;
+}
+
+/*
+ * Waits for all queued records to be processed, then stops the thread.
+ */
+void
+writer_stop(void) {
+	if (!writer_running)
+		return;
+	writer_push(WriterQuit, -1, NULL, 0, 1);
+	pthread_join(writer_thread, NULL);
+	writer_running = 0;
+	free(ring);
+	free(writer_fds);
+}
+
+void
+writer_open(int slot, const char *path) {
+	writer_push(WriterOpen, slot, path, strlen(path) + 1, 1);
+}
+
+/*
+ * Returns -1 if data was dropped because the ring is full.
+ */
+int
+writer_write(int slot, const char *data, size_t len, int block) {
+	size_t	 chunk, maxchunk = ring_size / 2;
+
+	if (!block && len > maxchunk)
+		return -1;
+	while (len > 0) {
+		chunk = (len > maxchunk) ? maxchunk : len;
+		if (writer_push(WriterWrite, slot, data, chunk, block) == -1)
+			return -1;
+		data += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+void
+writer_sync(int slot) {
+	writer_push(WriterSync, slot, NULL, 0, 1);
+}
+
+void
+writer_close(int slot) {
+	writer_push(WriterClose, slot, NULL, 0, 1);
+}
+
+/*
+ * Renames log after everything queued before is written, then passes
+ * the segment for compression. The log should be closed already.
+ */
+void
+writer_rotate(const char *path, const char *segment) {
+	char	 names[2 * PATH_MAX];
+	size_t	 len1, len2;
+
+	len1 = strlen(path) + 1;
+	len2 = strlen(segment) + 1;
+	if (len1 + len2 > sizeof(names))
+		return;
+	memcpy(names, path, len1);
+	memcpy(names + len1, segment, len2);
+	writer_push(WriterRotate, -1, names, len1 + len2, 1);
+}
+
+/*
+ * Waits until everything queued so far reached the files.
+ */
+void
+writer_drain(void) {
+	size_t	 head;
+
+	if (!writer_running)
+		return;
+	head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+	if (atomic_load(&ring_tail) == head)
+		return;
+	pthread_mutex_lock(&writer_mtx);
+	atomic_store(&main_sleeping, 1);
+	while (atomic_load(&ring_tail) != head)
+		pthread_cond_wait(&main_cv, &writer_mtx);
+	atomic_store(&main_sleeping, 0);
+	pthread_mutex_unlock(&writer_mtx);
+}
+
+/*
+ * Returns non-zero once the writer failed to open a file.
+ */
+int
+writer_failed(void) {
+	return atomic_load(&writer_error);
+}
+
+static void
+ring_put(size_t pos, const void *data, size_t len) {
+	size_t	 off = pos & ring_mask, first;
+
+	first = ring_size - off;
+	if (first > len)
+		first = len;
+	memcpy(ring + off, data, first);
+	memcpy(ring, (const char *)data + first, len - first);
+}
+
+static void
+ring_get(size_t pos, void *data, size_t len) {
+	size_t	 off = pos & ring_mask, first;
+
+	first = ring_size - off;
+	if (first > len)
+		first = len;
+	memcpy(data, ring + off, first);
+	memcpy((char *)data + first, ring, len - first);
+}
+
+static int
+writer_push(enum writer_op op, int slot, const void *data, size_t len,
+    int block) {
+	struct writer_rec	 rec;
+	size_t			 head, need;
+
+	need = sizeof(rec) + len;
+	if (need > ring_size)
+		errx(1, "%s: record too big (internal error)", __func__);
+	head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+	if (ring_size - (head - atomic_load(&ring_tail)) < need) {
+		if (!block)
+			return -1;
+		pthread_mutex_lock(&writer_mtx);
+		atomic_store(&main_sleeping, 1);
+		while (ring_size - (head - atomic_load(&ring_tail)) < need)
+			pthread_cond_wait(&main_cv, &writer_mtx);
+		atomic_store(&main_sleeping, 0);
+		pthread_mutex_unlock(&writer_mtx);
+	}
+
+	rec.wr_op = op;
+	rec.wr_slot = slot;
+	rec.wr_len = (uint32_t)len;
+	ring_put(head, &rec, sizeof(rec));
+	if (len)
+		ring_put(head + sizeof(rec), data, len);
+	atomic_store(&ring_head, head + need);
+
+	if (atomic_load(&writer_sleeping)) {
+		pthread_mutex_lock(&writer_mtx);
+		pthread_cond_signal(&writer_cv);
+		pthread_mutex_unlock(&writer_mtx);
+	}
+	return 0;
+}
+
+static void
+ring_write(int fd, size_t pos, size_t len) {
+	struct iovec	 iov[2];
+	size_t		 off = pos & ring_mask;
+	ssize_t		 n;
+	int		 iovcnt;
+
+	iov[0].iov_base = ring + off;
+	iov[0].iov_len = ring_size - off;
+	if (iov[0].iov_len >= len) {
+		iov[0].iov_len = len;
+		iovcnt = 1;
+	} else {
+		iov[1].iov_base = ring;
+		iov[1].iov_len = len - iov[0].iov_len;
+		iovcnt = 2;
+	}
+
+	while (iovcnt > 0) {
+		if ((n = writev(fd, iov, iovcnt)) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("cannot write history");
+			return;
+		}
+		while (iovcnt > 0 && (size_t)n >= iov[0].iov_len) {
+			n -= iov[0].iov_len;
+			iov[0] = iov[1];
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov[0].iov_base = (char *)iov[0].iov_base + n;
+			iov[0].iov_len -= n;
+		}
+	}
+}
+
+static void *
+writer_main(void *arg) {
+	struct writer_rec	 rec;
+	size_t			 tail;
+	char			 path[PATH_MAX], names[2 * PATH_MAX];
+	int			*fdp;
+
+	(void)arg;
+	tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+	for (;;) {
+		if (atomic_load(&ring_head) == tail) {
+			pthread_mutex_lock(&writer_mtx);
+			atomic_store(&writer_sleeping, 1);
+			while (atomic_load(&ring_head) == tail)
+				pthread_cond_wait(&writer_cv, &writer_mtx);
+			atomic_store(&writer_sleeping, 0);
+			pthread_mutex_unlock(&writer_mtx);
+		}
+
+		ring_get(tail, &rec, sizeof(rec));
+		fdp = NULL;
+		if (rec.wr_slot >= 0 && rec.wr_slot < writer_nslots)
+			fdp = &writer_fds[rec.wr_slot];
+
+		switch (rec.wr_op) {
+		case WriterOpen:
+			if (fdp == NULL || rec.wr_len > sizeof(path))
+				break;
+			ring_get(tail + sizeof(rec), path, rec.wr_len);
+			path[rec.wr_len - 1] = '\0';
+			if (*fdp != -1)
+				close(*fdp);
+			*fdp = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0666);
+			if (*fdp == -1) {
+				warn("cannot open '%s'", path);
+				atomic_store(&writer_error, 1);
+			}
+			break;
+
+		case WriterWrite:
+			if (fdp != NULL && *fdp != -1)
+				ring_write(*fdp, tail + sizeof(rec), rec.wr_len);
+			break;
+
+		case WriterSync:
+			if (fdp != NULL && *fdp != -1 && fsync(*fdp) == -1)
+				warn("fsync");
+			break;
+
+		case WriterClose:
+			if (fdp != NULL && *fdp != -1) {
+				close(*fdp);
+				*fdp = -1;
+			}
+			break;
+
+		case WriterRotate:
+			if (rec.wr_len > sizeof(names))
+				break;
+			ring_get(tail + sizeof(rec), names, rec.wr_len);
+			names[rec.wr_len - 1] = '\0';
+			if (rename(names, names + strlen(names) + 1) == -1) {
+				if (errno != ENOENT)
+					warn("cannot rotate %s", names);
+			} else
+				archive_queue(names + strlen(names) + 1);
+			break;
+
+		case WriterQuit:
+			for (rec.wr_slot = 0; rec.wr_slot < writer_nslots; rec.wr_slot++)
+				if (writer_fds[rec.wr_slot] != -1)
+					close(writer_fds[rec.wr_slot]);
+			return NULL;
+		}
+
+		tail += sizeof(rec) + rec.wr_len;
+		atomic_store(&ring_tail, tail);
+		if (atomic_load(&main_sleeping)) {
+			pthread_mutex_lock(&writer_mtx);
+			pthread_cond_signal(&main_cv);
+			pthread_mutex_unlock(&writer_mtx);
+		}
+	}
+}
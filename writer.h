@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2014-2020 Vadim Zhukov <zhuk@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef OICB_WRITER_H
+#define OICB_WRITER_H
+
+/*
+ * Background thread doing history file I/O, fed through a single
+ * producer, single consumer ring. Files are referred to by slot numbers
+ * chosen by the caller, the thread keeps the real descriptors.
+ */
+
+void	 writer_start(size_t ringsize, int nslots);
+void	 writer_stop(void);
+void	 writer_open(int slot, const char *path);
+int	 writer_write(int slot, const char *data, size_t len, int block);
+void	 writer_sync(int slot);
+void	 writer_close(int slot);
+void	 writer_rotate(const char *path, const char *segment);
+void	 writer_drain(void);
+int	 writer_failed(void);
+
+#endif // OICB_WRITER_H